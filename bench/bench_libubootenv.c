@@ -0,0 +1,461 @@
+/*
+ * (C) Copyright 2026
+ * Stefano Babic, <stefano.babic@swupdate.org>
+ *
+ * SPDX-License-Identifier:     LGPL-2.1-or-later
+ */
+
+/**
+ * @file bench_libubootenv.c
+ *
+ * @brief Latency of the library operations
+ *
+ * A synthetic environment with the requested size and number of
+ * variables is stored on each backend (files, simulated NOR and
+ * NAND flash) in a scratch directory, then open, get, set, batch
+ * set, iterate, serialize, store, deferred store and close are
+ * measured one by one. A boot counter is then incremented through
+ * open, set and store and in place with libuboot_env_increment().
+ *
+ * Results are printed one line per backend and operation as
+ * key=value pairs, times in microseconds, with the erases done
+ * on the flash during the operation.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "libuboot.h"
+
+#define BATCH_VARS	100
+/* deferred stores: a burst of requests is stored at most each 100 ms */
+#define DEBOUNCE_MS	10
+#define MAXDELAY_MS	100
+
+static const char *workdir = "/tmp";
+static const char *backends = "file,nor,nand";
+static const char *simopts = "";
+static size_t envsize = 0x4000;
+static unsigned int nvars = 100;
+static unsigned int valuelen = 32;
+static unsigned int iterations = 1000;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static unsigned long long flash_erases(struct uboot_ctx *ctx)
+{
+	struct libuboot_flash_counters counters;
+	unsigned long long erases = 0;
+	unsigned int i;
+
+	for (i = 0; i < 2; i++)
+		if (!libuboot_get_flash_counters(ctx, i, &counters))
+			erases += counters.erases;
+
+	return erases;
+}
+
+static void report(const char *backend, const char *op, uint64_t *samples,
+		   unsigned int n, unsigned long long erases)
+{
+	uint64_t sum = 0;
+	unsigned int i;
+
+	if (!n)
+		return;
+
+	qsort(samples, n, sizeof(*samples), cmp_u64);
+	for (i = 0; i < n; i++)
+		sum += samples[i];
+
+	fprintf(stdout, "backend=%s op=%s size=%zu vars=%u iterations=%u "
+		"mean_us=%.3f p50_us=%.3f p99_us=%.3f min_us=%.3f max_us=%.3f "
+		"ops_per_s=%.1f erases=%llu\n",
+		backend, op, envsize, nvars, n,
+		sum / 1e3 / n, samples[n / 2] / 1e3,
+		samples[(n * 99) / 100] / 1e3, samples[0] / 1e3,
+		samples[n - 1] / 1e3, n / (sum / 1e9), erases);
+}
+
+static char *make_vars(unsigned int first, unsigned int count, unsigned int gen,
+		       size_t *len)
+{
+	char *text = NULL;
+	FILE *fp;
+	unsigned int i;
+
+	fp = open_memstream(&text, len);
+	if (!fp)
+		return NULL;
+	for (i = first; i < first + count; i++)
+		fprintf(fp, "var%05u=%0*u\n", i, (int)valuelen, i + gen);
+	fclose(fp);
+
+	return text;
+}
+
+/*
+ * Configuration with two copies on the backend, sim devices
+ * get an erase block as large as a copy
+ */
+static int write_config(const char *backend, char *cfgname, size_t len)
+{
+	char path[512];
+	size_t sector;
+	FILE *fp;
+	int i, fd;
+
+	snprintf(cfgname, len, "%s/bench-%s.config", workdir, backend);
+	fp = fopen(cfgname, "w");
+	if (!fp)
+		return -errno;
+
+	if (!strcmp(backend, "file")) {
+		for (i = 0; i < 2; i++) {
+			snprintf(path, sizeof(path), "%s/bench-env%d", workdir, i);
+			if (truncate(path, envsize) && (errno != ENOENT ||
+			    (fd = open(path, O_WRONLY | O_CREAT, 0644)) < 0 ||
+			    ftruncate(fd, envsize) || close(fd))) {
+				fclose(fp);
+				return -errno;
+			}
+			fprintf(fp, "%s 0x0 0x%zx\n", path, envsize);
+		}
+	} else {
+		sector = (envsize + 0xfff) & ~(size_t)0xfff;
+		fprintf(fp, "sim:%s,erasesize=0x%zx%s%s:%s/bench-%s.img 0x0 0x%zx 0x%zx\n",
+			backend, sector, *simopts ? "," : "", simopts,
+			workdir, backend, envsize, sector);
+		fprintf(fp, "sim:%s,erasesize=0x%zx%s%s:%s/bench-%s.img 0x%zx 0x%zx 0x%zx\n",
+			backend, sector, *simopts ? "," : "", simopts,
+			workdir, backend, sector, envsize, sector);
+	}
+
+	return fclose(fp) ? -EIO : 0;
+}
+
+static int prepare(struct uboot_ctx *ctx)
+{
+	char *text;
+	size_t len;
+	int ret, i;
+
+	/* a fresh storage has no valid copy */
+	libuboot_open(ctx);
+	text = make_vars(0, nvars, 0, &len);
+	if (!text)
+		return -ENOMEM;
+	ret = libuboot_load_env_mem(ctx, text, len);
+	free(text);
+
+	/* both copies valid, as on a device in use */
+	for (i = 0; !ret && i < 2; i++)
+		ret = libuboot_env_store(ctx);
+	libuboot_close(ctx);
+
+	return ret;
+}
+
+static int run_backend(const char *backend, uint64_t *samples)
+{
+	char cfgname[512], name[16], value[64];
+	struct uboot_ctx *ctxlist = NULL, *ctx;
+	char *text, *v, *image;
+	unsigned int i, count;
+	size_t len;
+	unsigned long long erases;
+	uint64_t t;
+	void *tmp;
+	int ret;
+
+	ret = write_config(backend, cfgname, sizeof(cfgname));
+	if (!ret)
+		ret = libuboot_read_config_ext(&ctxlist, cfgname);
+	if (ret) {
+		fprintf(stderr, "%s: cannot set up the configuration: %s\n",
+			backend, strerror(-ret));
+		return ret;
+	}
+	ctx = ctxlist;
+
+	ret = prepare(ctx);
+	if (ret) {
+		fprintf(stderr, "%s: cannot store the environment: %s\n",
+			backend, strerror(-ret));
+		goto out;
+	}
+
+	/* open and close, each measured alone */
+	erases = flash_erases(ctx);
+	for (i = 0; i < iterations; i++) {
+		t = now_ns();
+		ret = libuboot_open(ctx);
+		samples[i] = now_ns() - t;
+		if (ret)
+			goto out;
+		if (i < iterations - 1)
+			libuboot_close(ctx);
+	}
+	report(backend, "open", samples, iterations, flash_erases(ctx) - erases);
+
+	erases = flash_erases(ctx);
+	for (i = 0; i < iterations; i++) {
+		snprintf(name, sizeof(name), "var%05u", (i * 7919) % nvars);
+		t = now_ns();
+		v = libuboot_get_env(ctx, name);
+		samples[i] = now_ns() - t;
+		free(v);
+	}
+	report(backend, "get", samples, iterations, flash_erases(ctx) - erases);
+
+	erases = flash_erases(ctx);
+	for (i = 0; i < iterations; i++) {
+		snprintf(name, sizeof(name), "var%05u", (i * 7919) % nvars);
+		snprintf(value, sizeof(value), "%0*u", (int)valuelen, i);
+		t = now_ns();
+		ret = libuboot_set_env(ctx, name, value);
+		samples[i] = now_ns() - t;
+		if (ret)
+			goto out;
+	}
+	report(backend, "set", samples, iterations, flash_erases(ctx) - erases);
+
+	count = nvars < BATCH_VARS ? nvars : BATCH_VARS;
+	erases = flash_erases(ctx);
+	for (i = 0; i < iterations; i++) {
+		text = make_vars((i * count) % (nvars - count + 1), count, i + 1, &len);
+		if (!text) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		t = now_ns();
+		ret = libuboot_load_env_mem(ctx, text, len);
+		samples[i] = now_ns() - t;
+		free(text);
+		if (ret)
+			goto out;
+	}
+	report(backend, "batch_set", samples, iterations, flash_erases(ctx) - erases);
+
+	erases = flash_erases(ctx);
+	for (i = 0; i < iterations; i++) {
+		t = now_ns();
+		tmp = NULL;
+		while ((tmp = libuboot_iterator(ctx, tmp)) != NULL)
+			if (!libuboot_getvalue(tmp))
+				break;
+		samples[i] = now_ns() - t;
+	}
+	report(backend, "iterate", samples, iterations, flash_erases(ctx) - erases);
+
+	image = malloc(envsize);
+	if (!image) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	erases = flash_erases(ctx);
+	for (i = 0; i < iterations; i++) {
+		t = now_ns();
+		ret = libuboot_serialize_image(ctx, image, envsize);
+		samples[i] = now_ns() - t;
+		if (ret < 0)
+			break;
+	}
+	free(image);
+	if (ret < 0)
+		goto out;
+	report(backend, "serialize", samples, iterations, flash_erases(ctx) - erases);
+
+	erases = flash_erases(ctx);
+	for (i = 0; i < iterations; i++) {
+		snprintf(value, sizeof(value), "%0*u", (int)valuelen, i);
+		libuboot_set_env(ctx, "var00000", value);
+		t = now_ns();
+		ret = libuboot_env_store(ctx);
+		samples[i] = now_ns() - t;
+		if (ret)
+			goto out;
+	}
+	report(backend, "store", samples, iterations, flash_erases(ctx) - erases);
+
+	/* the same changes, coalesced */
+	libuboot_set_store_delay(ctx, DEBOUNCE_MS, MAXDELAY_MS);
+	erases = flash_erases(ctx);
+	for (i = 0; i < iterations; i++) {
+		snprintf(value, sizeof(value), "%0*u", (int)valuelen, i);
+		libuboot_set_env(ctx, "var00000", value);
+		t = now_ns();
+		ret = libuboot_env_store_deferred(ctx);
+		samples[i] = now_ns() - t;
+		if (ret)
+			goto out;
+	}
+	ret = libuboot_env_flush(ctx);
+	libuboot_set_store_delay(ctx, 0, 0);
+	if (ret)
+		goto out;
+	report(backend, "store_deferred", samples, iterations, flash_erases(ctx) - erases);
+
+	erases = flash_erases(ctx);
+	for (i = 0; i < iterations; i++) {
+		if (i) {
+			ret = libuboot_open(ctx);
+			if (ret)
+				goto out;
+		}
+		t = now_ns();
+		libuboot_close(ctx);
+		samples[i] = now_ns() - t;
+	}
+	report(backend, "close", samples, iterations, flash_erases(ctx) - erases);
+
+	/* a boot counter, as a full update and patched in place */
+	ret = libuboot_open(ctx);
+	if (!ret)
+		ret = libuboot_set_env(ctx, "bootcount", "0");
+	if (!ret)
+		ret = libuboot_env_store(ctx);
+	libuboot_close(ctx);
+	if (ret)
+		goto out;
+	erases = flash_erases(ctx);
+	for (i = 0; i < iterations; i++) {
+		t = now_ns();
+		ret = libuboot_open(ctx);
+		v = ret ? NULL : libuboot_get_env(ctx, "bootcount");
+		if (v) {
+			snprintf(value, sizeof(value), "%lu", strtoul(v, NULL, 10) + 1);
+			free(v);
+			ret = libuboot_set_env(ctx, "bootcount", value);
+			if (!ret)
+				ret = libuboot_env_store(ctx);
+		}
+		libuboot_close(ctx);
+		samples[i] = now_ns() - t;
+		if (ret)
+			goto out;
+	}
+	report(backend, "bootcount", samples, iterations, flash_erases(ctx) - erases);
+
+	erases = flash_erases(ctx);
+	for (i = 0; i < iterations; i++) {
+		t = now_ns();
+		ret = libuboot_env_increment(ctx, "bootcount", 1, NULL);
+		samples[i] = now_ns() - t;
+		if (ret)
+			goto out;
+	}
+	report(backend, "increment", samples, iterations, flash_erases(ctx) - erases);
+	ret = 0;
+
+out:
+	if (ret)
+		fprintf(stderr, "%s: benchmark failed: %s\n", backend, strerror(ret < 0 ? -ret : ret));
+	libuboot_close(ctx);
+	libuboot_exit(ctxlist);
+	unlink(cfgname);
+	snprintf(cfgname + strlen(cfgname), sizeof(cfgname) - strlen(cfgname), ".cache");
+	unlink(cfgname);
+
+	return ret;
+}
+
+static void usage(const char *program)
+{
+	fprintf(stdout, "Usage %s [OPTION]\n", program);
+	fprintf(stdout,
+		" -d <dir>      : scratch directory (default: /tmp)\n"
+		" -b <list>     : backends among file,nor,nand (default: all)\n"
+		" -s <bytes>    : size of the environment (default: 0x4000)\n"
+		" -v <vars>     : variables in the environment (default: 100)\n"
+		" -l <bytes>    : length of the values (default: 32)\n"
+		" -n <count>    : iterations of each operation (default: 1000)\n"
+		" -o <options>  : options of the simulated flash, for example\n"
+		"                 erase_us=1000,program_us=50\n");
+}
+
+int main(int argc, char **argv)
+{
+	char *list, *backend, *saveptr;
+	uint64_t *samples;
+	int c, ret = 0;
+
+	while ((c = getopt(argc, argv, "d:b:s:v:l:n:o:h")) != EOF) {
+		switch (c) {
+		case 'd':
+			workdir = optarg;
+			break;
+		case 'b':
+			backends = optarg;
+			break;
+		case 's':
+			envsize = strtoul(optarg, NULL, 0);
+			break;
+		case 'v':
+			nvars = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			valuelen = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			simopts = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			exit(c == 'h' ? 0 : 1);
+		}
+	}
+
+	if (!nvars || !iterations || !envsize || valuelen > 48) {
+		usage(argv[0]);
+		exit(1);
+	}
+
+	samples = calloc(iterations, sizeof(*samples));
+	list = strdup(backends);
+	if (!samples || !list)
+		exit(1);
+
+	for (backend = strtok_r(list, ",", &saveptr); backend;
+	     backend = strtok_r(NULL, ",", &saveptr)) {
+		if (strcmp(backend, "file") && strcmp(backend, "nor") &&
+		    strcmp(backend, "nand")) {
+			fprintf(stderr, "Unknown backend %s\n", backend);
+			ret = 1;
+			continue;
+		}
+		if (run_backend(backend, samples))
+			ret = 1;
+	}
+
+	free(list);
+	free(samples);
+
+	return ret;
+}
@@ -0,0 +1,467 @@
+/*
+ * (C) Copyright 2026
+ * Stefano Babic, <stefano.babic@swupdate.org>
+ *
+ * SPDX-License-Identifier:     LGPL-2.1-or-later
+ */
+
+/**
+ * @file bench_lock.c
+ *
+ * @brief Lock contention between processes sharing an environment
+ *
+ * Readers and writers are forked against one file-backed environment
+ * and run in the two ways the library can be locked:
+ *
+ *	session	each iteration reads the configuration, opens, gets or
+ *		sets and stores, then closes, as fw_printenv and
+ *		fw_setenv do. The lock is held from open to close.
+ *	refresh	the process opens once and drops the lock, readers
+ *		call libuboot_refresh() and writers take the lock just
+ *		around refresh, set and store, as a long running
+ *		process would do.
+ *
+ * Every writer owns a variable and sets it to its iteration number.
+ * Readers check that no value goes backwards, and at the end each
+ * variable must hold the last iteration of its writer, otherwise
+ * an update was lost.
+ *
+ * Results are printed one line per mode and measure as key=value
+ * pairs, times in microseconds.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "libuboot.h"
+
+#define VARPREFIX	"lockbench_w"
+
+static const char *workdir = "/tmp";
+static size_t envsize = 0x4000;
+static unsigned int nreaders = 16;
+static unsigned int nwriters = 4;
+static unsigned int iterations = 100;
+
+static char cfgname[PATH_MAX];
+
+/* filled by the children, one slot per process and iteration */
+struct results {
+	uint64_t *open;
+	uint64_t *wait;
+	uint64_t *store;
+	unsigned long *errors;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t lock_ns(struct uboot_ctx *ctx)
+{
+	struct libuboot_stats stats;
+
+	if (libuboot_get_stats(ctx, &stats))
+		return 0;
+
+	return stats.total[LIBUBOOT_STATS_LOCK].ns;
+}
+
+static void report(const char *mode, const char *op, uint64_t *samples,
+		   unsigned int n)
+{
+	if (!n)
+		return;
+
+	qsort(samples, n, sizeof(*samples), cmp_u64);
+	fprintf(stdout, "mode=%s readers=%u writers=%u iterations=%u op=%s "
+		"samples=%u p50_us=%.1f p99_us=%.1f max_us=%.1f\n",
+		mode, nreaders, nwriters, iterations, op, n,
+		samples[n / 2] / 1e3, samples[(n * 99) / 100] / 1e3,
+		samples[n - 1] / 1e3);
+}
+
+static int write_config(void)
+{
+	char path[512];
+	FILE *fp;
+	int i, fd;
+
+	snprintf(cfgname, sizeof(cfgname), "%s/bench-lock.yaml", workdir);
+	fp = fopen(cfgname, "w");
+	if (!fp)
+		return -errno;
+
+	fprintf(fp, "uboot:\n  size : 0x%zx\n  lockfile : %s/bench-lock.lock\n"
+		"  devices:\n", envsize, workdir);
+	for (i = 0; i < 2; i++) {
+		snprintf(path, sizeof(path), "%s/bench-lock-env%d", workdir, i);
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0 || ftruncate(fd, envsize) || close(fd)) {
+			fclose(fp);
+			return -EIO;
+		}
+		fprintf(fp, "    - path : %s\n      offset : 0\n", path);
+	}
+
+	return fclose(fp) ? -EIO : 0;
+}
+
+/* a fresh environment, without the variables of the writers */
+static int prepare(void)
+{
+	struct uboot_ctx *ctx = NULL;
+	int ret, i;
+
+	ret = write_config();
+	if (!ret)
+		ret = libuboot_read_config_ext(&ctx, cfgname);
+	if (ret)
+		return ret;
+	libuboot_open(ctx);
+	ret = libuboot_set_env(ctx, "bootcmd", "run lockbench");
+	for (i = 0; !ret && i < 2; i++)
+		ret = libuboot_env_store(ctx);
+	libuboot_close(ctx);
+	libuboot_exit(ctx);
+
+	return ret;
+}
+
+/* value set by a writer, -1 if it did not store yet */
+static long writer_value(struct uboot_ctx *ctx, unsigned int w)
+{
+	char name[32];
+	char *v;
+	long value;
+
+	snprintf(name, sizeof(name), VARPREFIX "%u", w);
+	v = libuboot_get_env(ctx, name);
+	value = v ? strtol(v, NULL, 10) : -1;
+	free(v);
+
+	return value;
+}
+
+static int set_writer_value(struct uboot_ctx *ctx, unsigned int w, unsigned int value)
+{
+	char name[32], buf[16];
+
+	snprintf(name, sizeof(name), VARPREFIX "%u", w);
+	snprintf(buf, sizeof(buf), "%u", value);
+
+	return libuboot_set_env(ctx, name, buf);
+}
+
+static void session_child(unsigned int id, struct results *res)
+{
+	struct uboot_ctx *ctx;
+	long *seen;
+	long value;
+	uint64_t t, wait;
+	unsigned int i, w, slot;
+	bool writer = id < nwriters;
+	int ret;
+
+	seen = calloc(nwriters, sizeof(*seen));
+	if (!seen)
+		_exit(1);
+	for (w = 0; w < nwriters; w++)
+		seen[w] = -1;
+
+	for (i = 0; i < iterations; i++) {
+		slot = id * iterations + i;
+		ctx = NULL;
+		if (libuboot_read_config_ext(&ctx, cfgname)) {
+			res->errors[id]++;
+			continue;
+		}
+
+		wait = lock_ns(ctx);
+		t = now_ns();
+		ret = libuboot_open(ctx);
+		res->open[slot] = now_ns() - t;
+		res->wait[slot] = lock_ns(ctx) - wait;
+		if (ret) {
+			res->errors[id]++;
+		} else if (writer) {
+			t = now_ns();
+			ret = set_writer_value(ctx, id, i);
+			if (!ret)
+				ret = libuboot_env_store(ctx);
+			res->store[slot] = now_ns() - t;
+			if (ret)
+				res->errors[id]++;
+		} else {
+			for (w = 0; w < nwriters; w++) {
+				value = writer_value(ctx, w);
+				if (value < seen[w])
+					res->errors[id]++;
+				else
+					seen[w] = value;
+			}
+		}
+		libuboot_close(ctx);
+		libuboot_exit(ctx);
+	}
+
+	free(seen);
+	_exit(0);
+}
+
+static void refresh_child(unsigned int id, struct results *res)
+{
+	struct uboot_ctx *ctx = NULL;
+	long *seen;
+	long value;
+	uint64_t t, wait;
+	unsigned int i, w, slot;
+	bool writer = id < nwriters;
+	int ret;
+
+	seen = calloc(nwriters, sizeof(*seen));
+	if (!seen || libuboot_read_config_ext(&ctx, cfgname))
+		_exit(1);
+	for (w = 0; w < nwriters; w++)
+		seen[w] = -1;
+
+	if (libuboot_open(ctx))
+		_exit(1);
+	libuboot_unlock(ctx);
+
+	for (i = 0; i < iterations; i++) {
+		slot = id * iterations + i;
+		wait = lock_ns(ctx);
+		t = now_ns();
+		if (writer) {
+			ret = libuboot_lock(ctx);
+			if (!ret)
+				ret = libuboot_refresh(ctx);
+			res->open[slot] = now_ns() - t;
+			res->wait[slot] = lock_ns(ctx) - wait;
+			if (ret >= 0) {
+				t = now_ns();
+				ret = set_writer_value(ctx, id, i);
+				if (!ret)
+					ret = libuboot_env_store(ctx);
+				res->store[slot] = now_ns() - t;
+			}
+			libuboot_unlock(ctx);
+			if (ret)
+				res->errors[id]++;
+		} else {
+			ret = libuboot_refresh(ctx);
+			res->open[slot] = now_ns() - t;
+			res->wait[slot] = lock_ns(ctx) - wait;
+			if (ret < 0) {
+				res->errors[id]++;
+				continue;
+			}
+			for (w = 0; w < nwriters; w++) {
+				value = writer_value(ctx, w);
+				if (value < seen[w])
+					res->errors[id]++;
+				else
+					seen[w] = value;
+			}
+		}
+	}
+
+	libuboot_close(ctx);
+	libuboot_exit(ctx);
+	free(seen);
+	_exit(0);
+}
+
+/* every writer must have left its last iteration in the environment */
+static unsigned int check_final(void)
+{
+	struct uboot_ctx *ctx = NULL;
+	unsigned int w, lost = 0;
+
+	if (libuboot_read_config_ext(&ctx, cfgname))
+		return nwriters;
+	if (libuboot_open(ctx)) {
+		libuboot_exit(ctx);
+		return nwriters;
+	}
+	for (w = 0; w < nwriters; w++)
+		if (writer_value(ctx, w) != (long)iterations - 1)
+			lost++;
+	libuboot_close(ctx);
+	libuboot_exit(ctx);
+
+	return lost;
+}
+
+static int run(const char *mode, void (*child)(unsigned int, struct results *))
+{
+	unsigned int i, nprocs = nreaders + nwriters;
+	size_t n = (size_t)nprocs * iterations;
+	size_t len = 3 * n * sizeof(uint64_t) + nprocs * sizeof(unsigned long);
+	unsigned long errors = 0;
+	unsigned int lost;
+	struct results res;
+	uint64_t start, elapsed;
+	int status, failed = 0;
+	void *map;
+	pid_t pid;
+	int ret;
+
+	ret = prepare();
+	if (ret) {
+		fprintf(stderr, "%s: cannot store the environment: %s\n",
+			mode, strerror(-ret));
+		return ret;
+	}
+
+	map = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED)
+		return -ENOMEM;
+	res.open = map;
+	res.wait = res.open + n;
+	res.store = res.wait + n;
+	res.errors = (unsigned long *)(res.store + n);
+
+	start = now_ns();
+	for (i = 0; i < nprocs; i++) {
+		pid = fork();
+		if (pid < 0)
+			return -errno;
+		if (pid == 0) {
+			int devnull = open("/dev/null", O_WRONLY);
+
+			/* silence debug output of the library */
+			if (devnull >= 0)
+				dup2(devnull, STDOUT_FILENO);
+			child(i, &res);
+		}
+	}
+	while (wait(&status) > 0)
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			failed++;
+	elapsed = now_ns() - start;
+
+	for (i = 0; i < nprocs; i++)
+		errors += res.errors[i];
+	lost = check_final();
+
+	/* opens of readers and writers, stores of writers only */
+	report(mode, strcmp(mode, "session") ? "refresh" : "open", res.open, n);
+	report(mode, "lock_wait", res.wait, n);
+	report(mode, "store", res.store, nwriters * iterations);
+	fprintf(stdout, "mode=%s readers=%u writers=%u iterations=%u total_s=%.3f "
+		"stores=%u stores_per_s=%.1f failed=%d errors=%lu lost=%u result=%s\n",
+		mode, nreaders, nwriters, iterations, elapsed / 1e9,
+		nwriters * iterations, nwriters * iterations / (elapsed / 1e9),
+		failed, errors, lost, failed || errors || lost ? "FAIL" : "OK");
+	munmap(map, len);
+
+	return failed || errors || lost ? -EIO : 0;
+}
+
+static void cleanup(void)
+{
+	/* room for the cache next to the configuration */
+	char path[PATH_MAX + sizeof(".cache")];
+	int i;
+
+	unlink(cfgname);
+	snprintf(path, sizeof(path), "%s.cache", cfgname);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/bench-lock.lock", workdir);
+	unlink(path);
+	for (i = 0; i < 2; i++) {
+		snprintf(path, sizeof(path), "%s/bench-lock-env%d", workdir, i);
+		unlink(path);
+	}
+}
+
+static void usage(const char *program)
+{
+	fprintf(stdout, "Usage %s [OPTION] [session|refresh]...\n", program);
+	fprintf(stdout,
+		" -d <dir>      : scratch directory (default: /tmp)\n"
+		" -s <bytes>    : size of the environment (default: 0x4000)\n"
+		" -r <readers>  : reader processes (default: 16)\n"
+		" -w <writers>  : writer processes (default: 4)\n"
+		" -n <count>    : iterations of each process (default: 100)\n");
+}
+
+int main(int argc, char **argv)
+{
+	int c, i;
+	bool failed = false;
+
+	while ((c = getopt(argc, argv, "d:s:r:w:n:h")) != EOF) {
+		switch (c) {
+		case 'd':
+			workdir = optarg;
+			break;
+		case 's':
+			envsize = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			nreaders = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			nwriters = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			exit(c == 'h' ? 0 : 1);
+		}
+	}
+
+	if (!iterations || !envsize || !(nreaders + nwriters)) {
+		usage(argv[0]);
+		exit(1);
+	}
+
+	if (optind == argc) {
+		failed |= run("session", session_child) != 0;
+		failed |= run("refresh", refresh_child) != 0;
+	}
+	for (i = optind; i < argc; i++) {
+		if (!strcmp(argv[i], "session"))
+			failed |= run("session", session_child) != 0;
+		else if (!strcmp(argv[i], "refresh"))
+			failed |= run("refresh", refresh_child) != 0;
+		else {
+			fprintf(stderr, "Unknown mode %s\n", argv[i]);
+			failed = true;
+		}
+	}
+
+	cleanup();
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,177 @@
+/*
+ * (C) Copyright 2026
+ * Stefano Babic, <stefano.babic@swupdate.org>
+ *
+ * SPDX-License-Identifier:     LGPL-2.1-or-later
+ */
+
+/**
+ * @file bench_mkenvimage.c
+ *
+ * @brief Throughput of image generation from a template
+ *
+ * A synthetic template is built in memory, then the threads
+ * generate one image per device with unique serial number and
+ * MAC address through libuboot_serialize_overrides(), as
+ * fw_mkenvimage does. Nothing is written to disk.
+ *
+ * Results are printed as key=value pairs.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "libuboot.h"
+
+#define MAX_THREADS	256
+
+static size_t envsize = 0x10000;
+static bool redundant;
+static unsigned int nimages = 100000;
+static unsigned int nthreads;
+static unsigned int nvars = 100;
+
+static struct uboot_ctx *template;
+static unsigned int next;
+static int failed;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *worker(void *arg)
+{
+	char overrides[128];
+	void *image;
+	unsigned int i;
+	int len;
+
+	(void)arg;
+	image = malloc(envsize);
+	if (!image) {
+		__atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	while ((i = __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED)) < nimages) {
+		len = snprintf(overrides, sizeof(overrides),
+			       "serial#=SN%08u\nethaddr=02:00:%02x:%02x:%02x:%02x\n",
+			       i, (i >> 24) & 0xff, (i >> 16) & 0xff,
+			       (i >> 8) & 0xff, i & 0xff);
+		if (libuboot_serialize_overrides(template, overrides, len,
+						 image, envsize) < 0) {
+			__atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+			break;
+		}
+	}
+	free(image);
+
+	return NULL;
+}
+
+static void usage(const char *program)
+{
+	fprintf(stdout, "Usage %s [OPTION]\n", program);
+	fprintf(stdout,
+		" -s <bytes>    : size of the environment (default: 0x10000)\n"
+		" -r            : redundant environment\n"
+		" -n <images>   : images to generate (default: 100000)\n"
+		" -j <threads>  : threads (default: online cpus)\n"
+		" -v <vars>     : variables in the template (default: 100)\n");
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t threads[MAX_THREADS];
+	char *text = NULL;
+	size_t textlen = 0;
+	FILE *fp;
+	uint64_t start, elapsed;
+	unsigned int i;
+	int c, ret;
+
+	while ((c = getopt(argc, argv, "s:rn:j:v:h")) != EOF) {
+		switch (c) {
+		case 's':
+			envsize = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			redundant = true;
+			break;
+		case 'n':
+			nimages = strtoul(optarg, NULL, 0);
+			break;
+		case 'j':
+			nthreads = strtoul(optarg, NULL, 0);
+			break;
+		case 'v':
+			nvars = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			exit(c == 'h' ? 0 : 1);
+		}
+	}
+
+	if (!nthreads) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = cpus > 0 ? cpus : 1;
+	}
+	if (nthreads > MAX_THREADS)
+		nthreads = MAX_THREADS;
+
+	fp = open_memstream(&text, &textlen);
+	if (!fp)
+		exit(1);
+	for (i = 0; i < nvars; i++)
+		fprintf(fp, "var%04u=value of the variable number %u\n", i, i);
+	fclose(fp);
+
+	ret = libuboot_initialize(&template, NULL);
+	if (!ret)
+		ret = libuboot_configure_image(template, envsize, redundant);
+	if (!ret)
+		ret = libuboot_load_env_mem(template, text, textlen);
+	free(text);
+	if (ret) {
+		fprintf(stderr, "Cannot build the template: %d\n", ret);
+		exit(1);
+	}
+
+	start = now_ns();
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(&threads[i], NULL, worker, NULL))
+			break;
+	nthreads = i;
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	elapsed = now_ns() - start;
+
+	libuboot_exit(template);
+
+	if (failed || !nthreads) {
+		fprintf(stderr, "Image generation failed\n");
+		exit(1);
+	}
+
+	fprintf(stdout, "mode=mkenvimage size=%zu redundant=%d vars=%u threads=%u "
+		"images=%u total_s=%.3f images_per_s=%.1f\n",
+		envsize, redundant, nvars, nthreads, nimages, elapsed / 1e9,
+		nimages / (elapsed / 1e9));
+
+	return 0;
+}
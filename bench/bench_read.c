@@ -0,0 +1,284 @@
+/*
+ * (C) Copyright 2026
+ * Stefano Babic, <stefano.babic@swupdate.org>
+ *
+ * SPDX-License-Identifier:     LGPL-2.1-or-later
+ */
+
+/**
+ * @file bench_read.c
+ *
+ * @brief Sequential and parallel read of the redundant copies
+ *
+ * A redundant environment is stored on each backend (files,
+ * simulated NOR and NAND flash) in a scratch directory, then
+ * libuboot_open() is measured reading the two copies one after the
+ * other and with the second copy on its own thread, as chosen with
+ * libuboot_set_read_mode(). The simulated flash gets a read latency
+ * (read_us) so that the waits overlap as on real devices.
+ *
+ * Results are printed one line per backend and mode as key=value
+ * pairs, times in microseconds. The parallel line has the speedup
+ * over the sequential one.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+
+#include "libuboot.h"
+
+static const char *workdir = "/tmp";
+static const char *backends = "file,nor,nand";
+static const char *simopts = "read_us=1000";
+static size_t envsize = 0x4000;
+static unsigned int nvars = 100;
+static unsigned int iterations = 200;
+
+static const struct {
+	const char *name;
+	enum libuboot_read_mode mode;
+} modes[] = {
+	{ "sequential", LIBUBOOT_READ_SEQUENTIAL },
+	{ "parallel", LIBUBOOT_READ_PARALLEL },
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Print the line of one mode, return the mean in ns
+ */
+static double report(const char *backend, const char *mode, uint64_t *samples,
+		     unsigned int n, double basemean)
+{
+	uint64_t sum = 0;
+	double mean;
+	unsigned int i;
+
+	qsort(samples, n, sizeof(*samples), cmp_u64);
+	for (i = 0; i < n; i++)
+		sum += samples[i];
+	mean = (double)sum / n;
+
+	fprintf(stdout, "backend=%s op=open mode=%s size=%zu vars=%u iterations=%u "
+		"mean_us=%.3f p50_us=%.3f p99_us=%.3f min_us=%.3f max_us=%.3f",
+		backend, mode, envsize, nvars, n, mean / 1e3,
+		samples[n / 2] / 1e3, samples[(n * 99) / 100] / 1e3,
+		samples[0] / 1e3, samples[n - 1] / 1e3);
+	if (basemean > 0)
+		fprintf(stdout, " speedup=%.2f", basemean / mean);
+	fputc('\n', stdout);
+
+	return mean;
+}
+
+/*
+ * Configuration with two copies on the backend, sim devices
+ * get an erase block as large as a copy
+ */
+static int write_config(const char *backend, char *cfgname, size_t len)
+{
+	char path[PATH_MAX];
+	size_t sector;
+	FILE *fp;
+	int i, fd;
+
+	snprintf(cfgname, len, "%s/bench-read-%s.config", workdir, backend);
+	fp = fopen(cfgname, "w");
+	if (!fp)
+		return -errno;
+
+	if (!strcmp(backend, "file")) {
+		for (i = 0; i < 2; i++) {
+			snprintf(path, sizeof(path), "%s/bench-read-env%d", workdir, i);
+			fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (fd < 0 || ftruncate(fd, envsize) || close(fd)) {
+				fclose(fp);
+				return -errno;
+			}
+			fprintf(fp, "%s 0x0 0x%zx\n", path, envsize);
+		}
+	} else {
+		sector = (envsize + 0xfff) & ~(size_t)0xfff;
+		snprintf(path, sizeof(path), "%s/bench-read-%s.img", workdir, backend);
+		unlink(path);
+		for (i = 0; i < 2; i++)
+			fprintf(fp, "sim:%s,erasesize=0x%zx%s%s:%s 0x%zx 0x%zx 0x%zx\n",
+				backend, sector, *simopts ? "," : "", simopts,
+				path, i * sector, envsize, sector);
+	}
+
+	return fclose(fp) ? -EIO : 0;
+}
+
+static int prepare(struct uboot_ctx *ctx)
+{
+	char name[16], value[16];
+	unsigned int i;
+	int ret = 0;
+
+	/* a fresh storage has no valid copy */
+	libuboot_open(ctx);
+	for (i = 0; !ret && i < nvars; i++) {
+		snprintf(name, sizeof(name), "var%05u", i);
+		snprintf(value, sizeof(value), "%010u", i);
+		ret = libuboot_set_env(ctx, name, value);
+	}
+
+	/* both copies valid, so that both are checked on open */
+	for (i = 0; !ret && i < 2; i++)
+		ret = libuboot_env_store(ctx);
+	libuboot_close(ctx);
+
+	return ret;
+}
+
+static int run_backend(const char *backend, uint64_t *samples)
+{
+	char cfgname[PATH_MAX + sizeof(".cache")];
+	struct uboot_ctx *ctxlist = NULL, *ctx;
+	double basemean = 0;
+	unsigned int i, m;
+	uint64_t t;
+	int ret;
+
+	ret = write_config(backend, cfgname, PATH_MAX);
+	if (!ret)
+		ret = libuboot_read_config_ext(&ctxlist, cfgname);
+	if (ret) {
+		fprintf(stderr, "%s: cannot set up the configuration: %s\n",
+			backend, strerror(-ret));
+		return ret;
+	}
+	ctx = ctxlist;
+
+	ret = prepare(ctx);
+	if (ret) {
+		fprintf(stderr, "%s: cannot store the environment: %s\n",
+			backend, strerror(-ret));
+		goto out;
+	}
+
+	for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+		libuboot_set_read_mode(ctx, modes[m].mode);
+		for (i = 0; i < iterations; i++) {
+			t = now_ns();
+			ret = libuboot_open(ctx);
+			samples[i] = now_ns() - t;
+			libuboot_close(ctx);
+			if (ret) {
+				fprintf(stderr, "%s: open failed: %s\n",
+					backend, strerror(-ret));
+				goto out;
+			}
+		}
+		if (!m)
+			basemean = report(backend, modes[m].name, samples, iterations, 0);
+		else
+			report(backend, modes[m].name, samples, iterations, basemean);
+	}
+
+out:
+	libuboot_exit(ctxlist);
+	unlink(cfgname);
+	strcat(cfgname, ".cache");
+	unlink(cfgname);
+
+	return ret;
+}
+
+static void usage(const char *program)
+{
+	fprintf(stdout, "Usage %s [OPTION]\n", program);
+	fprintf(stdout,
+		" -d <dir>      : scratch directory (default: /tmp)\n"
+		" -b <list>     : backends among file,nor,nand (default: all)\n"
+		" -s <bytes>    : size of the environment (default: 0x4000)\n"
+		" -v <vars>     : variables in the environment (default: 100)\n"
+		" -n <count>    : opens in each mode (default: 200)\n"
+		" -o <options>  : options of the simulated flash\n"
+		"                 (default: read_us=1000)\n");
+}
+
+int main(int argc, char **argv)
+{
+	char *list, *backend, *saveptr;
+	uint64_t *samples;
+	int c, ret = 0;
+
+	while ((c = getopt(argc, argv, "d:b:s:v:n:o:h")) != EOF) {
+		switch (c) {
+		case 'd':
+			workdir = optarg;
+			break;
+		case 'b':
+			backends = optarg;
+			break;
+		case 's':
+			envsize = strtoul(optarg, NULL, 0);
+			break;
+		case 'v':
+			nvars = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			simopts = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			exit(c == 'h' ? 0 : 1);
+		}
+	}
+
+	if (!iterations || !envsize) {
+		usage(argv[0]);
+		exit(1);
+	}
+
+	samples = calloc(iterations, sizeof(*samples));
+	list = strdup(backends);
+	if (!samples || !list)
+		exit(1);
+
+	for (backend = strtok_r(list, ",", &saveptr); backend;
+	     backend = strtok_r(NULL, ",", &saveptr)) {
+		if (strcmp(backend, "file") && strcmp(backend, "nor") &&
+		    strcmp(backend, "nand")) {
+			fprintf(stderr, "Unknown backend %s\n", backend);
+			ret = 1;
+			continue;
+		}
+		if (run_backend(backend, samples))
+			ret = 1;
+	}
+
+	free(list);
+	free(samples);
+
+	return ret;
+}
@@ -0,0 +1,240 @@
+/*
+ * (C) Copyright 2026
+ * Stefano Babic, <stefano.babic@swupdate.org>
+ *
+ * SPDX-License-Identifier:     LGPL-2.1-or-later
+ */
+
+/**
+ * @file bench_ubootenvd.c
+ *
+ * @brief Compare direct access and ubootenvd under concurrent clients
+ *
+ * Each client is a separate process issuing requests in a loop, as
+ * many fw_printenv invocations would do. A direct request goes through
+ * the whole configuration, open, get and close sequence, a daemon request
+ * connects to the socket and asks for the variable.
+ * ubootenvd must already be running on the given socket.
+ *
+ * Results are printed one line per mode as key=value pairs.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "libuboot.h"
+#include "ubootenvd.h"
+
+static const char *cfgfname = "/etc/fw_env.config";
+static const char *sockname = DEFAULT_SOCKET_PATH;
+static const char *namespace;
+static const char *varname = "bootcmd";
+static unsigned int nclients = 8;
+static unsigned int nrequests = 100;
+static bool writes;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int direct_request(unsigned int n)
+{
+	struct uboot_ctx *ctxlist = NULL, *ctx;
+	char value[32];
+	char *v;
+	int ret;
+
+	ret = libuboot_read_config_ext(&ctxlist, cfgfname);
+	if (ret)
+		return ret;
+	ctx = namespace ? libuboot_get_namespace(ctxlist, namespace) : ctxlist;
+	if (!ctx) {
+		libuboot_exit(ctxlist);
+		return -ENOENT;
+	}
+	ret = libuboot_open(ctx);
+	if (!ret) {
+		if (writes) {
+			snprintf(value, sizeof(value), "%u", n);
+			ret = libuboot_set_env(ctx, varname, value);
+			if (!ret)
+				ret = libuboot_env_store(ctx);
+		} else {
+			v = libuboot_get_env(ctx, varname);
+			free(v);
+		}
+	}
+	libuboot_close(ctx);
+	libuboot_exit(ctxlist);
+
+	return ret;
+}
+
+static int daemon_request(unsigned int n)
+{
+	struct ubootenvd_client cl;
+	char value[32];
+	int ret;
+
+	ret = ubootenvd_connect(&cl, sockname);
+	if (ret)
+		return ret;
+	if (writes) {
+		snprintf(value, sizeof(value), "%u", n);
+		ret = ubootenvd_request(&cl, "set", namespace, varname, value, NULL, NULL);
+		if (!ret)
+			ret = ubootenvd_request(&cl, "store", namespace, NULL, NULL, NULL, NULL);
+	} else {
+		ret = ubootenvd_request(&cl, "get", namespace, varname, NULL, NULL, NULL);
+		if (ret == -ENOENT)
+			ret = 0;
+	}
+	ubootenvd_disconnect(&cl);
+
+	return ret;
+}
+
+static int run(const char *mode, int (*request)(unsigned int))
+{
+	uint64_t *lat, start, elapsed;
+	unsigned int i, j, total = nclients * nrequests;
+	int status, failed = 0;
+	pid_t pid;
+
+	lat = mmap(NULL, total * sizeof(*lat), PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (lat == MAP_FAILED)
+		return -ENOMEM;
+
+	start = now_ns();
+	for (i = 0; i < nclients; i++) {
+		pid = fork();
+		if (pid < 0)
+			return -errno;
+		if (pid == 0) {
+			int devnull = open("/dev/null", O_WRONLY);
+
+			/* silence debug output of the library */
+			if (devnull >= 0)
+				dup2(devnull, STDOUT_FILENO);
+			for (j = 0; j < nrequests; j++) {
+				uint64_t t = now_ns();
+				if (request(i * nrequests + j))
+					_exit(1);
+				lat[i * nrequests + j] = now_ns() - t;
+			}
+			_exit(0);
+		}
+	}
+	while (wait(&status) > 0)
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			failed++;
+	elapsed = now_ns() - start;
+
+	if (failed) {
+		fprintf(stderr, "%s: %d clients failed\n", mode, failed);
+		munmap(lat, total * sizeof(*lat));
+		return -EIO;
+	}
+
+	qsort(lat, total, sizeof(*lat), cmp_u64);
+	fprintf(stdout, "mode=%s op=%s clients=%u requests=%u total_s=%.3f "
+		"throughput_rps=%.1f p50_us=%.1f p99_us=%.1f max_us=%.1f\n",
+		mode, writes ? "set" : "get", nclients, total, elapsed / 1e9,
+		total / (elapsed / 1e9),
+		lat[total / 2] / 1e3, lat[(total * 99) / 100] / 1e3,
+		lat[total - 1] / 1e3);
+	munmap(lat, total * sizeof(*lat));
+
+	return 0;
+}
+
+static void usage(const char *program)
+{
+	fprintf(stdout, "Usage %s [OPTION] [direct|daemon]...\n", program);
+	fprintf(stdout,
+		" -c <filename> : configuration file for direct mode\n"
+		" -S <path>     : ubootenvd socket\n"
+		" -m <name>     : namespace\n"
+		" -v <name>     : variable to get or set (default: bootcmd)\n"
+		" -n <clients>  : concurrent clients (default: 8)\n"
+		" -r <requests> : requests per client (default: 100)\n"
+		" -w            : set and store instead of get\n");
+}
+
+int main(int argc, char **argv)
+{
+	int c, i, ret = 0;
+
+	while ((c = getopt(argc, argv, "c:S:m:v:n:r:wh")) != EOF) {
+		switch (c) {
+		case 'c':
+			cfgfname = optarg;
+			break;
+		case 'S':
+			sockname = optarg;
+			break;
+		case 'm':
+			namespace = optarg;
+			break;
+		case 'v':
+			varname = optarg;
+			break;
+		case 'n':
+			nclients = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			nrequests = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			writes = true;
+			break;
+		default:
+			usage(argv[0]);
+			exit(c == 'h' ? 0 : 1);
+		}
+	}
+
+	if (!nclients || !nrequests) {
+		usage(argv[0]);
+		exit(1);
+	}
+
+	if (optind == argc) {
+		ret |= run("direct", direct_request);
+		ret |= run("daemon", daemon_request);
+	}
+	for (i = optind; i < argc; i++) {
+		if (!strcmp(argv[i], "direct"))
+			ret |= run("direct", direct_request);
+		else if (!strcmp(argv[i], "daemon"))
+			ret |= run("daemon", daemon_request);
+		else
+			fprintf(stderr, "Unknown mode %s\n", argv[i]);
+	}
+
+	return ret ? 1 : 0;
+}
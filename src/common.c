@@ -17,6 +17,7 @@
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #ifdef __FreeBSD__
@@ -29,24 +30,6 @@
 #include "uboot_private.h"
 #include "common.h"
 
-static enum device_type get_device_type(char *device)
-{
-	enum device_type type = DEVICE_NONE;
-
-	if (!strncmp(device, DEVICE_MTD_NAME, strlen(DEVICE_MTD_NAME)))
-		if (strchr(device, DEVNAME_SEPARATOR)) {
-			type = DEVICE_UBI;
-		} else {
-			type = DEVICE_MTD;
-		}
-	else if (!strncmp(device, DEVICE_UBI_NAME, strlen(DEVICE_UBI_NAME)))
-		type = DEVICE_UBI;
-	else if (strlen(device) > 0)
-		type = DEVICE_FILE;
-
-	return type;
-}
-
 int normalize_device_path(char *path, struct uboot_flash_env *dev)
 {
 	char *sep = NULL, *normalized = NULL;
@@ -168,81 +151,80 @@ bool check_compatible_devices(struct uboot_ctx *ctx)
 	return true;
 }
 
-int check_env_device(struct uboot_flash_env *dev)
+/*
+ * Check for negative offsets, treat it as backwards offset
+ * from the end of the block device
+ */
+int resolve_env_offset(struct uboot_flash_env *dev, int fd)
 {
-	int fd, ret;
-	struct stat st;
+	uint64_t blkdevsize;
 
-	dev->device_type = get_device_type(dev->devname);
-	if (dev->device_type == DEVICE_NONE)
-		return -EBADF;
+	if (dev->offset >= 0)
+		return 0;
 
-	if (dev->device_type == DEVICE_UBI) {
-		ret = libubootenv_ubi_update_name(dev);
-		if (ret)
-			return ret;
-	}
+	if (ioctl(fd, BLKGETSIZE64, &blkdevsize) < 0)
+		return -EINVAL;
 
-	ret = stat(dev->devname, &st);
-	if (ret < 0)
-		return -EBADF;
-	fd = open(dev->devname, O_RDONLY);
-	if (fd < 0)
-		return -EBADF;
+	dev->offset += blkdevsize;
 
-	if (S_ISCHR(st.st_mode)) {
-		if (dev->device_type == DEVICE_MTD) {
-			ret = libubootenv_mtdgetinfo(fd, dev);
-			if (ret < 0 || (dev->mtdinfo.type != MTD_NORFLASH &&
-					dev->mtdinfo.type != MTD_NANDFLASH)) {
-				close(fd);
-				return -EBADF;
-			}
-			if (dev->sectorsize == 0) {
-				dev->sectorsize = dev->mtdinfo.erasesize;
-			}
-		}
-	}
+	return 0;
+}
 
-	switch (dev->device_type) {
-	case DEVICE_FILE:
-		dev->flagstype = FLAGS_INCREMENTAL;
-		break;
-	case DEVICE_MTD:
-		switch (dev->mtdinfo.type) {
-		case MTD_NORFLASH:
-			dev->flagstype = FLAGS_BOOLEAN;
-			break;
-		case MTD_NANDFLASH:
-			dev->flagstype = FLAGS_INCREMENTAL;
-		};
-		break;
-	case DEVICE_UBI:
-		dev->flagstype = FLAGS_INCREMENTAL;
-		break;
-	default:
-		close(fd);
+int check_env_device(struct uboot_flash_env *dev)
+{
+	dev->ops = libubootenv_find_backend(dev->devname);
+	if (!dev->ops)
 		return -EBADF;
-	};
 
-	/*
-	 * Check for negative offsets, treat it as backwards offset
-	 * from the end of the block device
-	 */
-	if (dev->offset < 0) {
-		uint64_t blkdevsize;
-		int rc;
+	return dev->ops->probe(dev);
+}
 
-		rc = ioctl(fd, BLKGETSIZE64, &blkdevsize);
-		if (rc < 0) {
-			close(fd);
-			return -EINVAL;
-		}
+/*
+ * Resolve the device as found in the configuration
+ * and check that it can be used
+ */
+int probe_env_device(struct uboot_flash_env *dev)
+{
+	char path[DEVNAME_MAX_LENGTH];
+	const struct uboot_backend_ops *ops;
 
-		dev->offset += blkdevsize;
+	ops = libubootenv_find_backend(dev->devname);
+	if (dev->devname[0] && !(ops && ops->virtual_device)) {
+		strcpy(path, dev->devname);
+		if (normalize_device_path(path, dev) < 0)
+			return -EINVAL;
 	}
 
-	close(fd);
+	return check_env_device(dev);
+}
 
-	return 0;
+uint64_t stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * A new operation starts, the counters
+ * of the last one are dropped
+ */
+void stats_begin(struct libuboot_stats *stats)
+{
+	memset(stats->last, 0, sizeof(stats->last));
+}
+
+void stats_record(struct libuboot_stats *stats, unsigned int phase,
+		  uint64_t start, size_t bytes)
+{
+	uint64_t ns = stats_now() - start;
+
+	stats->total[phase].calls++;
+	stats->total[phase].bytes += bytes;
+	stats->total[phase].ns += ns;
+	stats->last[phase].calls++;
+	stats->last[phase].bytes += bytes;
+	stats->last[phase].ns += ns;
 }
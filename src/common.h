@@ -6,10 +6,37 @@
  */
 
 
+#include <sys/stat.h>
 #include "uboot_private.h"
 
 struct var_entry *create_var_entry(const char *name);
 void set_var_access_type(struct var_entry *entry, const char *pvarflags);
 int normalize_device_path(char *path, struct uboot_flash_env *dev);
 int check_env_device(struct uboot_flash_env *dev);
+int resolve_env_offset(struct uboot_flash_env *dev, int fd);
+int probe_env_device(struct uboot_flash_env *dev);
 bool check_compatible_devices(struct uboot_ctx *ctx);
+int flash_read(struct uboot_flash_env *dev, void *data, size_t size);
+int flash_write(struct uboot_flash_env *dev, void *data);
+int flash_erase(struct uboot_flash_env *dev);
+/*
+ * CRC of data from the CRC of old, a buffer of the same length,
+ * going through the ranges that differ. crcbytes returns the
+ * bytes checked. False if too much changed to save anything.
+ */
+bool crc32_update(const uint8_t *old, uint32_t oldcrc, const uint8_t *data,
+		  size_t len, uint32_t *crc, size_t *crcbytes);
+uint64_t stats_now(void);
+void stats_begin(struct libuboot_stats *stats);
+void stats_record(struct libuboot_stats *stats, unsigned int phase,
+		  uint64_t start, size_t bytes);
+
+#if defined(NO_CONFIG_CACHE)
+#define config_cache_load(ctxlist, config, st) (-ENOENT)
+#define config_cache_save(ctxlist, config, st)
+#else
+int config_cache_load(struct uboot_ctx **ctxlist, const char *config,
+		      const struct stat *st);
+void config_cache_save(struct uboot_ctx *ctxlist, const char *config,
+		       const struct stat *st);
+#endif
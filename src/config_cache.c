@@ -0,0 +1,444 @@
+/*
+ * (C) Copyright 2026
+ * Stefano Babic, <stefano.babic@swupdate.org>
+ *
+ * SPDX-License-Identifier:     LGPL-2.1-or-later
+ */
+
+/**
+ * @file config_cache.c
+ *
+ * @brief Binary cache of the parsed configuration
+ *
+ * The cache is stored next to the configuration file as
+ * <config>.cache and it is valid as long as the configuration
+ * file has the same device, inode, size and modification time.
+ * It contains the parsed namespaces, devices and writelists,
+ * devices are still resolved and checked at each load.
+ * The cache is host specific and it is written best effort:
+ * if it cannot be written, the configuration is just parsed
+ * again next time.
+ */
+
+#define _GNU_SOURCE
+
+#if !defined(NO_CONFIG_CACHE)
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "uboot_private.h"
+#include "common.h"
+
+#define CONFIG_CACHE_SUFFIX	".cache"
+#define CONFIG_CACHE_MAGIC	0x55424343	/* UBCC */
+#define CONFIG_CACHE_VERSION	3
+/* length of a missing string */
+#define NO_STRING		0xFFFF
+
+struct config_cache_header {
+	uint32_t magic;
+	uint32_t version;
+	/* identity of the configuration file */
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	/* nelem of the first context, 0 for a legacy configuration */
+	uint32_t nelem;
+	/* length and crc32 of the data following the header */
+	uint32_t datalen;
+	uint32_t crc;
+};
+
+struct cache_buf {
+	uint8_t *data;
+	size_t len;
+	size_t size;
+	bool error;
+};
+
+struct cache_reader {
+	const uint8_t *p;
+	const uint8_t *end;
+};
+
+static void put(struct cache_buf *b, const void *data, size_t len)
+{
+	uint8_t *tmp;
+	size_t size;
+
+	if (b->error)
+		return;
+
+	if (b->len + len > b->size) {
+		size = b->size ? b->size : 1024;
+		while (size < b->len + len)
+			size *= 2;
+		tmp = realloc(b->data, size);
+		if (!tmp) {
+			b->error = true;
+			return;
+		}
+		b->data = tmp;
+		b->size = size;
+	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+}
+
+#define PUT(b, type, v) do { type __v = (v); put(b, &__v, sizeof(__v)); } while (0)
+
+static void put_string(struct cache_buf *b, const char *str)
+{
+	size_t len = str ? strlen(str) : NO_STRING;
+
+	if (str && len >= NO_STRING) {
+		b->error = true;
+		return;
+	}
+	PUT(b, uint16_t, len);
+	if (str)
+		put(b, str, len);
+}
+
+static int get(struct cache_reader *r, void *data, size_t len)
+{
+	if ((size_t)(r->end - r->p) < len)
+		return -EINVAL;
+	memcpy(data, r->p, len);
+	r->p += len;
+
+	return 0;
+}
+
+static int get_string(struct cache_reader *r, char **str)
+{
+	uint16_t len;
+
+	*str = NULL;
+	if (get(r, &len, sizeof(len)))
+		return -EINVAL;
+	if (len == NO_STRING)
+		return 0;
+	if ((size_t)(r->end - r->p) < len)
+		return -EINVAL;
+	*str = strndup((const char *)r->p, len);
+	if (!*str)
+		return -ENOMEM;
+	r->p += len;
+
+	return 0;
+}
+
+static char *cache_name(const char *config)
+{
+	char *name;
+
+	if (asprintf(&name, "%s%s", config, CONFIG_CACHE_SUFFIX) < 0)
+		return NULL;
+
+	return name;
+}
+
+static void put_ctx(struct cache_buf *b, struct uboot_ctx *ctx)
+{
+	struct uboot_flash_env *dev;
+	struct var_entry *entry;
+	uint32_t nvars = 0;
+	int i;
+
+	PUT(b, uint8_t, ctx->redundant);
+	PUT(b, uint64_t, ctx->size);
+	put_string(b, ctx->name);
+	put_string(b, ctx->lockfile);
+	PUT(b, uint8_t, ctx->erase_ahead);
+	PUT(b, uint8_t, ctx->padding);
+
+	for (i = 0; i < (ctx->redundant ? 2 : 1); i++) {
+		dev = &ctx->envdevs[i];
+		put_string(b, dev->devname);
+		PUT(b, int64_t, dev->offset);
+		PUT(b, uint64_t, dev->envsize);
+		PUT(b, uint64_t, dev->sectorsize);
+		PUT(b, uint64_t, dev->envsectors);
+		PUT(b, int32_t, dev->disable_mtd_lock);
+	}
+
+	LIST_FOREACH(entry, &ctx->writevarlist, next)
+		nvars++;
+	PUT(b, uint32_t, nvars);
+	LIST_FOREACH(entry, &ctx->writevarlist, next) {
+		put_string(b, entry->name);
+		PUT(b, uint8_t, entry->type);
+		PUT(b, uint8_t, entry->access);
+	}
+}
+
+static int get_ctx(struct cache_reader *r, struct uboot_ctx *ctx)
+{
+	struct uboot_flash_env *dev;
+	struct var_entry *entry, *last = NULL;
+	uint8_t redundant, erase_ahead, padding, type, access;
+	uint64_t size, envsize, sectorsize, envsectors;
+	int64_t offset;
+	int32_t disable_mtd_lock;
+	uint32_t nvars;
+	char *str;
+	int i;
+
+	if (get(r, &redundant, sizeof(redundant)) ||
+	    get(r, &size, sizeof(size)) ||
+	    get_string(r, &ctx->name) ||
+	    get_string(r, &ctx->lockfile) ||
+	    get(r, &erase_ahead, sizeof(erase_ahead)) ||
+	    get(r, &padding, sizeof(padding)))
+		return -EINVAL;
+	ctx->redundant = redundant;
+	ctx->erase_ahead = erase_ahead;
+	ctx->padding = padding;
+	ctx->size = size;
+
+	for (i = 0; i < (ctx->redundant ? 2 : 1); i++) {
+		dev = &ctx->envdevs[i];
+		if (get_string(r, &str))
+			return -EINVAL;
+		if (!str || strlen(str) >= sizeof(dev->devname)) {
+			free(str);
+			return -EINVAL;
+		}
+		strcpy(dev->devname, str);
+		free(str);
+		if (get(r, &offset, sizeof(offset)) ||
+		    get(r, &envsize, sizeof(envsize)) ||
+		    get(r, &sectorsize, sizeof(sectorsize)) ||
+		    get(r, &envsectors, sizeof(envsectors)) ||
+		    get(r, &disable_mtd_lock, sizeof(disable_mtd_lock)))
+			return -EINVAL;
+		dev->offset = offset;
+		dev->envsize = envsize;
+		dev->sectorsize = sectorsize;
+		dev->envsectors = envsectors;
+		dev->disable_mtd_lock = disable_mtd_lock;
+	}
+
+	if (get(r, &nvars, sizeof(nvars)))
+		return -EINVAL;
+	while (nvars--) {
+		if (get_string(r, &str) || !str)
+			return -EINVAL;
+		entry = create_var_entry(str);
+		free(str);
+		if (!entry)
+			return -ENOMEM;
+		/* keep the order of the list */
+		if (last)
+			LIST_INSERT_AFTER(last, entry, next);
+		else
+			LIST_INSERT_HEAD(&ctx->writevarlist, entry, next);
+		last = entry;
+		if (get(r, &type, sizeof(type)) ||
+		    get(r, &access, sizeof(access)))
+			return -EINVAL;
+		entry->type = type;
+		entry->access = access;
+	}
+
+	return 0;
+}
+
+static void free_ctxsets(struct uboot_ctx *ctxsets, unsigned int n)
+{
+	struct var_entry *entry, *tmp;
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		free(ctxsets[i].name);
+		free(ctxsets[i].lockfile);
+		LIST_FOREACH_SAFE(entry, &ctxsets[i].writevarlist, next, tmp) {
+			LIST_REMOVE(entry, next);
+			free(entry->name);
+			free(entry);
+		}
+	}
+	free(ctxsets);
+}
+
+static bool same_file(const struct config_cache_header *hdr, const struct stat *st)
+{
+	return hdr->magic == CONFIG_CACHE_MAGIC &&
+		hdr->version == CONFIG_CACHE_VERSION &&
+		hdr->dev == (uint64_t)st->st_dev &&
+		hdr->ino == (uint64_t)st->st_ino &&
+		hdr->size == (uint64_t)st->st_size &&
+		hdr->mtime_sec == (int64_t)st->st_mtim.tv_sec &&
+		hdr->mtime_nsec == (int64_t)st->st_mtim.tv_nsec;
+}
+
+int config_cache_load(struct uboot_ctx **ctxlist, const char *config,
+		      const struct stat *st)
+{
+	struct config_cache_header hdr;
+	struct cache_reader r;
+	struct uboot_ctx *ctxsets;
+	struct stat cst;
+	uint8_t *buf;
+	char *name;
+	unsigned int i, n;
+	ssize_t len;
+	int fd, ret = -EINVAL;
+
+	name = cache_name(config);
+	if (!name)
+		return -ENOMEM;
+	fd = open(name, O_RDONLY | O_CLOEXEC);
+	free(name);
+	if (fd < 0)
+		return -ENOENT;
+
+	/*
+	 * Trust the cache only as much as the configuration:
+	 * same owner and not writable by anyone else
+	 */
+	if (fstat(fd, &cst) < 0 || !S_ISREG(cst.st_mode) ||
+	    cst.st_uid != st->st_uid || (cst.st_mode & (S_IWGRP | S_IWOTH)) ||
+	    cst.st_size < (off_t)sizeof(hdr) || cst.st_size > 1024 * 1024) {
+		close(fd);
+		return -EINVAL;
+	}
+
+	buf = malloc(cst.st_size);
+	if (!buf) {
+		close(fd);
+		return -ENOMEM;
+	}
+	len = read(fd, buf, cst.st_size);
+	close(fd);
+
+	memcpy(&hdr, buf, sizeof(hdr));
+	if (len != cst.st_size || !same_file(&hdr, st) ||
+	    hdr.datalen != len - sizeof(hdr) ||
+	    hdr.crc != crc32(0, buf + sizeof(hdr), hdr.datalen))
+		goto out;
+
+	n = hdr.nelem ? hdr.nelem : 1;
+	ctxsets = calloc(n, sizeof(*ctxsets));
+	if (!ctxsets) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	r.p = buf + sizeof(hdr);
+	r.end = buf + len;
+	for (i = 0; i < n; i++) {
+		ret = get_ctx(&r, &ctxsets[i]);
+		if (ret) {
+			free_ctxsets(ctxsets, n);
+			goto out;
+		}
+		if (hdr.nelem)
+			ctxsets[i].ctxlist = ctxsets;
+	}
+	if (r.p != r.end) {
+		free_ctxsets(ctxsets, n);
+		ret = -EINVAL;
+		goto out;
+	}
+	ctxsets[0].nelem = hdr.nelem;
+	*ctxlist = ctxsets;
+
+out:
+	free(buf);
+
+	return ret;
+}
+
+/*
+ * Write the whole buffer, retrying after short writes
+ */
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+void config_cache_save(struct uboot_ctx *ctxlist, const char *config,
+		       const struct stat *st)
+{
+	struct config_cache_header hdr;
+	struct cache_buf b = { 0 };
+	char *name, *tmpname = NULL;
+	unsigned int i;
+	bool ok;
+	int fd;
+
+	/* a cache from another user would be refused anyway */
+	if (geteuid() != st->st_uid)
+		return;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = CONFIG_CACHE_MAGIC;
+	hdr.version = CONFIG_CACHE_VERSION;
+	hdr.dev = st->st_dev;
+	hdr.ino = st->st_ino;
+	hdr.size = st->st_size;
+	hdr.mtime_sec = st->st_mtim.tv_sec;
+	hdr.mtime_nsec = st->st_mtim.tv_nsec;
+	hdr.nelem = ctxlist->nelem;
+
+	put(&b, &hdr, sizeof(hdr));
+	for (i = 0; i < (ctxlist->nelem ? ctxlist->nelem : 1); i++)
+		put_ctx(&b, &ctxlist[i]);
+	if (b.error)
+		goto out;
+
+	hdr.datalen = b.len - sizeof(hdr);
+	hdr.crc = crc32(0, b.data + sizeof(hdr), hdr.datalen);
+	memcpy(b.data, &hdr, sizeof(hdr));
+
+	name = cache_name(config);
+	if (!name)
+		goto out;
+	if (asprintf(&tmpname, "%s.XXXXXX", name) < 0) {
+		tmpname = NULL;
+		goto out_name;
+	}
+
+	/* replace the cache atomically, readers never see a partial file */
+	fd = mkostemp(tmpname, O_CLOEXEC);
+	if (fd < 0)
+		goto out_name;
+	ok = !fchmod(fd, 0644) && !write_all(fd, b.data, b.len);
+	/* closed in any case, an error of close() means data lost */
+	if (close(fd) < 0)
+		ok = false;
+	if (!ok || rename(tmpname, name) < 0)
+		unlink(tmpname);
+
+out_name:
+	free(tmpname);
+	free(name);
+out:
+	free(b.data);
+}
+#endif
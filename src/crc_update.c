@@ -0,0 +1,68 @@
+/*
+ * (C) Copyright 2026
+ * Stefano Babic, <stefano.babic@swupdate.org>
+ *
+ * SPDX-License-Identifier:     LGPL-2.1-or-later
+ */
+
+/**
+ * @file crc_update.c
+ *
+ * @brief CRC-32 of a buffer from the CRC of a previous content
+ *
+ * CRC-32 is linear: over the same length, crc(A) ^ crc(B) depends
+ * only on A ^ B. The CRC of each range that changed, XORed with the
+ * old one and shifted with crc32_combine() over the bytes that follow
+ * it, is the change of the whole CRC.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "common.h"
+
+#define CRC_BLOCK	64
+#define CRC_MAX_RANGES	16
+
+static size_t block_len(size_t pos, size_t len)
+{
+	return len - pos < CRC_BLOCK ? len - pos : CRC_BLOCK;
+}
+
+bool crc32_update(const uint8_t *old, uint32_t oldcrc, const uint8_t *data,
+		  size_t len, uint32_t *crc, size_t *crcbytes)
+{
+	size_t start = 0, end, changed = 0;
+	unsigned int ranges = 0;
+	uint32_t c = oldcrc;
+
+	for (;;) {
+		while (start < len && !memcmp(old + start, data + start,
+					      block_len(start, len)))
+			start += CRC_BLOCK;
+		if (start >= len)
+			break;
+
+		end = start + CRC_BLOCK;
+		while (end < len && memcmp(old + end, data + end, block_len(end, len)))
+			end += CRC_BLOCK;
+		if (end > len)
+			end = len;
+
+		changed += end - start;
+		if (++ranges > CRC_MAX_RANGES || changed > len / 2)
+			return false;
+
+		c ^= crc32_combine(crc32(0, old + start, end - start) ^
+				   crc32(0, data + start, end - start),
+				   0, len - end);
+		start = end;
+	}
+
+	*crc = c;
+	*crcbytes = 2 * changed;
+
+	return true;
+}
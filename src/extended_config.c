@@ -25,6 +25,62 @@
 #include "uboot_private.h"
 #include "common.h"
 
+#if defined(YAML_DLOPEN)
+#include <dlfcn.h>
+
+#ifndef YAML_LIBRARY
+#define YAML_LIBRARY "libyaml-0.so.2"
+#endif
+
+/*
+ * libyaml is loaded the first time a YAML configuration
+ * is parsed, legacy configurations do not need it at all.
+ */
+static struct {
+	int (*parser_initialize)(yaml_parser_t *parser);
+	void (*parser_set_input_file)(yaml_parser_t *parser, FILE *file);
+	int (*parser_parse)(yaml_parser_t *parser, yaml_event_t *event);
+	void (*event_delete)(yaml_event_t *event);
+	void (*parser_delete)(yaml_parser_t *parser);
+} libyaml;
+
+static int load_libyaml(void)
+{
+	static void *handle;
+	void *h;
+
+	if (handle)
+		return 0;
+
+	h = dlopen(YAML_LIBRARY, RTLD_NOW | RTLD_LOCAL);
+	if (!h)
+		return -ENOSYS;
+
+	libyaml.parser_initialize = dlsym(h, "yaml_parser_initialize");
+	libyaml.parser_set_input_file = dlsym(h, "yaml_parser_set_input_file");
+	libyaml.parser_parse = dlsym(h, "yaml_parser_parse");
+	libyaml.event_delete = dlsym(h, "yaml_event_delete");
+	libyaml.parser_delete = dlsym(h, "yaml_parser_delete");
+	if (!libyaml.parser_initialize || !libyaml.parser_set_input_file ||
+	    !libyaml.parser_parse || !libyaml.event_delete ||
+	    !libyaml.parser_delete) {
+		dlclose(h);
+		return -ENOSYS;
+	}
+	handle = h;
+
+	return 0;
+}
+
+#define yaml_parser_initialize(p)		libyaml.parser_initialize(p)
+#define yaml_parser_set_input_file(p, f)	libyaml.parser_set_input_file(p, f)
+#define yaml_parser_parse(p, e)			libyaml.parser_parse(p, e)
+#define yaml_event_delete(e)			libyaml.event_delete(e)
+#define yaml_parser_delete(p)			libyaml.parser_delete(p)
+#else
+#define load_libyaml() 0
+#endif
+
 /* yaml_* functions return 1 on success and 0 on failure. */
 enum yaml_status {
     SUCCESS = 0,
@@ -42,6 +98,8 @@ enum yaml_state {
 	STATE_NKEY,		/* Check key names */
 	STATE_NSIZE,		/* Size key-value pair */
 	STATE_NLOCKFILE,	/* Lockfile key-value pair */
+	STATE_NERASEAHEAD,	/* Erase the obsolete copy after a store */
+	STATE_NPADDING,		/* Byte after the end of the environment */
 	STATE_DEVVALUES,	/* Devices key names */
 	STATE_WRITELIST,	/* List with vars that are accepted by write
 				 * if list is missing, all vars are accepted
@@ -62,6 +120,7 @@ typedef enum yaml_parse_error_e {
 	YAML_BAD_DEVICE,
 	YAML_BAD_DEVNAME,
 	YAML_BAD_VARLIST,
+	YAML_BAD_PADDING,
 	YAML_DUPLICATE_VARLIST,
 	YAML_OOM,
 } yaml_parse_error_type_t;
@@ -175,6 +234,10 @@ static int consume_event(struct parser_state *s, yaml_event_t *event)
 				s->state = STATE_NSIZE;
 			} else if (!strcmp(value, "lockfile")) {
 				s->state = STATE_NLOCKFILE;
+			} else if (!strcmp(value, "eraseahead")) {
+				s->state = STATE_NERASEAHEAD;
+			} else if (!strcmp(value, "padding")) {
+				s->state = STATE_NPADDING;
 			} else if (!strcmp(value, "devices")) {
 				s->state = STATE_DEVVALUES;
 				s->cdev = 0;
@@ -225,18 +288,46 @@ static int consume_event(struct parser_state *s, yaml_event_t *event)
 		}
 		break;
 
+	case STATE_NERASEAHEAD:
+		switch (event->type) {
+		case YAML_SCALAR_EVENT:
+			value = (char *)event->data.scalar.value;
+			if (!strcmp(value, "yes"))
+				s->ctx->erase_ahead = true;
+			s->state = STATE_NAMESPACE_FIELDS;
+			break;
+		default:
+			s->error = YAML_UNEXPECTED_STATE;
+			s->event_type = event->type;
+			return FAILURE;
+		}
+		break;
+
+	case STATE_NPADDING:
+		switch (event->type) {
+		case YAML_SCALAR_EVENT:
+			value = (char *)event->data.scalar.value;
+			if (libuboot_set_padding(s->ctx, strtoul(value, NULL, 0))) {
+				s->error = YAML_BAD_PADDING;
+				s->event_type = event->type;
+				return FAILURE;
+			}
+			s->state = STATE_NAMESPACE_FIELDS;
+			break;
+		default:
+			s->error = YAML_UNEXPECTED_STATE;
+			s->event_type = event->type;
+			return FAILURE;
+		}
+		break;
+
 	case STATE_DEVVALUES:
 		switch (event->type) {
 		case YAML_MAPPING_START_EVENT:
 		case YAML_SEQUENCE_START_EVENT:
 			break;
 		case YAML_MAPPING_END_EVENT:
-			dev = &s->ctx->envdevs[s->cdev];
-			if (check_env_device(dev) < 0) {
-				s->error = YAML_BAD_DEVICE;
-				s->event_type = event->type;
-				return FAILURE;
-			}
+			/* devices are checked after parsing */
 			s->cdev++;
 			break;
 		case YAML_SEQUENCE_END_EVENT:
@@ -335,11 +426,12 @@ static int consume_event(struct parser_state *s, yaml_event_t *event)
 		case YAML_SCALAR_EVENT:
 			dev = &s->ctx->envdevs[s->cdev];
 			value = (char *)event->data.scalar.value;
-			if (normalize_device_path(value, dev) < 0) {
+			if (strlen(value) >= sizeof(dev->devname)) {
 				s->error = YAML_BAD_DEVNAME;
 				s->event_type = event->type;
 				return FAILURE;
 			}
+			strcpy(dev->devname, value);
 			dev->envsize = s->ctx->size;
 			s->state = STATE_DEVVALUES;
 			break;
@@ -409,6 +501,11 @@ int parse_yaml_config(struct uboot_ctx **ctxlist, FILE *fp)
 	enum yaml_status status;
 	struct parser_state state;
 	struct uboot_ctx *ctx;
+	int ret;
+
+	ret = load_libyaml();
+	if (ret)
+		return ret;
 
 	if (!yaml_parser_initialize(&parser))
 		return -ENOMEM;
@@ -439,13 +536,8 @@ int parse_yaml_config(struct uboot_ctx **ctxlist, FILE *fp)
 	for (int i = 0; i < state.nelem; i++) {
 		ctx = &state.ctxsets[i];
 		ctx->ctxlist = &state.ctxsets[0];
-		if (ctx->redundant && !check_compatible_devices(ctx)) {
-			status = FAILURE;
-			break;
-		}
 	}
 
-
 cleanup:
 	yaml_parser_delete(&parser);
 	if (status == FAILURE) {
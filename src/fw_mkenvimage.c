@@ -0,0 +1,475 @@
+/*
+ * (C) Copyright 2026
+ * Stefano Babic, <stefano.babic@swupdate.org>
+ *
+ * SPDX-License-Identifier:     LGPL-2.1-or-later
+ */
+
+/**
+ * @file fw_mkenvimage.c
+ *
+ * @brief Generate environment images from a template
+ *
+ * A template environment is loaded once, then one image is
+ * generated for each record of overrides. Records use the same
+ * text format as fw_setenv --script and they are separated by
+ * an empty line. Images are generated by a pool of threads
+ * sharing the template.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "libuboot.h"
+
+#define MAX_JOBS	256
+
+static struct option long_options[] = {
+	{"version", no_argument, NULL, 'V'},
+	{"help", no_argument, NULL, 'h'},
+	{"size", required_argument, NULL, 's'},
+	{"redundant", no_argument, NULL, 'r'},
+	{"padding", required_argument, NULL, 'p'},
+	{"template", required_argument, NULL, 't'},
+	{"output", required_argument, NULL, 'o'},
+	{"key", required_argument, NULL, 'k'},
+	{"jobs", required_argument, NULL, 'j'},
+	{NULL, 0, NULL, 0}
+};
+
+struct record {
+	const char *text;
+	size_t len;
+};
+
+struct job {
+	/* template, only read by the workers */
+	struct uboot_ctx *ctx;
+	size_t size;
+	struct record *records;
+	size_t nrecords;
+	/* next record to be generated */
+	size_t next;
+	/* output directory, or file with all images one after the other */
+	const char *output;
+	bool todir;
+	int outfd;
+	const char *keyvar;
+	/* set by the first failing worker */
+	int error;
+};
+
+static void usage(char *program)
+{
+	fprintf(stdout, "%s (compiled %s)\n", program, __DATE__);
+	fprintf(stdout, "Usage %s [OPTION] [overrides]\n", program);
+	fprintf(stdout,
+		" -h, --help                       : print this help\n"
+		" -s, --size <bytes>               : size of the environment, header included\n"
+		" -r, --redundant                  : environment with flags byte (redundant copies)\n"
+		" -p, --padding <byte>             : fill after the environment, 0x00 (default) or 0xff\n"
+		" -t, --template <filename>        : template environment, same syntax as a script\n"
+		" -o, --output <file|directory>    : images one after the other in a file, or\n"
+		"                                    one file <key>.bin per image in a directory\n"
+		" -k, --key <name>                 : variable naming the images in a directory,\n"
+		"                                    by default the number of the record\n"
+		" -j, --jobs <n>                   : number of threads (default: online cpus)\n"
+		" -V, --version                    : print version and exit\n"
+		"\n"
+		"overrides is a file ('-' for stdin) with one record per image. Records have the\n"
+		"same syntax as a script and they are separated by an empty line, a file\n"
+		"without records is an error. Without overrides, just the template is written.\n"
+		);
+}
+
+/*
+ * The whole argument must be a number, "4k" or "-1" are refused
+ */
+static int parse_number(const char *arg, unsigned long *value)
+{
+	char *end;
+
+	errno = 0;
+	*value = strtoul(arg, &end, 0);
+	if (errno || end == arg || *end || strchr(arg, '-'))
+		return -EINVAL;
+
+	return 0;
+}
+
+static int read_input(const char *filename, char **out, size_t *outlen)
+{
+	size_t size = 65536, len = 0;
+	char *buf, *tmp;
+	ssize_t n;
+	int fd;
+
+	fd = strcmp(filename, "-") ? open(filename, O_RDONLY | O_CLOEXEC) : STDIN_FILENO;
+	if (fd < 0)
+		return -errno;
+
+	buf = malloc(size);
+	if (!buf) {
+		if (fd != STDIN_FILENO)
+			close(fd);
+		return -ENOMEM;
+	}
+
+	while ((n = read(fd, buf + len, size - len)) != 0) {
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			n = -errno;
+			free(buf);
+			if (fd != STDIN_FILENO)
+				close(fd);
+			return n;
+		}
+		len += n;
+		if (len == size) {
+			size *= 2;
+			tmp = realloc(buf, size);
+			if (!tmp) {
+				free(buf);
+				if (fd != STDIN_FILENO)
+					close(fd);
+				return -ENOMEM;
+			}
+			buf = tmp;
+		}
+	}
+	if (fd != STDIN_FILENO)
+		close(fd);
+
+	*out = buf;
+	*outlen = len;
+
+	return 0;
+}
+
+/*
+ * Split the input at empty lines. An empty line following
+ * an escaped newline belongs to the value.
+ */
+static int split_records(const char *buf, size_t len, struct record **out, size_t *nrecords)
+{
+	struct record *records = NULL, *tmp;
+	const char *p = buf, *end = buf + len, *eol, *start = NULL, *q;
+	size_t n = 0, size = 0, linelen;
+	bool escaped = false;
+
+	while (p < end) {
+		eol = memchr(p, '\n', end - p);
+		if (!eol)
+			eol = end;
+		linelen = eol - p;
+		if (linelen && p[linelen - 1] == '\r')
+			linelen--;
+
+		if (!linelen && !escaped) {
+			if (start) {
+				if (n == size) {
+					size = size ? size * 2 : 1024;
+					tmp = realloc(records, size * sizeof(*records));
+					if (!tmp) {
+						free(records);
+						return -ENOMEM;
+					}
+					records = tmp;
+				}
+				records[n].text = start;
+				records[n].len = p - start;
+				n++;
+				start = NULL;
+			}
+		} else if (!start) {
+			start = p;
+		}
+
+		/* odd number of trailing backslashes escapes the newline */
+		escaped = false;
+		for (q = p + linelen; q > p && q[-1] == '\\'; q--)
+			escaped = !escaped;
+
+		p = eol < end ? eol + 1 : end;
+	}
+
+	if (start) {
+		if (n == size) {
+			tmp = realloc(records, (size + 1) * sizeof(*records));
+			if (!tmp) {
+				free(records);
+				return -ENOMEM;
+			}
+			records = tmp;
+		}
+		records[n].text = start;
+		records[n].len = end - start;
+		n++;
+	}
+
+	*out = records;
+	*nrecords = n;
+
+	return 0;
+}
+
+/*
+ * Name of the image: value of the key variable in the record
+ * or the number of the record
+ */
+static int get_key(struct job *job, size_t idx, char *key, size_t keylen)
+{
+	const struct record *rec = &job->records[idx];
+	const char *p = rec->text, *end = rec->text + rec->len, *eol;
+	size_t namelen, len;
+	bool found = false;
+
+	if (job->keyvar) {
+		namelen = strlen(job->keyvar);
+		while (p < end) {
+			eol = memchr(p, '\n', end - p);
+			if (!eol)
+				eol = end;
+			if ((size_t)(eol - p) > namelen && !strncmp(p, job->keyvar, namelen) &&
+			    p[namelen] == '=') {
+				len = eol - p - namelen - 1;
+				if (len && p[namelen + len] == '\r')
+					len--;
+				if (!len || len >= keylen)
+					return -EINVAL;
+				memcpy(key, p + namelen + 1, len);
+				key[len] = '\0';
+				found = true;
+			}
+			p = eol + 1;
+		}
+		if (!found)
+			return -ENOENT;
+		if (strchr(key, '/') || !strcmp(key, ".") || !strcmp(key, ".."))
+			return -EINVAL;
+		return 0;
+	}
+
+	snprintf(key, keylen, "%zu", idx);
+
+	return 0;
+}
+
+static int write_image(struct job *job, size_t idx, const void *image)
+{
+	char key[256], *path;
+	ssize_t n;
+	int fd, ret;
+
+	if (!job->todir) {
+		n = pwrite(job->outfd, image, job->size, idx * job->size);
+		return n == job->size ? 0 : -EIO;
+	}
+
+	ret = get_key(job, idx, key, sizeof(key));
+	if (ret)
+		return ret;
+	if (asprintf(&path, "%s/%s.bin", job->output, key) < 0)
+		return -ENOMEM;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	free(path);
+	if (fd < 0)
+		return -errno;
+	n = write(fd, image, job->size);
+	ret = close(fd);
+
+	return (n == job->size && !ret) ? 0 : -EIO;
+}
+
+static void *worker(void *arg)
+{
+	struct job *job = arg;
+	void *image;
+	size_t idx;
+	int ret;
+
+	image = malloc(job->size);
+	if (!image) {
+		__atomic_store_n(&job->error, -ENOMEM, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	while (!__atomic_load_n(&job->error, __ATOMIC_RELAXED)) {
+		idx = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+		if (idx >= job->nrecords)
+			break;
+
+		ret = libuboot_serialize_overrides(job->ctx, job->records[idx].text,
+						   job->records[idx].len, image, job->size);
+		if (ret >= 0)
+			ret = write_image(job, idx, image);
+		if (ret < 0) {
+			fprintf(stderr, "Record %zu: %s\n", idx, strerror(-ret));
+			__atomic_store_n(&job->error, ret, __ATOMIC_RELAXED);
+			break;
+		}
+	}
+	free(image);
+
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	struct job job;
+	struct record single = { "", 0 };
+	pthread_t threads[MAX_JOBS];
+	char *options = "Vhs:rp:t:o:k:j:";
+	char *progname;
+	char *template = NULL;
+	char *input = NULL;
+	size_t inputlen = 0;
+	unsigned long jobs = 0;
+	bool redundant = false;
+	unsigned long padding = 0;
+	unsigned long size = 0;
+	struct stat st;
+	unsigned int i, started;
+	int c, ret;
+
+	memset(&job, 0, sizeof(job));
+	job.outfd = -1;
+
+	progname = strrchr(argv[0], '/');
+	progname = progname ? progname + 1 : argv[0];
+
+	while ((c = getopt_long(argc, argv, options,
+				long_options, NULL)) != EOF) {
+		switch (c) {
+		case 's':
+			if (parse_number(optarg, &size)) {
+				fprintf(stderr, "Invalid size %s\n", optarg);
+				exit(1);
+			}
+			job.size = size;
+			break;
+		case 'r':
+			redundant = true;
+			break;
+		case 'p':
+			if (parse_number(optarg, &padding)) {
+				fprintf(stderr, "Invalid padding %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 't':
+			template = optarg;
+			break;
+		case 'o':
+			job.output = optarg;
+			break;
+		case 'k':
+			job.keyvar = optarg;
+			break;
+		case 'j':
+			if (parse_number(optarg, &jobs)) {
+				fprintf(stderr, "Invalid number of jobs %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'V':
+			fprintf(stdout, "%s %u\n", libuboot_version_info()->version, libuboot_version_info()->version_num);
+			exit(0);
+		case 'h':
+			usage(progname);
+			exit(0);
+		default:
+			usage(progname);
+			exit(1);
+		}
+	}
+
+	if (!job.size || !job.output || argc - optind > 1) {
+		usage(progname);
+		exit(1);
+	}
+
+	if (!jobs) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		jobs = cpus > 0 ? cpus : 1;
+	}
+	if (jobs > MAX_JOBS)
+		jobs = MAX_JOBS;
+
+	ret = libuboot_initialize(&job.ctx, NULL);
+	if (!ret)
+		ret = libuboot_configure_image(job.ctx, job.size, redundant);
+	if (!ret)
+		ret = libuboot_set_padding(job.ctx, padding);
+	if (ret) {
+		fprintf(stderr, "Cannot set up the environment: %s\n", strerror(-ret));
+		exit(1);
+	}
+
+	if (template) {
+		ret = libuboot_load_file(job.ctx, template);
+		if (ret) {
+			fprintf(stderr, "Cannot read template %s: %s\n", template, strerror(-ret));
+			exit(1);
+		}
+	}
+
+	if (optind < argc) {
+		ret = read_input(argv[optind], &input, &inputlen);
+		if (!ret)
+			ret = split_records(input, inputlen, &job.records, &job.nrecords);
+		/* no image to generate is an error, not an empty output */
+		if (!ret && !job.nrecords)
+			ret = -ENODATA;
+		if (ret) {
+			fprintf(stderr, "Cannot read overrides %s: %s\n", argv[optind], strerror(-ret));
+			exit(1);
+		}
+	} else {
+		job.records = &single;
+		job.nrecords = 1;
+	}
+
+	job.todir = !stat(job.output, &st) && S_ISDIR(st.st_mode);
+	if (!job.todir) {
+		job.outfd = open(job.output, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (job.outfd < 0) {
+			fprintf(stderr, "Cannot open %s: %s\n", job.output, strerror(errno));
+			exit(1);
+		}
+	}
+
+	if (jobs > job.nrecords)
+		jobs = job.nrecords;
+	for (started = 0; started < jobs; started++) {
+		if (pthread_create(&threads[started], NULL, worker, &job))
+			break;
+	}
+	if (!started)
+		worker(&job);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	if (job.outfd >= 0 && close(job.outfd) && !job.error)
+		job.error = -EIO;
+
+	if (job.records != &single)
+		free(job.records);
+	free(input);
+	libuboot_exit(job.ctx);
+
+	return job.error ? 1 : 0;
+}
@@ -13,8 +13,10 @@
 #include <getopt.h>
 #include <string.h>
 #include <stdbool.h>
+#include <errno.h>
 
 #include "libuboot.h"
+#include "ubootenvd.h"
 
 #ifndef DEFAULT_CFG_FILE
 #define DEFAULT_CFG_FILE "/etc/fw_env.config"
@@ -26,6 +28,10 @@
 
 #define PROGRAM_SET	"fw_setenv"
 
+/* long only options */
+#define OPT_STATS	0x100
+#define OPT_INCREMENT	0x101
+
 static struct option long_options[] = {
 	{"version", no_argument, NULL, 'V'},
 	{"no-header", no_argument, NULL, 'n'},
@@ -34,6 +40,10 @@ static struct option long_options[] = {
 	{"defenv", required_argument, NULL, 'f'},
 	{"script", required_argument, NULL, 's'},
 	{"namespace", required_argument, NULL, 'm'},
+	{"socket", required_argument, NULL, 'S'},
+	{"batch", required_argument, NULL, 'b'},
+	{"stats", no_argument, NULL, OPT_STATS},
+	{"increment", required_argument, NULL, OPT_INCREMENT},
 	{NULL, 0, NULL, 0}
 };
 
@@ -47,6 +57,9 @@ static void usage(char *program, bool setprogram)
 		" -c, --config <filename>          : configuration file (by default: " DEFAULT_CFG_FILE ")\n"
 		" -f, --defenv <filename>          : default environment if no one found (by default: " DEFAULT_ENV_FILE ")\n"
 		" -m, --namespace <name>           : chose one of sets in the YAML file, default first in YAML\n"
+		" -S, --socket <path>              : ubootenvd socket (by default: " DEFAULT_SOCKET_PATH ")\n"
+		" -b, --batch <filename>           : run commands from file ('-' for stdin), see below\n"
+		"     --stats                      : print timings and counters on stderr\n"
 		" -V, --version                    : print version and exit\n"
 	);
 	if (!setprogram)
@@ -56,11 +69,13 @@ static void usage(char *program, bool setprogram)
 	else
 		fprintf(stdout,
 		" -s, --script <filename>          : read variables to be set from a script\n"
+		"     --increment <name>           : increment a number (boot counter) in place\n"
 		"\n"
 		"Script Syntax:\n"
 		" key=value\n"
 		" lines starting with '#' are treated as comment\n"
 		" lines without '=' are ignored\n"
+		" a backslash at the end of a line continues the value on the next one\n"
 		"\n"
 		"Script Example:\n"
 		" netdev=eth0\n"
@@ -69,14 +84,322 @@ static void usage(char *program, bool setprogram)
 		" bar\n"
 		"\n"
 		);
+	fprintf(stdout,
+		"\n"
+		"Batch Commands:\n"
+		" get <name>\n"
+		" set <name> <value>              : without value the variable is deleted\n"
+		" delete <name>\n"
+		" list\n"
+		" Each answer is \"OK <n>\" or \"ERR <errno>\", followed by n lines\n"
+		" \"<length> <data>\". Changes are stored once at the end.\n"
+		);
+}
+
+static void print_item(const char *data, size_t len, void *priv)
+{
+	(void)priv;
+	fwrite(data, 1, len, stdout);
+	fputc('\n', stdout);
+}
+
+static void get_item(const char *data, size_t len, void *priv)
+{
+	char **value = priv;
+
+	(void)len;
+	*value = strdup(data);
+}
+
+static int client_set(struct ubootenvd_client *cl, const char *namespace,
+		      const char *name, const char *value)
+{
+	int ret;
+
+	if (value)
+		ret = ubootenvd_request(cl, "set", namespace, name, value, NULL, NULL);
+	else
+		ret = ubootenvd_request(cl, "del", namespace, name, NULL, NULL, NULL);
+	if (ret)
+		fprintf(stderr, "libuboot_set_env failed: %d\n", ret);
+
+	return ret;
+}
+
+struct client_import {
+	struct ubootenvd_client *cl;
+	const char *namespace;
+	struct uboot_ctx *mirror;
+	int ret;
+};
+
+static void mirror_item(const char *data, size_t len, void *priv)
+{
+	struct client_import *imp = priv;
+	char *name, *value;
+
+	(void)len;
+	name = strdup(data);
+	if (!name) {
+		imp->ret = -ENOMEM;
+		return;
+	}
+	value = strchr(name, '=');
+	if (value) {
+		*value++ = '\0';
+		libuboot_set_env(imp->mirror, name, value);
+	}
+	free(name);
+}
+
+static void import_change(const char *name, const char *oldvalue,
+			  const char *newvalue, void *priv)
+{
+	struct client_import *imp = priv;
+
+	(void)oldvalue;
+	if (!imp->ret)
+		imp->ret = client_set(imp->cl, imp->namespace, name, newvalue);
+}
+
+/*
+ * The script is parsed by the library as with direct access, on a
+ * copy of the environment served by the daemon: each change found
+ * is sent as a set or a delete.
+ */
+static int client_script(struct ubootenvd_client *cl, const char *namespace,
+			 const char *scriptfile)
+{
+	struct client_import imp = {
+		.cl = cl,
+		.namespace = namespace,
+	};
+	int ret;
+
+	ret = libuboot_initialize(&imp.mirror, NULL);
+	if (ret)
+		return ret;
+
+	ret = ubootenvd_request(cl, "list", namespace, NULL, NULL,
+				mirror_item, &imp);
+	if (!ret)
+		ret = imp.ret;
+	if (!ret) {
+		ret = libuboot_import_file(imp.mirror, scriptfile,
+					   import_change, &imp);
+		if (ret < 0)
+			fprintf(stderr, "Error reading %s: %d\n", scriptfile, ret);
+		else
+			ret = imp.ret;
+	}
+
+	libuboot_exit(imp.mirror);
+
+	return ret;
+}
+
+/*
+ * Run the command through ubootenvd. It returns -ENOTCONN
+ * if the daemon is not running, and the caller accesses
+ * the environment directly.
+ */
+static int run_client(const char *sockname, const char *namespace,
+		      bool is_setenv, bool noheader, const char *scriptfile,
+		      int argc, char **argv)
+{
+	struct ubootenvd_client cl;
+	char *value;
+	int i, ret;
+
+	if (access(sockname, F_OK))
+		return -ENOTCONN;
+	if (ubootenvd_connect(&cl, sockname))
+		return -ENOTCONN;
+
+	if (!is_setenv) {
+		if (!argc) {
+			ret = ubootenvd_request(&cl, "list", namespace, NULL, NULL,
+						print_item, NULL);
+		} else {
+			for (i = 0, ret = 0; i < argc && !ret; i++) {
+				value = NULL;
+				ret = ubootenvd_request(&cl, "get", namespace, argv[i],
+							NULL, get_item, &value);
+				if (ret == -ENOENT)
+					ret = 0;
+				if (noheader)
+					fprintf(stdout, "%s\n", value ? value : "");
+				else
+					fprintf(stdout, "%s=%s\n", argv[i], value ? value : "");
+				free(value);
+			}
+		}
+	} else {
+		if (scriptfile)
+			ret = client_script(&cl, namespace, scriptfile);
+		else
+			for (i = 0, ret = 0; i < argc && !ret; i += 2)
+				ret = client_set(&cl, namespace, argv[i],
+						 i + 1 == argc ? NULL : argv[i + 1]);
+		if (!ret) {
+			ret = ubootenvd_request(&cl, "store", namespace, NULL, NULL,
+						NULL, NULL);
+			if (ret)
+				fprintf(stderr, "Error storing the env\n");
+		}
+	}
+
+	ubootenvd_disconnect(&cl);
+	if (ret == -ENOENT)
+		fprintf(stderr, "Namespace %s not found\n", namespace);
+
+	return ret;
+}
+
+/*
+ * Show what a script really changes, unchanged
+ * variables are not reported.
+ */
+static void report_change(const char *name, const char *oldvalue,
+			  const char *newvalue, void *priv)
+{
+	(void)oldvalue;
+	(void)priv;
+
+	if (newvalue)
+		fprintf(stdout, "set %s=%s\n", name, newvalue);
+	else
+		fprintf(stdout, "delete %s\n", name);
+}
+
+/*
+ * Run get/set/delete/list commands against the opened context
+ * and answer them in the ubootenvd format
+ */
+static int run_batch(struct uboot_ctx *ctx, const char *batchfile, bool *need_store)
+{
+	FILE *fp;
+	char *line = NULL, *args, *cmd, *name, *value;
+	size_t bufsize = 0;
+	ssize_t len;
+	unsigned int items;
+	void *tmp;
+	int ret;
+
+	fp = strcmp(batchfile, "-") ? fopen(batchfile, "r") : stdin;
+	if (!fp) {
+		fprintf(stderr, "Cannot open %s\n", batchfile);
+		return -EACCES;
+	}
+
+	while ((len = getline(&line, &bufsize, fp)) != -1) {
+		while (len && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			line[--len] = '\0';
+
+		if (len == 0 || line[0] == '#')
+			continue;
+
+		args = line;
+		cmd = strsep(&args, " ");
+		name = strsep(&args, " ");
+
+		if (!strcmp(cmd, "list")) {
+			items = 0;
+			tmp = NULL;
+			while ((tmp = libuboot_iterator(ctx, tmp)) != NULL)
+				items++;
+			ubootenvd_put_header(stdout, 0, items);
+			tmp = NULL;
+			while ((tmp = libuboot_iterator(ctx, tmp)) != NULL)
+				ubootenvd_put_pair(stdout, libuboot_getname(tmp),
+						   libuboot_getvalue(tmp));
+			continue;
+		}
+
+		if (!name || !*name) {
+			ubootenvd_put_header(stdout, -EINVAL, 0);
+			continue;
+		}
+
+		if (!strcmp(cmd, "get")) {
+			value = libuboot_get_env(ctx, name);
+			if (value) {
+				ubootenvd_put_header(stdout, 0, 1);
+				ubootenvd_put_item(stdout, value, strlen(value));
+				free(value);
+			} else {
+				ubootenvd_put_header(stdout, -ENOENT, 0);
+			}
+		} else if (!strcmp(cmd, "set") || !strcmp(cmd, "delete")) {
+			char *old = libuboot_get_env(ctx, name);
+
+			value = (cmd[0] == 's' && args && *args) ? args : NULL;
+			ret = 0;
+			if (value ? (!old || strcmp(old, value)) : old != NULL) {
+				ret = libuboot_set_env(ctx, name, value);
+				if (!ret)
+					*need_store = true;
+			}
+			free(old);
+			ubootenvd_put_header(stdout, ret, 0);
+		} else {
+			ubootenvd_put_header(stdout, -EINVAL, 0);
+		}
+	}
+
+	free(line);
+	if (fp != stdin)
+		fclose(fp);
+	fflush(stdout);
+
+	return 0;
+}
+
+static void print_stats(struct uboot_ctx *ctx)
+{
+	struct libuboot_flash_counters counters;
+	struct libuboot_stats stats;
+	unsigned int i;
+
+	if (libuboot_get_stats(ctx, &stats))
+		return;
+
+	for (i = 0; i < LIBUBOOT_STATS_PHASES; i++) {
+		if (!stats.total[i].calls)
+			continue;
+		fprintf(stderr, "%s: calls=%llu bytes=%llu time_us=%llu "
+			"last_calls=%llu last_bytes=%llu last_time_us=%llu\n",
+			libuboot_stats_phase_name(i),
+			stats.total[i].calls, stats.total[i].bytes,
+			stats.total[i].ns / 1000,
+			stats.last[i].calls, stats.last[i].bytes,
+			stats.last[i].ns / 1000);
+	}
+
+	/* raw flash only, the wear caused by this run */
+	for (i = 0; i < 2; i++) {
+		if (libuboot_get_flash_counters(ctx, i, &counters) ||
+		    !(counters.erases + counters.erases_skipped +
+		      counters.erases_skipped_nand + counters.programs))
+			continue;
+		fprintf(stderr, "copy%u: erases=%llu erases_skipped=%llu "
+			"erases_skipped_nand=%llu programs=%llu "
+			"bytes_written=%llu badblocks=%llu\n", i,
+			counters.erases, counters.erases_skipped,
+			counters.erases_skipped_nand, counters.programs,
+			counters.bytes_written, counters.badblocks);
+	}
 }
 
 int main (int argc, char **argv) {
 	struct uboot_ctx *ctx = NULL;
-	char *options = "Vc:f:s:nhm:";
+	char *options = "Vc:f:s:nhm:S:b:";
 	char *cfgfname = NULL;
+	char *sockname = NULL;
 	char *defenvfile = NULL;
 	char *scriptfile = NULL;
+	char *batchfile = NULL;
+	char *increment = NULL;
 	const char *namespace = NULL;
 	int c, i;
 	int ret = 0;
@@ -86,6 +409,7 @@ int main (int argc, char **argv) {
 	bool is_setenv = false;
 	bool noheader = false;
 	bool default_used = false;
+	bool stats = false;
 
 	/*
 	 * As old tool, there is just a tool with symbolic link
@@ -125,12 +449,36 @@ int main (int argc, char **argv) {
 		case 's':
 			scriptfile = strdup(optarg);
 			break;
+		case 'S':
+			sockname = strdup(optarg);
+			break;
+		case 'b':
+			batchfile = strdup(optarg);
+			break;
+		case OPT_STATS:
+			stats = true;
+			break;
+		case OPT_INCREMENT:
+			increment = strdup(optarg);
+			break;
 		}
 	}
 
 	argc -= optind;
 	argv += optind;
 
+	/*
+	 * ubootenvd serves the default configuration: use it
+	 * when it is running, unless another setup is requested.
+	 * Batches, statistics and counters need a directly opened environment.
+	 */
+	if (!batchfile && !stats && !increment && (sockname || (!cfgfname && !defenvfile))) {
+		ret = run_client(sockname ? sockname : DEFAULT_SOCKET_PATH,
+				 namespace ? namespace : libuboot_namespace_from_dt(),
+				 is_setenv, noheader, scriptfile, argc, argv);
+		if (ret != -ENOTCONN)
+			exit(ret < 0 ? -ret : ret);
+	}
 
 	if (!cfgfname)
 		cfgfname = DEFAULT_CFG_FILE;
@@ -155,6 +503,20 @@ int main (int argc, char **argv) {
 		exit (1);
 	}
 
+	/*
+	 * The counter is patched on the storage, without loading
+	 * the environment
+	 */
+	if (increment) {
+		ret = libuboot_env_increment(ctx, increment, 1, NULL);
+		if (ret)
+			fprintf(stderr, "Cannot increment %s: %s\n", increment, strerror(-ret));
+		if (stats)
+			print_stats(ctx);
+		libuboot_exit(ctx);
+		exit(-ret);
+	}
+
 	if (!defenvfile)
 		defenvfile = DEFAULT_ENV_FILE;
 
@@ -167,7 +529,16 @@ int main (int argc, char **argv) {
 		default_used = true;
 	}
 
-	if (!is_setenv) {
+	if (batchfile) {
+		bool need_store = false;
+
+		ret = run_batch(ctx, batchfile, &need_store);
+		if (!ret && need_store) {
+			ret = libuboot_env_store(ctx);
+			if (ret)
+				fprintf(stderr, "Error storing the env\n");
+		}
+	} else if (!is_setenv) {
 		/* No variable given, print all environment */
 		if (!argc) {
 			tmp = NULL;
@@ -188,8 +559,13 @@ int main (int argc, char **argv) {
 	} else { /* setenv branch */
 		bool need_store = false;
 		if (scriptfile) {
-			libuboot_load_file(ctx, scriptfile);
-			need_store = true;
+			ret = libuboot_import_file(ctx, scriptfile, report_change, NULL);
+			if (ret < 0) {
+				fprintf(stderr, "Cannot apply script %s: %d\n", scriptfile, ret);
+				exit(-ret);
+			}
+			need_store = ret > 0;
+			ret = 0;
 		} else {
 			for (i = 0; i < argc; i += 2) {
 				value = libuboot_get_env(ctx, argv[i]);
@@ -228,6 +604,9 @@ int main (int argc, char **argv) {
 		}
 	}
 
+	if (stats)
+		print_stats(ctx);
+
 	libuboot_close(ctx);
 	libuboot_exit(ctx);
 
@@ -35,6 +35,75 @@ struct uboot_env_device {
 	unsigned long 	envsectors;
 };
 
+/** Operations on a raw flash (MTD or simulated) copy
+ *
+ */
+struct libuboot_flash_counters {
+	/** erase operations, one for each sector */
+	unsigned long long erases;
+	/** program operations */
+	unsigned long long programs;
+	/** programmed bytes */
+	unsigned long long bytes_written;
+	/** bad blocks skipped */
+	unsigned long long badblocks;
+	/** erases skipped on NOR, the sectors were already blank */
+	unsigned long long erases_skipped;
+	/** erases skipped on NAND, the copy was erased under the current lock */
+	unsigned long long erases_skipped_nand;
+};
+
+/** Phases measured by libuboot_get_stats()
+ *
+ */
+enum libuboot_stats_phase {
+	/** libuboot_open() as a whole */
+	LIBUBOOT_STATS_OPEN,
+	/** libuboot_env_store() as a whole */
+	LIBUBOOT_STATS_STORE,
+	/** waiting for the lock */
+	LIBUBOOT_STATS_LOCK,
+	/** reading copies or headers from the storage */
+	LIBUBOOT_STATS_READ,
+	/** CRC of loaded and stored copies */
+	LIBUBOOT_STATS_CRC,
+	/** parsing the variables of the current copy */
+	LIBUBOOT_STATS_PARSE,
+	/** building the copy to be stored */
+	LIBUBOOT_STATS_SERIALIZE,
+	/** writing a copy, erase and program included */
+	LIBUBOOT_STATS_WRITE,
+	/** erasing sectors on raw flash */
+	LIBUBOOT_STATS_ERASE,
+	/** programming sectors on raw flash */
+	LIBUBOOT_STATS_PROGRAM,
+	/** flushing the written copy (fsync) */
+	LIBUBOOT_STATS_SYNC,
+	LIBUBOOT_STATS_PHASES
+};
+
+/** Counters of one phase
+ *
+ */
+struct libuboot_phase_stats {
+	/** number of calls (system calls for lock, erase, program and sync) */
+	unsigned long long calls;
+	/** bytes read, checked, parsed or written */
+	unsigned long long bytes;
+	/** time in nanoseconds */
+	unsigned long long ns;
+};
+
+/** Statistics of a context
+ *
+ */
+struct libuboot_stats {
+	/** since the context was created */
+	struct libuboot_phase_stats total[LIBUBOOT_STATS_PHASES];
+	/** in the last libuboot_open(), libuboot_refresh() or libuboot_env_store() */
+	struct libuboot_phase_stats last[LIBUBOOT_STATS_PHASES];
+};
+
 /** Static structure to return version ionformation
  *
  */
@@ -67,6 +136,19 @@ int libuboot_read_config(struct uboot_ctx *ctx, const char *config);
  */
 int libuboot_read_config_ext(struct uboot_ctx **ctx, const char *config);
 
+/** @brief Read U-Boot environment configuration from memory
+ *
+ * Same as libuboot_read_config_ext(), but the configuration
+ * (legacy or YAML) is passed as a buffer. The buffer is not
+ * modified and it is not referenced after the call.
+ *
+ * @param[in] pointer to array of ctx libuboot context
+ * @param[in] buf configuration, it does not need to be NUL terminated
+ * @param[in] len length of the configuration
+ * @return 0 in case of success, else negative value
+ */
+int libuboot_read_config_mem(struct uboot_ctx **ctx, const char *buf, size_t len);
+
 /** @brief Get ctx from namespace
  *
  * @param[in] ctxlist libuboot context array
@@ -98,7 +180,9 @@ int libuboot_configure(struct uboot_ctx *ctx,
  * U-Boot does with "env import -t"
  * The file has the format:
  * < variable name >=< value >
- * Comments starting with "#" are allowed.
+ * Comments starting with "#" are allowed. A backslash at the end
+ * of a line continues the value on the next one, any other
+ * backslash is part of the value.
  *
  * @param[in] ctx libuboot context
  * @param[in] filename path to the file to be imported
@@ -106,6 +190,147 @@ int libuboot_configure(struct uboot_ctx *ctx,
  */
 int libuboot_load_file(struct uboot_ctx *ctx, const char *filename);
 
+/** @brief Import environment from memory
+ *
+ * Same as libuboot_load_file(), but the variables are passed
+ * as a buffer, for example a built-in default environment.
+ *
+ * @param[in] ctx libuboot context
+ * @param[in] buf environment in text format, it does not need to be NUL terminated
+ * @param[in] len length of the environment
+ * @return 0 in case of success, else negative value
+ */
+int libuboot_load_env_mem(struct uboot_ctx *ctx, const char *buf, size_t len);
+
+/** @brief Set the layout of a context without devices
+ *
+ * A context created by libuboot_initialize() without devices
+ * can be used with libuboot_load_image() and
+ * libuboot_serialize_image() once the layout is known.
+ *
+ * @param[in] ctx libuboot context
+ * @param[in] size size of one copy of the environment, header included
+ * @param[in] redundant non zero if the copies have the flags byte
+ * @return 0 in case of success, -EBUSY if the context has devices,
+ * else negative value
+ */
+int libuboot_configure_image(struct uboot_ctx *ctx, size_t size, int redundant);
+
+/** @brief Allow erasing the obsolete copy ahead of the next store
+ *
+ * Enables libuboot_erase_ahead() for the context. The same is set
+ * in the YAML configuration with "eraseahead : yes".
+ *
+ * @param[in] ctx libuboot context
+ * @param[in] enable non zero to erase ahead
+ * @return 0 in case of success, else negative value
+ */
+int libuboot_set_erase_ahead(struct uboot_ctx *ctx, int enable);
+
+/** @brief Erase the obsolete copy now
+ *
+ * On raw flash (NOR and NAND) with a redundant environment, erase
+ * the copy that is not the current one, so that the next store just
+ * programs it. The application calls it when the time spent does
+ * not matter, for example when idle after a store. The old
+ * environment is not kept as a fallback any more. The lock is taken
+ * if the caller does not hold it, and nothing is erased if another
+ * process wrote the copy meanwhile. On NAND a block reading as
+ * erased cannot be trusted, so the erase is done only if the caller
+ * holds the lock until the next store. The erases are in the
+ * counters and in the statistics of the context.
+ *
+ * @param[in] ctx libuboot context
+ * @return 0 in case of success or if there is nothing to erase
+ * (erase ahead not enabled, no raw flash), else negative value
+ */
+int libuboot_erase_ahead(struct uboot_ctx *ctx);
+
+/** @brief Set the byte filling a copy after the environment
+ *
+ * The default is 0x00, as U-Boot does. With 0xFF the padding reads
+ * as erased flash and on raw flash the trailing pages of a copy
+ * holding just padding are not programmed at all. The CRC covers
+ * the padding in both cases. The same is set in the YAML
+ * configuration with "padding : 0xff".
+ *
+ * @param[in] ctx libuboot context
+ * @param[in] padding 0x00 or 0xFF
+ * @return 0 in case of success, else negative value
+ */
+int libuboot_set_padding(struct uboot_ctx *ctx, unsigned int padding);
+
+/** How the copies of a redundant environment are read
+ */
+enum libuboot_read_mode {
+	/** in parallel on flash or when more than one CPU is online */
+	LIBUBOOT_READ_AUTO,
+	/** one copy after the other */
+	LIBUBOOT_READ_SEQUENTIAL,
+	/** the second copy on its own thread */
+	LIBUBOOT_READ_PARALLEL,
+};
+
+/** @brief Choose how the copies are read and checked
+ *
+ * By default (LIBUBOOT_READ_AUTO) the second copy of a redundant
+ * environment is read and checked on another thread when the reads
+ * wait for the flash or when the CRCs can run on two CPUs.
+ *
+ * @param[in] ctx libuboot context
+ * @param[in] mode one of enum libuboot_read_mode
+ * @return 0 in case of success, else negative value
+ */
+int libuboot_set_read_mode(struct uboot_ctx *ctx, enum libuboot_read_mode mode);
+
+/** @brief Load the environment from an image in memory
+ *
+ * The image has the layout of the context: one copy, or both
+ * copies one after the other for a redundant environment, in
+ * which case the current copy is selected as for the storage.
+ * The variables of the context are replaced.
+ *
+ * @param[in] ctx libuboot context
+ * @param[in] image environment image
+ * @param[in] len size of the image
+ * @return 0 in case of success, -ENODATA if no copy is valid,
+ * else negative value
+ */
+int libuboot_load_image(struct uboot_ctx *ctx, const void *image, size_t len);
+
+/** @brief Serialize the environment into an image in memory
+ *
+ * One copy is written with header, CRC, flags and .flags, as
+ * libuboot_env_store() would write it. Nothing is written to
+ * the storage and the context is not changed.
+ *
+ * @param[in] ctx libuboot context
+ * @param[out] buf destination
+ * @param[in] len size of buf, at least the size of the environment
+ * @return size of the image in case of success, else negative value
+ */
+int libuboot_serialize_image(struct uboot_ctx *ctx, void *buf, size_t len);
+
+/** @brief Serialize the environment with some variables overridden
+ *
+ * Same as libuboot_serialize_image(), but the variables in text
+ * (same format as libuboot_load_file()) are applied on top of the
+ * ones in the context, with the same rules as libuboot_set_env().
+ * The context is only read, so more threads can generate images
+ * from the same template context at the same time, as long as
+ * nobody changes it.
+ *
+ * @param[in] ctx libuboot context, used as template
+ * @param[in] text variables to set or drop
+ * @param[in] textlen length of text
+ * @param[out] buf destination
+ * @param[in] len size of buf, at least the size of the environment
+ * @return size of the image in case of success, -EPERM if a variable
+ * cannot be set, else negative value
+ */
+int libuboot_serialize_overrides(struct uboot_ctx *ctx, const char *text,
+				 size_t textlen, void *buf, size_t len);
+
 /** @brief Flush environment to the storage
  *
  * Write the environment back to the storage and handle
@@ -116,6 +341,164 @@ int libuboot_load_file(struct uboot_ctx *ctx, const char *filename);
  */
 int libuboot_env_store(struct uboot_ctx *ctx);
 
+/** Callback reporting the end of an asynchronous store
+ *
+ * It runs on the worker thread and it must not call the library
+ * on the same context.
+ */
+typedef void (*libuboot_store_cb)(struct uboot_ctx *ctx, int result, void *priv);
+
+/** @brief Flush environment to the storage without waiting
+ *
+ * The variables are serialized before returning, so they can be
+ * changed at once without affecting the stored environment. Writing
+ * the copy (erase, program, sync) runs on a worker thread under the
+ * lock owned by the context. Completion is reported by cb (if set),
+ * by the descriptor from libuboot_env_store_fd() and by
+ * libuboot_env_store_wait(). libuboot_get_env(), libuboot_set_env()
+ * and the iterator can be used meanwhile. The functions accessing the
+ * storage or the lock (store, open, close, unlock, refresh) wait for
+ * the running store first.
+ *
+ * @param[in] ctx libuboot context
+ * @param[in] cb callback at the end of the store, can be NULL
+ * @param[in] priv passed to cb
+ * @return 0 if the store was started, -EBUSY if one is still running
+ * (a finished one is waited for first), else negative value
+ */
+int libuboot_env_store_async(struct uboot_ctx *ctx, libuboot_store_cb cb, void *priv);
+
+/** @brief Wait for an asynchronous store
+ *
+ * @param[in] ctx libuboot context
+ * @return result of the last asynchronous store, 0 if there was none
+ */
+int libuboot_env_store_wait(struct uboot_ctx *ctx);
+
+/** @brief Descriptor signalled by asynchronous stores
+ *
+ * An eventfd that becomes readable (poll/epoll) each time an
+ * asynchronous store completes. Read it to clear the event and
+ * call libuboot_env_store_wait() to get the result, it does not
+ * block at that point. The descriptor belongs to the context and
+ * it is closed by libuboot_exit().
+ *
+ * @param[in] ctx libuboot context
+ * @return file descriptor in case of success, else negative value
+ */
+int libuboot_env_store_fd(struct uboot_ctx *ctx);
+
+/** @brief Coalesce the stores of frequently changing variables
+ *
+ * libuboot_env_store_deferred() stores only when no store was
+ * requested for debounce_ms, but not later than maxdelay_ms after
+ * the first pending request, so that a burst of changes costs one
+ * erase cycle. Without a delay (the default) it stores at once.
+ *
+ * @param[in] ctx libuboot context
+ * @param[in] debounce_ms time without requests before storing
+ * @param[in] maxdelay_ms maximum delay of a request, 0 for no limit
+ * @return 0 in case of success, else negative value
+ */
+int libuboot_set_store_delay(struct uboot_ctx *ctx, unsigned int debounce_ms,
+			     unsigned int maxdelay_ms);
+
+/** @brief Request a store, coalesced with the following ones
+ *
+ * The store happens in a later call when its time has come, in
+ * libuboot_env_flush() or in libuboot_close(), whichever is first.
+ * Applications with an event loop use libuboot_env_flush_timeout()
+ * to call libuboot_env_flush() on time.
+ *
+ * @param[in] ctx libuboot context
+ * @return 0 in case of success (stored or pending), else negative value
+ */
+int libuboot_env_store_deferred(struct uboot_ctx *ctx);
+
+/** @brief Store now if a deferred store is pending
+ *
+ * libuboot_close() does the same, but it cannot report errors.
+ *
+ * @param[in] ctx libuboot context
+ * @return 0 in case of success or nothing pending, else negative value
+ */
+int libuboot_env_flush(struct uboot_ctx *ctx);
+
+/** @brief Time left before a pending deferred store
+ *
+ * @param[in] ctx libuboot context
+ * @return milliseconds (0 if it is due), -1 if nothing is pending
+ */
+int libuboot_env_flush_timeout(struct uboot_ctx *ctx);
+
+/** @brief Increment a number on the storage
+ *
+ * Read-modify-write of a decimal or hex variable (a boot counter),
+ * atomic under the lock. It does not need libuboot_open(): the
+ * current copy is patched in place and written as the next one,
+ * without parsing and serializing the environment. If the length
+ * of the value does not change, the CRC is updated from the bytes
+ * that changed. The format of the value (0x prefix, case, leading
+ * zeroes) is kept. The type is taken from .flags or from the
+ * configuration, untyped variables are accepted if they hold a
+ * number. If the context has the variables loaded, the variable is
+ * updated too.
+ *
+ * @param[in] ctx libuboot context
+ * @param[in] varname variable name, it must be already set
+ * @param[in] delta added to the value, can be negative
+ * @param[out] value the new value, can be NULL
+ * @return 0 in case of success, -ENOENT if the variable is not set,
+ * -EINVAL if it is not a number, -ERANGE on overflow, -EPERM if it
+ * cannot be changed, else negative value
+ */
+int libuboot_env_increment(struct uboot_ctx *ctx, const char *varname,
+			   long long delta, unsigned long long *value);
+
+/** @brief Set a number on the storage
+ *
+ * As libuboot_env_increment(), setting the value.
+ *
+ * @param[in] ctx libuboot context
+ * @param[in] varname variable name, it must be already set
+ * @param[in] value new value
+ * @return 0 in case of success, else negative value
+ */
+int libuboot_env_set_number(struct uboot_ctx *ctx, const char *varname,
+			    unsigned long long value);
+
+/** @brief Get the flash counters of a copy
+ *
+ * The counters are cumulative since the context was created
+ * and they stay at zero for devices that are not raw flash.
+ *
+ * @param[in] ctx libuboot context
+ * @param[in] copy 0 or 1, the device in the configuration
+ * @param[out] counters destination
+ * @return 0 in case of success, else negative value
+ */
+int libuboot_get_flash_counters(struct uboot_ctx *ctx, unsigned int copy,
+				struct libuboot_flash_counters *counters);
+
+/** @brief Get timings and counters of a context
+ *
+ * Each phase of loading and storing the environment is measured,
+ * so that a slow operation can be attributed to lock contention,
+ * storage access or processing.
+ *
+ * @param[in] ctx libuboot context
+ * @param[out] stats destination
+ * @return 0 in case of success, else negative value
+ */
+int libuboot_get_stats(struct uboot_ctx *ctx, struct libuboot_stats *stats);
+
+/** @brief Name of a phase
+ *
+ * @param[in] phase one of libuboot_stats_phase
+ * @return short name, NULL for an unknown phase
+ */
+const char *libuboot_stats_phase_name(unsigned int phase);
+
 /** @brief Initialize the library
  *
  * Initialize the library and get the context structure
@@ -129,6 +512,8 @@ int libuboot_initialize(struct uboot_ctx **out,
 			struct uboot_env_device *envdevs);
 
 /** @brief Release all resources and exit the library
+ *
+ * A store in flight is waited for and the lock is released.
  *
  * @param[in] ctx libuboot context
  */
@@ -151,6 +536,90 @@ int libuboot_open(struct uboot_ctx *ctx);
  */
 void libuboot_close(struct uboot_ctx *ctx);
 
+/** @brief Acquire the environment lock
+ *
+ * libuboot_open() takes the lock and keeps it until
+ * libuboot_close(). Long running processes can drop it with
+ * libuboot_unlock() after loading and take it again here
+ * just around libuboot_env_store().
+ *
+ * @param[in] ctx libuboot context
+ * @return 0 in case of success, else negative value
+ */
+int libuboot_lock(struct uboot_ctx *ctx);
+
+/** @brief Release the environment lock
+ *
+ * The loaded variables are kept, see libuboot_lock().
+ *
+ * @param[in] ctx libuboot context
+ */
+void libuboot_unlock(struct uboot_ctx *ctx);
+
+/** @brief Pick up changes stored by other processes
+ *
+ * Read just the headers of the stored copies and compare them
+ * with the ones loaded by libuboot_open() or written by the last
+ * libuboot_env_store(). The environment is reloaded only if
+ * they differ, keeping unchanged variables in place. The lock is
+ * taken for the check if the context does not own it.
+ *
+ * @param[in] ctx libuboot context
+ * @return number of changed variables (0 if nothing changed),
+ *         negative value in case of error
+ */
+int libuboot_refresh(struct uboot_ctx *ctx);
+
+/** Callback reporting a changed variable
+ *
+ * oldvalue is NULL for a new variable, newvalue is NULL
+ * for a removed one.
+ */
+typedef void (*libuboot_change_cb)(const char *name, const char *oldvalue,
+				   const char *newvalue, void *priv);
+
+/** @brief Watch for environment updates
+ *
+ * Return a file descriptor that becomes readable (poll/epoll)
+ * when any process stores a new environment for the namespace.
+ * The descriptor belongs to the context and it is closed by
+ * libuboot_exit(). Namespaces sharing the lockfile share the
+ * notification, too.
+ *
+ * @param[in] ctx libuboot context
+ * @return file descriptor in case of success, else negative value
+ */
+int libuboot_watch(struct uboot_ctx *ctx);
+
+/** @brief Reload the environment and report the changes
+ *
+ * Call it when the descriptor from libuboot_watch() is readable:
+ * it consumes the pending notifications, refreshes the context as
+ * libuboot_refresh() does and calls cb for each variable that differs
+ * from the one in the context. The context keeps the new values.
+ *
+ * @param[in] ctx libuboot context
+ * @param[in] cb callback for each change, maybe NULL
+ * @param[in] priv private pointer passed to cb
+ * @return number of changed variables, negative value in case of error
+ */
+int libuboot_watch_changes(struct uboot_ctx *ctx, libuboot_change_cb cb, void *priv);
+
+/** @brief Import environment from file and report the changes
+ *
+ * Same as libuboot_load_file(), but cb is called for each
+ * variable whose value really changes. Assignments that leave
+ * a variable as it is are not counted.
+ *
+ * @param[in] ctx libuboot context
+ * @param[in] filename path to the file to be imported, "-" for stdin
+ * @param[in] cb callback for each change, maybe NULL
+ * @param[in] priv private pointer passed to cb
+ * @return number of changed variables, negative value in case of error
+ */
+int libuboot_import_file(struct uboot_ctx *ctx, const char *filename,
+			 libuboot_change_cb cb, void *priv);
+
 /** @brief Set a variable
  *
  * It creates a new variable if not present in
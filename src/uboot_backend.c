@@ -0,0 +1,78 @@
+/*
+ * (C) Copyright 2026
+ * Stefano Babic, <stefano.babic@swupdate.org>
+ *
+ * SPDX-License-Identifier:     LGPL-2.1-or-later
+ */
+
+/**
+ * @file uboot_backend.c
+ *
+ * @brief Registry of the storage backends
+ *
+ * Each device in the configuration is bound to the first backend
+ * whose match() accepts its name. Registered backends come first,
+ * the last registered one first, then the built-in ones in the
+ * order UBI, MTD, simulated flash, file. The interface is private,
+ * backends are built with the library.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+
+#include "uboot_private.h"
+
+#define MAX_BACKENDS	8
+
+static const struct uboot_backend_ops *builtin_backends[] = {
+#if !defined(__FreeBSD__)
+	&libubootenv_ubi_ops,
+	&libubootenv_mtd_ops,
+#endif
+	&libubootenv_sim_ops,
+	&libubootenv_file_ops,
+};
+
+static const struct uboot_backend_ops *backends[MAX_BACKENDS];
+static unsigned int nbackends;
+
+/*
+ * Not thread safe: backends are registered before
+ * any context is set up
+ */
+int libubootenv_register_backend(const struct uboot_backend_ops *ops)
+{
+	unsigned int i;
+
+	if (!ops || !ops->match || !ops->probe || !ops->read || !ops->write)
+		return -EINVAL;
+
+	for (i = 0; i < nbackends; i++)
+		if (backends[i] == ops)
+			return 0;
+
+	if (nbackends == MAX_BACKENDS)
+		return -ENOSPC;
+
+	backends[nbackends++] = ops;
+
+	return 0;
+}
+
+const struct uboot_backend_ops *libubootenv_find_backend(const char *devname)
+{
+	unsigned int i;
+
+	if (!devname || !*devname)
+		return NULL;
+
+	for (i = nbackends; i > 0; i--)
+		if (backends[i - 1]->match(devname))
+			return backends[i - 1];
+
+	for (i = 0; i < sizeof(builtin_backends) / sizeof(builtin_backends[0]); i++)
+		if (builtin_backends[i]->match(devname))
+			return builtin_backends[i];
+
+	return NULL;
+}
@@ -31,10 +31,16 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/ioctl.h>
+#if !defined(__FreeBSD__)
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#endif
+#include <pthread.h>
 #include <zlib.h>
 
 #include "uboot_private.h"
 #include "common.h"
+#include "uboot_trace.h"
 
 #if defined(NO_YAML_SUPPORT)
 #define parse_yaml_config(ctx,fp) -1
@@ -54,30 +60,61 @@ extern int parse_yaml_config(struct uboot_ctx **ctxlist, FILE *fp);
  * configuration file.
  */
 static const char *default_lockname = "/var/lock/fw_printenv.lock";
+static int store_reap(struct uboot_ctx *ctx);
 static struct uboot_version_info libinfo;
 
-static int libuboot_lock(struct uboot_ctx *ctx)
+/*
+ * Without the lock another process may program a copy,
+ * a blank copy must be checked again on the flash
+ */
+static void forget_erased(struct uboot_ctx *ctx)
+{
+	ctx->envdevs[0].erased = false;
+	ctx->envdevs[1].erased = false;
+}
+
+int libuboot_lock(struct uboot_ctx *ctx)
 {
 	int lockfd = -1;
+	uint64_t t;
+
+	if (!ctx)
+		return -EINVAL;
+
+	/* already owned by this context */
+	if (ctx->lock > 0)
+		return 0;
+
 	lockfd = open(ctx->lockfile ?: default_lockname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
 	if (lockfd < 0) {
 		return -EBUSY;
 	}
+	t = stats_now();
+	TRACE1(lock__wait, ctx->lockfile ?: default_lockname);
 	if (flock(lockfd, LOCK_EX) < 0) {
 		close(lockfd);
 		return -EIO;
 	}
+	stats_record(&ctx->stats, LIBUBOOT_STATS_LOCK, t, 0);
+	TRACE1(lock__acquired, ctx->lockfile ?: default_lockname);
 
+	forget_erased(ctx);
 	ctx->lock = lockfd;
 	return 0;
 }
 
-static void libuboot_unlock(struct uboot_ctx *ctx)
+void libuboot_unlock(struct uboot_ctx *ctx)
 {
+	/* a running store must complete under the lock */
+	if (ctx)
+		store_reap(ctx);
+
 	if (ctx && (ctx->lock > 0)) {
+		TRACE1(lock__release, ctx->lockfile ?: default_lockname);
 		flock(ctx->lock, LOCK_UN);
 		close(ctx->lock);
 		ctx->lock = -1;
+		forget_erased(ctx);
 	}
 }
 
@@ -139,6 +176,37 @@ static void free_var_entry(struct var_entry *entry)
 	}
 }
 
+static void insert_sorted(struct vars *envs, struct var_entry *entry)
+{
+	struct var_entry *elm, *lastentry = NULL;
+
+	LIST_FOREACH(elm, envs, next) {
+		if (strcmp(elm->name, entry->name) > 0) {
+			LIST_INSERT_BEFORE(elm, entry, next);
+			return;
+		}
+		lastentry = elm;
+	}
+	if (lastentry)
+		LIST_INSERT_AFTER(lastentry, entry, next);
+	else
+		LIST_INSERT_HEAD(envs, entry, next);
+}
+
+static void free_var_list(struct vars *envs)
+{
+	struct var_entry *e, *tmp;
+
+	LIST_FOREACH_SAFE(e, envs, next, tmp) {
+		if (e->name)
+			free(e->name);
+		if (e->value)
+			free(e->value);
+		LIST_REMOVE(e, next);
+		free(e);
+	}
+}
+
 static bool validate_int(bool hex, const char *value)
 {
 	const char *c;
@@ -208,7 +276,7 @@ static bool libuboot_validate_flags(struct var_entry *entry, const char *value)
  */
 static int __libuboot_set_env(struct uboot_ctx *ctx, const char *varname, const char *value, struct var_entry *validate)
 {
-	struct var_entry *entry, *elm, *lastentry;
+	struct var_entry *entry;
 	struct vars *envs = &ctx->varlist;
 
 	/* U-Boot setenv treats '=' as an illegal character for variable names */
@@ -264,227 +332,300 @@ static int __libuboot_set_env(struct uboot_ctx *ctx, const char *varname, const
 		}
 	}
 
-	lastentry = NULL;
-	LIST_FOREACH(elm, envs, next) {
-		if (strcmp(elm->name, varname) > 0) {
-			LIST_INSERT_BEFORE(elm, entry, next);
-			return 0;
-		}
-		lastentry = elm;
-	}
-	if (lastentry)
-		LIST_INSERT_AFTER(lastentry, entry, next);
-	else
-		LIST_INSERT_HEAD(envs, entry, next);
+	insert_sorted(envs, entry);
 
 	return 0;
 }
 
-static int fileread(struct uboot_flash_env *dev, void *data)
+/*
+ * A variable parsed from a text environment
+ */
+struct import_pair {
+	char *name;
+	/** NULL to drop the variable */
+	char *value;
+	/** position in the input, the last assignment wins */
+	size_t pos;
+	/** attributes when serialized without being set, see env_serialize() */
+	type_attribute type;
+	access_attribute access;
+};
+
+static int cmp_import_pair(const void *a, const void *b)
 {
-	int ret = 0;
+	const struct import_pair *p1 = a, *p2 = b;
+	int ret = strcmp(p1->name, p2->name);
 
-	if (dev->offset)
-		ret = lseek(dev->fd, dev->offset, SEEK_SET);
-
-	if (ret < 0)
+	if (ret)
 		return ret;
 
-	size_t remaining = dev->envsize;
+	return p1->pos < p2->pos ? -1 : p1->pos > p2->pos;
+}
 
-	while (1) {
-		ret = read(dev->fd, data, remaining);
+/*
+ * State kept while variables read from the storage are added
+ */
+struct load_state {
+	/** entries of a previous load, moved over when still present */
+	struct vars old;
+	/** next candidate in old when the storage is sorted */
+	struct var_entry *cursor;
+	/** last added entry */
+	struct var_entry *last;
+	/** reports differences to the previous load, maybe NULL */
+	libuboot_change_cb cb;
+	void *priv;
+	/** number of differences */
+	int changes;
+};
+
+static struct var_entry *take_old_entry(struct load_state *st, const char *name,
+					bool sorted)
+{
+	struct var_entry *e;
 
-		if (ret == 0 && remaining > 0)
-		    return -1;
+	e = sorted ? st->cursor : LIST_FIRST(&st->old);
+	while (e && strcmp(e->name, name) < 0)
+		e = LIST_NEXT(e, next);
+	if (!e || strcmp(e->name, name))
+		return NULL;
 
-		if (ret < 0)
-			break;
+	st->cursor = LIST_NEXT(e, next);
+	LIST_REMOVE(e, next);
 
-		remaining -= ret;
-		data += ret;
+	return e;
+}
 
-		if (!remaining) {
-			ret = dev->envsize;
-			break;
+/*
+ * Add a variable read from the storage. U-Boot and this library
+ * write the variables sorted, so the entry is usually appended
+ * after the last one. Entries of a previous load are reused
+ * instead of being allocated again.
+ */
+static int add_loaded_var(struct uboot_ctx *ctx, struct load_state *st,
+			  const char *name, const char *value)
+{
+	struct var_entry *entry;
+	bool sorted = !st->last || strcmp(st->last->name, name) < 0;
+
+	if (!sorted && __libuboot_get_env(&ctx->varlist, name)) {
+		/* duplicate, the last one wins as in U-Boot */
+		return __libuboot_set_env(ctx, name, value, NULL);
+	}
+
+	entry = take_old_entry(st, name, sorted);
+	if (entry) {
+		entry->type = TYPE_ATTR_STRING;
+		entry->access = ACCESS_ATTR_ANY;
+		if (strcmp(entry->value, value)) {
+			char *newvalue = strdup(value);
+			if (!newvalue) {
+				FREE_ENTRY;
+				return -ENOMEM;
+			}
+			if (st->cb)
+				st->cb(name, entry->value, value, st->priv);
+			st->changes++;
+			free(entry->value);
+			entry->value = newvalue;
+		}
+	} else {
+		entry = create_var_entry(name);
+		if (!entry)
+			return -ENOMEM;
+		entry->value = strdup(value);
+		if (!entry->value) {
+			FREE_ENTRY;
+			return -ENOMEM;
 		}
+		if (st->cb)
+			st->cb(name, NULL, value, st->priv);
+		st->changes++;
 	}
 
-	return ret;
+	if (sorted && st->last)
+		LIST_INSERT_AFTER(st->last, entry, next);
+	else
+		insert_sorted(&ctx->varlist, entry);
+	if (sorted)
+		st->last = entry;
+
+	return 0;
 }
 
-static int devread(struct uboot_ctx *ctx, unsigned int copy, void *data)
+/*
+ * A new operation on the context starts, see libuboot_get_stats()
+ */
+static void ctx_stats_begin(struct uboot_ctx *ctx)
 {
-	int ret;
-	struct uboot_flash_env *dev;
+	stats_begin(&ctx->stats);
+	stats_begin(&ctx->envdevs[0].stats);
+	stats_begin(&ctx->envdevs[1].stats);
+}
 
-	if (copy > 1)
-		return -EINVAL;
+/*
+ * Open a copy through its backend
+ */
+static int devopen(struct uboot_flash_env *dev, int flags)
+{
+	if (!dev->ops)
+		return -EBADF;
 
-	dev = &ctx->envdevs[copy];
+	if (dev->ops->open)
+		return dev->ops->open(dev, flags);
 
-	dev->fd = open(dev->devname, O_RDONLY);
+	dev->fd = open(dev->devname, flags);
 	if (dev->fd < 0)
 		return -EBADF;
 
-	switch (dev->device_type) {
-	case DEVICE_FILE:
-		ret = fileread(dev, data);
-		break;
-	case DEVICE_MTD:
-		ret = libubootenv_mtdread(dev, data);
-		break;
-	case DEVICE_UBI:
-		ret = libubootenv_ubiread(dev, data);
-		break;
-	default:
-		ret = -1;
-		break;
-	};
-
-	close(dev->fd);
-	return ret;
+	return 0;
 }
 
-static int fileprotect(struct uboot_flash_env *dev, bool on)
-{
-	const char c_sys_path_1[] = "/sys/class/block/";
-	const char c_sys_path_2[] = "/force_ro";
-	const char c_dev_name_1[] = "mmcblk";
-	const char c_dev_name_2[] = "boot";
-	const char c_unprot_char = '0';
-	const char c_prot_char = '1';
-	const char *devfile = dev->devname;
-	int ret = 0;  // 0 means OK, negative means error
-	int ret_int = 0;
-	char *sysfs_path = NULL;
-	int fd_force_ro;
-
-	// Devices without ro flag at /sys/class/block/mmcblk?boot?/force_ro are ignored
-	if (strncmp("/dev/block/", dev->devname, 11) == 0) {
-		devfile = dev->devname + 11;
-	} else if (strncmp("/dev/", dev->devname, 5) == 0) {
-		devfile = dev->devname + 5;
-	} else {
-		return ret;
-	}
+static void devclose(struct uboot_flash_env *dev)
+{
+	if (dev->ops->close)
+		dev->ops->close(dev);
+	else
+		close(dev->fd);
+}
 
-	ret_int = strncmp(devfile, c_dev_name_1, sizeof(c_dev_name_1) - 1);
-	if (ret_int != 0) {
-		return ret;
-	}
+/*
+ * Read the first size bytes of a copy, the whole
+ * environment or just its header
+ */
+static int devread(struct uboot_ctx *ctx, unsigned int copy, void *data, size_t size)
+{
+	int ret;
+	struct uboot_flash_env *dev;
+	uint64_t t;
 
-	if (strncmp(devfile + sizeof(c_dev_name_1), c_dev_name_2, sizeof(c_dev_name_2) - 1) != 0) {
-		return ret;
-	}
+	if (copy > 1)
+		return -EINVAL;
 
-	if (*(devfile + sizeof(c_dev_name_1) - 1) < '0' ||
-	    *(devfile + sizeof(c_dev_name_1) - 1) > '9') {
-		return ret;
-	}
+	dev = &ctx->envdevs[copy];
 
-	if (*(devfile + sizeof(c_dev_name_1) + sizeof(c_dev_name_2) - 1) < '0' ||
-	    *(devfile + sizeof(c_dev_name_1) + sizeof(c_dev_name_2) - 1) > '9') {
+	t = stats_now();
+	TRACE3(read__start, dev->devname, copy, size);
+	ret = devopen(dev, O_RDONLY);
+	if (ret < 0)
 		return ret;
-	}
-
-	// There is a ro flag, the device needs to be protected or unprotected
-	ret_int = asprintf(&sysfs_path, "%s%s%s", c_sys_path_1, devfile, c_sys_path_2);
-	if(ret_int < 0) {
-		ret = -ENOMEM;
-		goto fileprotect_out;
-	}
-
-	if (access(sysfs_path, W_OK) == -1) {
-		goto fileprotect_out;
-	}
 
-	fd_force_ro = open(sysfs_path, O_RDWR);
-	if (fd_force_ro == -1) {
-		ret = -EBADF;
-		goto fileprotect_out;
-	}
+	ret = dev->ops->read(dev, data, size);
 
-	if(on == false){
-		ret_int = write(fd_force_ro, &c_unprot_char, 1);
-	} else {
-		ret_int = write(fd_force_ro, &c_prot_char, 1);
-	}
-	close(fd_force_ro);
+	devclose(dev);
+	TRACE3(read__done, dev->devname, copy, ret);
+	stats_record(&dev->stats, LIBUBOOT_STATS_READ, t, ret > 0 ? ret : 0);
 
-fileprotect_out:
-	if(sysfs_path)
-		free(sysfs_path);
 	return ret;
 }
 
-static int filewrite(struct uboot_flash_env *dev, void *data)
+static int devwrite(struct uboot_ctx *ctx, unsigned int copy, void *data)
 {
-	int ret = 0;
+	int ret;
+	struct uboot_flash_env *dev;
+	uint64_t t, ts;
+
+	if (copy > 1)
+		return -EINVAL;
 
-	ret = fileprotect(dev, false);
+	dev = &ctx->envdevs[copy];
+	t = stats_now();
+	ret = devopen(dev, O_RDWR);
 	if (ret < 0)
 		return ret;
 
-	if (dev->offset)
-		ret = lseek(dev->fd, dev->offset, SEEK_SET);
+	ret = dev->ops->write(dev, data);
+	dev->erased = false;
+	if (ret >= 0 && dev->ops->sync) {
+		ts = stats_now();
+		if (dev->ops->sync(dev) < 0)
+			ret = -EIO;
+		stats_record(&ctx->stats, LIBUBOOT_STATS_SYNC, ts, 0);
+	}
 
-	if (ret < 0)
-		return ret;
+	devclose(dev);
+	stats_record(&ctx->stats, LIBUBOOT_STATS_WRITE, t, ret > 0 ? ret : 0);
 
-	size_t remaining = dev->envsize;
+	return ret;
+}
 
-	while (1) {
-		ret = write(dev->fd, data, remaining);
+/*
+ * Mark a copy as obsolete after the other one was
+ * written, just for FLAGS_BOOLEAN devices
+ */
+static int devobsolete(struct uboot_ctx *ctx, unsigned int copy)
+{
+	int ret;
+	struct uboot_flash_env *dev;
 
-		if (ret < 0)
-			break;
+	if (copy > 1)
+		return -EINVAL;
 
-		remaining -= ret;
-		data += ret;
+	dev = &ctx->envdevs[copy];
+	if (!dev->ops || !dev->ops->set_obsolete)
+		return -EINVAL;
 
-		if (!remaining) {
-			ret = dev->envsize;
-			break;
-		}
-	}
+	ret = devopen(dev, O_RDWR);
+	if (ret < 0)
+		return ret;
 
-	fsync(dev->fd);
+	ret = dev->ops->set_obsolete(dev);
+	dev->erased = false;
+	if (!ret && dev->ops->program) {
+		dev->counters.programs++;
+		dev->counters.bytes_written++;
+	}
 
-	fileprotect(dev, true);  // no error handling, keep ret from write
+	devclose(dev);
 
 	return ret;
 }
 
-static int devwrite(struct uboot_ctx *ctx, unsigned int copy, void *data)
+int libuboot_erase_ahead(struct uboot_ctx *ctx)
 {
-	int ret;
+	unsigned char hdr[offsetof(struct uboot_env_redund, data)];
+	struct uboot_env_redund *env = (struct uboot_env_redund *)hdr;
 	struct uboot_flash_env *dev;
+	unsigned int copy;
+	bool locked;
+	int ret;
 
-	if (copy > 1)
+	if (!ctx)
 		return -EINVAL;
 
+	store_reap(ctx);
+	if (!ctx->erase_ahead || !ctx->redundant)
+		return 0;
+
+	copy = ctx->current ? 0 : 1;
 	dev = &ctx->envdevs[copy];
-	dev->fd = open(dev->devname, O_RDWR);
-	if (dev->fd < 0)
-		return -EBADF;
+	if (!dev->ops || !dev->ops->erase || dev->erased ||
+	    (dev->mtdinfo.type != MTD_NORFLASH && dev->mtdinfo.type != MTD_NANDFLASH))
+		return 0;
 
-	switch (dev->device_type) {
-	case DEVICE_FILE:
-		ret = filewrite(dev, data);
-		break;
-	case DEVICE_MTD:
-		ret = libubootenv_mtdwrite(dev, data);
-		break;
-	case DEVICE_UBI:
-		ret = libubootenv_ubiwrite(dev, data);
-		break;
-	default:
-		ret = -1;
-		break;
-	};
+	/* an erased NAND block is trusted only until the lock is released */
+	locked = ctx->lock > 0;
+	if (!locked && dev->mtdinfo.type == MTD_NANDFLASH)
+		return 0;
+	if (!locked && (ret = libuboot_lock(ctx)) < 0)
+		return ret;
 
-	close(dev->fd);
+	/* another store can have written the copy meanwhile */
+	ret = devread(ctx, copy, hdr, sizeof(hdr));
+	if (ret != sizeof(hdr)) {
+		ret = -EIO;
+	} else if (env->crc != dev->storedcrc || env->flags != dev->flags) {
+		ret = 0;
+	} else {
+		ret = devopen(dev, O_RDWR);
+		if (!ret) {
+			ret = flash_erase(dev);
+			devclose(dev);
+		}
+	}
+
+	if (!locked)
+		libuboot_unlock(ctx);
 
 	return ret;
 }
@@ -511,24 +652,134 @@ const struct uboot_version_info *libuboot_version_info(void)
 	return &libinfo;
 }
 
-int libuboot_env_store(struct uboot_ctx *ctx)
+/*
+ * Tell watchers that a new generation of the environment was stored,
+ * see libuboot_watch()
+ */
+static void libuboot_stamp(struct uboot_ctx *ctx, unsigned char flags, uint32_t crc)
+{
+	char *stampfile;
+	int fd;
+
+	if (asprintf(&stampfile, "%s%s", ctx->lockfile ?: default_lockname,
+		     STAMPFILE_SUFFIX) < 0)
+		return;
+
+	fd = open(stampfile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	free(stampfile);
+	if (fd < 0)
+		return;
+
+	dprintf(fd, "%s %u %08x\n", ctx->name ?: "-", flags, crc);
+	close(fd);
+}
+
+/*
+ * Flags for the next generation of the environment
+ */
+static unsigned char next_flags(struct uboot_ctx *ctx)
 {
+	unsigned char flags = 0;
+
+	if (ctx->redundant) {
+		flags = ctx->envdevs[ctx->current].flags;
+		switch(ctx->envdevs[ctx->current].flagstype) {
+		case FLAGS_INCREMENTAL:
+			flags++;
+			break;
+		case FLAGS_BOOLEAN:
+			flags = 1;
+			break;
+		default:
+			break;
+		}
+	}
+
+	return flags;
+}
+
+/*
+ * Walk the variables of the context merged with sorted pairs
+ * as if they were set, without changing the context. Pairs
+ * must be sorted with cmp_import_pair().
+ */
+struct merge_iter {
 	struct var_entry *entry;
-	void *image;
-	char *data;
-	char *buf;
+	struct import_pair *pair;
+	struct import_pair *end;
+};
+
+static void merge_iter_init(struct merge_iter *it, struct uboot_ctx *ctx,
+			    struct import_pair *pairs, size_t n)
+{
+	it->entry = LIST_FIRST(&ctx->varlist);
+	it->pair = pairs;
+	it->end = pairs + n;
+}
+
+static bool merge_iter_next(struct merge_iter *it, const char **name,
+			    const char **value, type_attribute *type,
+			    access_attribute *access)
+{
+	struct import_pair *p;
+	int cmp;
+
+	while (it->entry || it->pair < it->end) {
+		p = NULL;
+		if (it->pair < it->end) {
+			p = it->pair;
+			/* only the last assignment counts */
+			while (p + 1 < it->end && !strcmp(p->name, p[1].name))
+				p++;
+			if (!*p->name) {
+				it->pair = p + 1;
+				continue;
+			}
+		}
+
+		cmp = !p ? -1 : !it->entry ? 1 : strcmp(it->entry->name, p->name);
+		if (cmp < 0) {
+			*name = it->entry->name;
+			*value = it->entry->value;
+			*type = it->entry->type;
+			*access = it->entry->access;
+			it->entry = LIST_NEXT(it->entry, next);
+			return true;
+		}
+
+		if (!cmp)
+			it->entry = LIST_NEXT(it->entry, next);
+		it->pair = p + 1;
+		if (!p->value)
+			continue;
+
+		*name = p->name;
+		*value = p->value;
+		*type = p->type;
+		*access = p->access;
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * Build the data of one copy of the environment (ctx->size bytes)
+ * with variables and .flags, the header is set by env_seal().
+ * The unused space is zeroed. pairs, if any, override the
+ * variables of the context.
+ */
+static int env_serialize(struct uboot_ctx *ctx, struct import_pair *pairs, size_t n,
+			 void *image)
+{
+	struct merge_iter it;
+	const char *name, *value;
+	type_attribute type;
+	access_attribute access;
+	char *data, *buf, *end;
 	bool saveflags = false;
-	size_t size;
+	size_t len;
 	uint8_t offsetdata;
-	int ret;
-	int copy;
-
-	/*
-	 * Allocate the bigger of the case
-	 */
-	image = malloc(sizeof(struct uboot_env_redund) + ctx->size);
-	if (!image)
-		return -ENOMEM;
 
 	if (ctx->redundant)
 		offsetdata = offsetof(struct uboot_env_redund, data);
@@ -536,17 +787,23 @@ int libuboot_env_store(struct uboot_ctx *ctx)
 		offsetdata = offsetof(struct uboot_env_noredund, data);
 
 	data = (char *)(image + offsetdata);
+	end = (char *)(image + ctx->size);
 
+	/*
+	 * Room for the terminating '\0' of the environment
+	 * is always kept
+	 */
 	buf = data;
-	LIST_FOREACH(entry, &ctx->varlist, next) {
-		size = (ctx->size - offsetdata)  - (buf - data);
-		if ((strlen(entry->name) + strlen(entry->value) + 2) > size)
+	merge_iter_init(&it, ctx, pairs, n);
+	while (merge_iter_next(&it, &name, &value, &type, &access)) {
+		len = strlen(name) + strlen(value) + 2;
+		if (len >= end - buf)
 			return -ENOMEM;
 
-		if (entry->type || entry->access)
+		if (type || access)
 			saveflags = true;
 
-		buf += snprintf(buf, size, "%s=%s", entry->name, entry->value);
+		buf += sprintf(buf, "%s=%s", name, value);
 		buf++;
 	}
 
@@ -555,272 +812,1817 @@ int libuboot_env_store(struct uboot_ctx *ctx)
 	 */
 	if (saveflags) {
 		bool first = true;
-		size = (ctx->size - offsetdata)  - (buf - data);
-		buf += snprintf(buf, size, ".flags=");
 
-		LIST_FOREACH(entry, &ctx->varlist, next) {
-			size = (ctx->size - offsetdata)  - (buf - data);
-			if (entry->type || entry->access) {
-				buf += snprintf(buf, size, "%s%s:%c%c",
+		if (end - buf < sizeof(".flags=") + 1)
+			return -ENOMEM;
+		buf += sprintf(buf, ".flags=");
+
+		merge_iter_init(&it, ctx, pairs, n);
+		while (merge_iter_next(&it, &name, &value, &type, &access)) {
+			if (type || access) {
+				len = strlen(name) + 3 + (first ? 0 : 1);
+				if (len + 2 > end - buf)
+					return -ENOMEM;
+				buf += sprintf(buf, "%s%s:%c%c",
 						first ? "" : ",",
-						entry->name,
-						attr_tostring(entry->type),
-						access_tostring(entry->access));
+						name,
+						attr_tostring(type),
+						access_tostring(access));
 				first = false;
 			}
 		}
 		buf++;
 	}
 	*buf++ = '\0';
+	memset(buf, ctx->padding, end - buf);
 
-	if (ctx->redundant) {
-		unsigned char flags = ctx->envdevs[ctx->current].flags;
-		switch(ctx->envdevs[ctx->current].flagstype) {
-		case FLAGS_INCREMENTAL:
-			flags++;
-			break;
-		case FLAGS_BOOLEAN:
-			flags = 1;
-			break;
-		}
-		((struct uboot_env_redund *)image)->flags = flags;
-	}
+	return 0;
+}
 
-	*(uint32_t *)image = crc32(0, (uint8_t *)data, ctx->size - offsetdata);
+/*
+ * Keep the data of a copy and its CRC as reference for the CRC of
+ * the next stored copy, see env_crc(). The reference belongs to the
+ * owner of the lock: the serializing functions, that can run
+ * concurrently on a shared context, never use it.
+ */
+static void env_crc_reference(struct uboot_ctx *ctx, const void *data, size_t len,
+			      uint32_t crc)
+{
+	uint8_t *p = ctx->lastdata;
+
+	if (ctx->lock <= 0)
+		return;
+
+	if (ctx->lastlen != len) {
+		p = realloc(ctx->lastdata, len);
+		if (!p) {
+			free(ctx->lastdata);
+			ctx->lastdata = NULL;
+			ctx->lastlen = 0;
+			return;
+		}
+	}
+
+	memcpy(p, data, len);
+	ctx->lastdata = p;
+	ctx->lastlen = len;
+	ctx->lastcrc = crc;
+}
+
+/*
+ * CRC of the data of a copy to be stored, updated from the
+ * reference if the changes are localized, and the data become
+ * the new reference. crcbytes returns the bytes that went
+ * through crc32().
+ */
+static uint32_t env_crc(struct uboot_ctx *ctx, const uint8_t *data, size_t len,
+			size_t *crcbytes)
+{
+	uint32_t crc;
+
+	if (ctx->lock <= 0 || !ctx->lastdata || ctx->lastlen != len ||
+	    !crc32_update(ctx->lastdata, ctx->lastcrc, data, len, &crc, crcbytes)) {
+		crc = crc32(0, data, len);
+		*crcbytes = len;
+	}
+	env_crc_reference(ctx, data, len, crc);
+
+	return crc;
+}
+
+/*
+ * Set flags and CRC in the header of a serialized copy. With
+ * crcbytes set, the copy is going to be stored and its CRC
+ * comes from env_crc(), else the context is not changed.
+ */
+static uint32_t env_seal(struct uboot_ctx *ctx, void *image, unsigned char flags,
+			 size_t *crcbytes)
+{
+	uint8_t offsetdata;
+	uint32_t crc;
+
+	if (ctx->redundant) {
+		offsetdata = offsetof(struct uboot_env_redund, data);
+		((struct uboot_env_redund *)image)->flags = flags;
+	} else {
+		offsetdata = offsetof(struct uboot_env_noredund, data);
+	}
+
+	if (crcbytes)
+		crc = env_crc(ctx, image + offsetdata, ctx->size - offsetdata, crcbytes);
+	else
+		crc = crc32(0, (uint8_t *)(image + offsetdata), ctx->size - offsetdata);
+	memcpy(image, &crc, sizeof(crc));
 
-	copy = ctx->redundant ? (ctx->current ? 0 : 1) : 0;
-	ret = devwrite(ctx, copy, image);
-	free(image);
+	return crc;
+}
+
+int libuboot_serialize_image(struct uboot_ctx *ctx, void *buf, size_t len)
+{
+	int ret;
+
+	if (!ctx || !buf || !ctx->size)
+		return -EINVAL;
+	if (len < ctx->size)
+		return -ENOSPC;
+
+	ret = env_serialize(ctx, NULL, 0, buf);
+	if (ret)
+		return ret;
+	env_seal(ctx, buf, next_flags(ctx), NULL);
+
+	return ctx->size;
+}
+
+/*
+ * Serialize the context into the image of the copy to be written
+ * next. The variables can change as soon as this returns.
+ */
+static int store_prepare(struct uboot_ctx *ctx, struct store_job *job)
+{
+	size_t crcbytes;
+	uint64_t t;
+	int ret;
+
+	job->image = malloc(ctx->size);
+	if (!job->image)
+		return -ENOMEM;
+
+	job->flags = next_flags(ctx);
+	t = stats_now();
+	ret = env_serialize(ctx, NULL, 0, job->image);
+	if (ret) {
+		free(job->image);
+		job->image = NULL;
+		return ret;
+	}
+	stats_record(&ctx->stats, LIBUBOOT_STATS_SERIALIZE, t, ctx->size);
+	t = stats_now();
+	job->crc = env_seal(ctx, job->image, job->flags, &crcbytes);
+	stats_record(&ctx->stats, LIBUBOOT_STATS_CRC, t, crcbytes);
+
+	job->copy = ctx->redundant ? (ctx->current ? 0 : 1) : 0;
+
+	return 0;
+}
+
+/*
+ * Write a prepared image and make it the current copy
+ */
+static int store_commit(struct uboot_ctx *ctx, struct store_job *job)
+{
+	int copy = job->copy;
+	int ret;
+
+	ret = devwrite(ctx, copy, job->image);
+	free(job->image);
+	job->image = NULL;
 
 	if (ret == ctx->size)
 		ret = 0;
 
 	if (ctx->redundant && !ret) {
-		if (ctx->envdevs[ctx->current].flagstype == FLAGS_BOOLEAN)
-			ret = libubootenv_set_obsolete_flag(&ctx->envdevs[ctx->current]);
+		if (ctx->envdevs[ctx->current].flagstype == FLAGS_BOOLEAN) {
+			ret = devobsolete(ctx, ctx->current);
+			if (!ret)
+				ctx->envdevs[ctx->current].flags = 0;
+		}
+	}
+
+	if (!ret) {
+		/*
+		 * Track what is now on the storage, a further store
+		 * from the same context must continue from here
+		 */
+		ctx->envdevs[copy].flags = job->flags;
+		ctx->envdevs[copy].crc = job->crc;
+		ctx->envdevs[copy].storedcrc = job->crc;
+		ctx->current = copy;
+		libuboot_stamp(ctx, job->flags, job->crc);
+	}
+	stats_record(&ctx->stats, LIBUBOOT_STATS_STORE, job->start, ret ? 0 : ctx->size);
+	TRACE4(store__done, ctx->name, copy, ret, job->flags);
+
+	return ret;
+}
+
+/*
+ * Wait for the store running on the worker thread, if any. Anything
+ * using the storage or the state of the copies must call it first.
+ */
+static int store_reap(struct uboot_ctx *ctx)
+{
+	struct store_job *job = ctx->job;
+
+	if (!job)
+		return ctx->asyncresult;
+
+	pthread_join(job->thread, NULL);
+	ctx->asyncresult = job->result;
+	ctx->job = NULL;
+	free(job);
+
+	return ctx->asyncresult;
+}
+
+static void *store_worker(void *arg)
+{
+	struct store_job *job = arg;
+	struct uboot_ctx *ctx = job->ctx;
+#if !defined(__FreeBSD__)
+	uint64_t one = 1;
+#endif
+
+	job->result = store_commit(ctx, job);
+	/* whoever is notified below can start the next store */
+	__atomic_store_n(&job->done, true, __ATOMIC_RELEASE);
+
+	if (job->cb)
+		job->cb(ctx, job->result, job->priv);
+#if !defined(__FreeBSD__)
+	if (ctx->storefd > 0 && write(ctx->storefd, &one, sizeof(one)) < 0)
+		job->result = job->result ?: -errno;
+#endif
+
+	return NULL;
+}
+
+int libuboot_env_store(struct uboot_ctx *ctx)
+{
+	struct store_job job;
+	int ret;
+
+	if (!ctx)
+		return -EINVAL;
+
+	store_reap(ctx);
+
+	memset(&job, 0, sizeof(job));
+	job.start = stats_now();
+	ctx_stats_begin(ctx);
+	TRACE2(store__start, ctx->name, ctx->size);
+
+	ret = store_prepare(ctx, &job);
+	if (ret)
+		return ret;
+
+	ret = store_commit(ctx, &job);
+	if (!ret)
+		ctx->dirty = false;
+
+	return ret;
+}
+
+int libuboot_env_store_async(struct uboot_ctx *ctx, libuboot_store_cb cb, void *priv)
+{
+	struct store_job *job;
+	int ret;
+
+	if (!ctx)
+		return -EINVAL;
+
+	/* one store at a time, the next one continues from its copy */
+	if (ctx->job) {
+		if (!__atomic_load_n(&ctx->job->done, __ATOMIC_ACQUIRE))
+			return -EBUSY;
+		store_reap(ctx);
+	}
+
+	job = calloc(1, sizeof(*job));
+	if (!job)
+		return -ENOMEM;
+	job->ctx = ctx;
+	job->cb = cb;
+	job->priv = priv;
+
+	job->start = stats_now();
+	ctx_stats_begin(ctx);
+	TRACE2(store__start, ctx->name, ctx->size);
+
+	ret = store_prepare(ctx, job);
+	if (!ret) {
+		ret = -pthread_create(&job->thread, NULL, store_worker, job);
+		if (ret)
+			free(job->image);
+	}
+	if (ret) {
+		free(job);
+		return ret;
+	}
+
+	ctx->job = job;
+	/* the image has all the changes, a failure is reported by the job */
+	ctx->dirty = false;
+
+	return 0;
+}
+
+static uint64_t now_ms(void)
+{
+	return stats_now() / 1000000;
+}
+
+int libuboot_set_store_delay(struct uboot_ctx *ctx, unsigned int debounce_ms,
+			     unsigned int maxdelay_ms)
+{
+	if (!ctx)
+		return -EINVAL;
+
+	ctx->debounce_ms = debounce_ms;
+	ctx->maxdelay_ms = maxdelay_ms;
+
+	return 0;
+}
+
+int libuboot_env_store_deferred(struct uboot_ctx *ctx)
+{
+	uint64_t now;
+
+	if (!ctx)
+		return -EINVAL;
+
+	if (!ctx->debounce_ms && !ctx->maxdelay_ms)
+		return libuboot_env_store(ctx);
+
+	now = now_ms();
+	if (!ctx->dirty) {
+		ctx->dirty = true;
+		ctx->first_change = now;
+	}
+	ctx->deadline = now + ctx->debounce_ms;
+	if (ctx->maxdelay_ms && ctx->deadline > ctx->first_change + ctx->maxdelay_ms)
+		ctx->deadline = ctx->first_change + ctx->maxdelay_ms;
+
+	/* requests keep coming, the maximum delay is over */
+	if (ctx->deadline <= now)
+		return libuboot_env_flush(ctx);
+
+	return 0;
+}
+
+int libuboot_env_flush(struct uboot_ctx *ctx)
+{
+	if (!ctx)
+		return -EINVAL;
+
+	if (!ctx->dirty)
+		return 0;
+
+	return libuboot_env_store(ctx);
+}
+
+int libuboot_env_flush_timeout(struct uboot_ctx *ctx)
+{
+	uint64_t now;
+
+	if (!ctx || !ctx->dirty)
+		return -1;
+
+	now = now_ms();
+	if (ctx->deadline <= now)
+		return 0;
+
+	return ctx->deadline - now > INT_MAX ? INT_MAX : ctx->deadline - now;
+}
+
+int libuboot_env_store_wait(struct uboot_ctx *ctx)
+{
+	if (!ctx)
+		return -EINVAL;
+
+	return store_reap(ctx);
+}
+
+#if defined(__FreeBSD__)
+int libuboot_env_store_fd(struct uboot_ctx *ctx)
+{
+	return -ENOSYS;
+}
+#else
+int libuboot_env_store_fd(struct uboot_ctx *ctx)
+{
+	int fd;
+
+	if (!ctx)
+		return -EINVAL;
+
+	if (ctx->storefd > 0)
+		return ctx->storefd;
+
+	/* the worker must not see a half set descriptor */
+	store_reap(ctx);
+
+	fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	ctx->storefd = fd;
+
+	return fd;
+}
+#endif
+
+static const char * const stats_phase_names[LIBUBOOT_STATS_PHASES] = {
+	[LIBUBOOT_STATS_OPEN] = "open",
+	[LIBUBOOT_STATS_STORE] = "store",
+	[LIBUBOOT_STATS_LOCK] = "lock",
+	[LIBUBOOT_STATS_READ] = "read",
+	[LIBUBOOT_STATS_CRC] = "crc",
+	[LIBUBOOT_STATS_PARSE] = "parse",
+	[LIBUBOOT_STATS_SERIALIZE] = "serialize",
+	[LIBUBOOT_STATS_WRITE] = "write",
+	[LIBUBOOT_STATS_ERASE] = "erase",
+	[LIBUBOOT_STATS_PROGRAM] = "program",
+	[LIBUBOOT_STATS_SYNC] = "sync",
+};
+
+const char *libuboot_stats_phase_name(unsigned int phase)
+{
+	return phase < LIBUBOOT_STATS_PHASES ? stats_phase_names[phase] : NULL;
+}
+
+/*
+ * Erase, program and the read and CRC of each copy are
+ * measured on the devices, the rest on the context
+ */
+int libuboot_get_stats(struct uboot_ctx *ctx, struct libuboot_stats *stats)
+{
+	const struct libuboot_stats *src[3];
+	unsigned int i, j;
+
+	if (!ctx || !stats)
+		return -EINVAL;
+
+	src[0] = &ctx->stats;
+	src[1] = &ctx->envdevs[0].stats;
+	src[2] = &ctx->envdevs[1].stats;
+
+	memset(stats, 0, sizeof(*stats));
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j < LIBUBOOT_STATS_PHASES; j++) {
+			stats->total[j].calls += src[i]->total[j].calls;
+			stats->total[j].bytes += src[i]->total[j].bytes;
+			stats->total[j].ns += src[i]->total[j].ns;
+			stats->last[j].calls += src[i]->last[j].calls;
+			stats->last[j].bytes += src[i]->last[j].bytes;
+			stats->last[j].ns += src[i]->last[j].ns;
+		}
+	}
+
+	return 0;
+}
+
+int libuboot_get_flash_counters(struct uboot_ctx *ctx, unsigned int copy,
+				struct libuboot_flash_counters *counters)
+{
+	if (!ctx || !counters || copy > 1 || (copy && !ctx->redundant))
+		return -EINVAL;
+
+	*counters = ctx->envdevs[copy].counters;
+
+	return 0;
+}
+
+/*
+ * A copy reading as erased flash is never valid, whatever its CRC,
+ * and it can be programmed without erasing it first
+ */
+static bool is_blank(const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+
+	return len && p[0] == 0xFF && !memcmp(p, p + 1, len - 1);
+}
+
+/*
+ * Check the CRC of a copy already read into buf. It runs on its
+ * own thread for the second copy, see read_copies(): only the
+ * device of the copy is touched.
+ */
+static void check_copy(struct uboot_ctx *ctx, unsigned int copy, void *buf)
+{
+	struct uboot_flash_env *dev = &ctx->envdevs[copy];
+	uint8_t offsetdata = offsetof(struct uboot_env_noredund, data);
+	uint8_t offsetcrc = offsetof(struct uboot_env_noredund, crc);
+	uint8_t offsetflags = offsetof(struct uboot_env_redund, flags);
+	size_t usable_envsize;
+	uint32_t crc;
+	uint64_t t;
+
+	if (ctx->redundant) {
+		offsetdata = offsetof(struct uboot_env_redund, data);
+		offsetcrc = offsetof(struct uboot_env_redund, crc);
+	}
+	usable_envsize = ctx->size - offsetdata;
+
+	crc = *(uint32_t *)(buf + offsetcrc);
+	dev->storedcrc = crc;
+	t = stats_now();
+	dev->crc = crc32(0, (uint8_t *)(buf + offsetdata), usable_envsize);
+	stats_record(&dev->stats, LIBUBOOT_STATS_CRC, t, usable_envsize);
+	dev->blank = is_blank(buf, ctx->size);
+	/* reading as erased proves nothing on NAND, see flash_write() */
+	dev->erased = dev->blank && dev->mtdinfo.type != MTD_NANDFLASH;
+	TRACE4(crc, copy, dev->crc, crc, !dev->blank && dev->crc == crc);
+	if (ctx->redundant)
+		dev->flags = *(uint8_t *)(buf + offsetflags);
+}
+
+/*
+ * Select the current copy among the ones checked by check_copy()
+ */
+static void select_copy(struct uboot_ctx *ctx)
+{
+	struct uboot_flash_env *dev;
+	bool crcenv[2];
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		dev = &ctx->envdevs[i];
+		crcenv[i] = !dev->blank && dev->crc == dev->storedcrc;
 	}
 
-	if (!ret)
-		ctx->current = ctx->current ? 0 : 1;
+	if (!ctx->redundant) {
+		ctx->current = 0;
+		ctx->valid = crcenv[0];
+	} else {
+		if (crcenv[0] && !crcenv[1]) {
+			ctx->valid = true;
+			ctx->current = 0;
+		} else if (!crcenv[0] && crcenv[1]) {
+			ctx->valid = true;
+			ctx->current = 1;
+		} else if (!crcenv[0] && !crcenv[1]) {
+			ctx->valid = false;
+			ctx->current = 0;
+		} else { /* both valid, check flags */
+			ctx->valid = true;
+			if (ctx->envdevs[1].flags > ctx->envdevs[0].flags)
+				ctx->current = 1;
+			else
+				ctx->current = 0;
+			switch (ctx->envdevs[0].flagstype) {
+			case FLAGS_BOOLEAN:
+				if (ctx->envdevs[1].flags == 0xFF)
+					ctx->current = 1;
+				else if (ctx->envdevs[0].flags == 0xFF)
+					ctx->current = 0;
+				break;
+			case FLAGS_INCREMENTAL:
+				/* check overflow */
+				if (ctx->envdevs[0].flags == 0xFF &&
+					ctx->envdevs[1].flags == 0)
+					ctx->current = 1;
+				else if (ctx->envdevs[1].flags == 0xFF &&
+					ctx->envdevs[0].flags == 0)
+					ctx->current = 0;
+				break;
+			}
+		}
+	}
+
+	TRACE4(copy__select, ctx->current, ctx->valid,
+	       ctx->envdevs[0].flags, ctx->envdevs[1].flags);
+
+#if !defined(NDEBUG)
+	fprintf(stdout, "Environment %s, copy %d\n",
+			ctx->valid ? "OK" : "WRONG", ctx->current);
+#endif
+}
+
+/*
+ * Select the current copy among the ones already read into buf
+ * and checked with check_copy(), and import its variables. If
+ * state is set, it contains the variables of a previous load to
+ * be reused.
+ */
+static int load_copies(struct uboot_ctx *ctx, struct load_state *state, void *buf[2])
+{
+	struct load_state fresh;
+	size_t usable_envsize;
+	char *line, *next;
+	uint8_t offsetdata = offsetof(struct uboot_env_noredund, data);
+	char *data;
+	struct var_entry *entry;
+	uint64_t t;
+
+	ctx->valid = false;
+
+	if (!state) {
+		memset(&fresh, 0, sizeof(fresh));
+		LIST_INIT(&fresh.old);
+		state = &fresh;
+	}
+	state->cursor = LIST_FIRST(&state->old);
+	state->last = NULL;
+
+	if (ctx->redundant)
+		offsetdata = offsetof(struct uboot_env_redund, data);
+	usable_envsize = ctx->size - offsetdata;
+
+	select_copy(ctx);
+
+	data = (char *)(buf[ctx->current] + offsetdata);
+
+	/* before the parser splits the variables in place */
+	if (ctx->valid)
+		env_crc_reference(ctx, data, usable_envsize,
+				  ctx->envdevs[ctx->current].crc);
+
+	char *flagsvar = NULL;
+
+	t = stats_now();
+	if (ctx->valid) {
+		for (line = data; line - data < usable_envsize && *line; line = next + 1) {
+			char *value;
+
+			/*
+			 * Search the end of the string pointed by line,
+			 * without running past the copy
+			 */
+			next = memchr(line, '\0', usable_envsize - (line - data));
+			if (!next) {
+				free(flagsvar);
+				return -EIO;
+			}
+
+			value = strchr(line, '=');
+			if (!value)
+				continue;
+
+			*value++ = '\0';
+
+			if (!strcmp(line, ".flags"))
+				flagsvar = strdup(value);
+			else
+				add_loaded_var(ctx, state, line, value);
+		}
+	}
+
+	/*
+	 * Parse .flags and set the attributes for a variable
+	 */
+	char *pvar;
+	char *pval;
+	if (flagsvar) {
+#if !defined(NDEBUG)
+	fprintf(stdout, "Environment FLAGS %s\n", flagsvar);
+#endif
+		unsigned int flagslen = strlen(flagsvar);
+		pvar = flagsvar;
+
+		while (*pvar && (pvar - flagsvar) < flagslen) {
+			char *pnext;
+			pval = strchr(pvar, ':');
+			if (!pval)
+				break;
+
+			*pval++ = '\0';
+			pnext = strchr(pval, ',');
+			if (!pnext)
+				pnext = flagsvar + strlen(flagsvar);
+			else
+				*pnext++ = '\0';
+
+			entry = __libuboot_get_env(&ctx->varlist, pvar);
+			set_var_access_type(entry, pval);
+			pvar = pnext;
+		}
+	}
+	free(flagsvar);
+	if (ctx->valid)
+		stats_record(&ctx->stats, LIBUBOOT_STATS_PARSE, t, usable_envsize);
+
+	return ctx->valid ? 0 : -ENODATA;
+}
+
+/*
+ * Read a copy and check its CRC
+ */
+struct copy_read {
+	pthread_t thread;
+	struct uboot_ctx *ctx;
+	unsigned int copy;
+	void *buf;
+	int ret;
+};
+
+static void *read_copy(void *arg)
+{
+	struct copy_read *cr = arg;
+
+	cr->ret = devread(cr->ctx, cr->copy, cr->buf, cr->ctx->size);
+	if (cr->ret == cr->ctx->size)
+		check_copy(cr->ctx, cr->copy, cr->buf);
+
+	return NULL;
+}
+
+/*
+ * A thread for the second copy pays off if the reads wait for
+ * the flash or if the CRCs can run on two CPUs
+ */
+static bool read_in_parallel(struct uboot_ctx *ctx)
+{
+	static long cpus;
+
+	if (!ctx->redundant || ctx->read_mode == LIBUBOOT_READ_SEQUENTIAL)
+		return false;
+	if (ctx->read_mode == LIBUBOOT_READ_PARALLEL ||
+	    ctx->envdevs[0].device_type != DEVICE_FILE ||
+	    ctx->envdevs[1].device_type != DEVICE_FILE)
+		return true;
+	if (!cpus)
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return cpus > 1;
+}
+
+/*
+ * Read and check the copies into buf. The copies of a redundant
+ * environment often sit on different devices or partitions:
+ * the second one is read and checked on another thread meanwhile.
+ */
+static int read_copies(struct uboot_ctx *ctx, void *buf[2])
+{
+	struct copy_read cr[2];
+	int i, copies = ctx->redundant ? 2 : 1;
+
+	for (i = 0; i < copies; i++) {
+		cr[i].ctx = ctx;
+		cr[i].copy = i;
+		cr[i].buf = buf[i];
+	}
+
+	if (read_in_parallel(ctx) &&
+	    !pthread_create(&cr[1].thread, NULL, read_copy, &cr[1])) {
+		read_copy(&cr[0]);
+		pthread_join(cr[1].thread, NULL);
+	} else {
+		for (i = 0; i < copies; i++)
+			read_copy(&cr[i]);
+	}
+
+	for (i = 0; i < copies; i++)
+		if (cr[i].ret != ctx->size)
+			return -EIO;
+
+	return 0;
+}
+
+/*
+ * Load the environment from the storage. If state is set, it
+ * contains the variables of a previous load to be reused.
+ */
+static int libuboot_load(struct uboot_ctx *ctx, struct load_state *state)
+{
+	void *buf[2];
+	size_t bufsize;
+	int ret;
+	int copies = ctx->redundant ? 2 : 1;
+
+	ctx->valid = false;
+
+	bufsize = ctx->size * copies;
+	buf[0] = malloc(bufsize);
+	if (!buf[0])
+		return -ENOMEM;
+	buf[1] = buf[0] + ctx->size;
+
+	ret = read_copies(ctx, buf);
+	if (!ret)
+		ret = load_copies(ctx, state, buf);
+	free(buf[0]);
+
+	return ret;
+}
+
+/*
+ * Look up a variable in the data of a copy. Return its value,
+ * with the end (the terminating '\0') in valend, or NULL.
+ */
+static char *env_lookup(char *data, size_t len, const char *name, char **valend)
+{
+	size_t namelen = strlen(name);
+	char *line, *next;
+
+	for (line = data; line - data < len && *line; line = next + 1) {
+		next = memchr(line, '\0', len - (line - data));
+		if (!next)
+			return NULL;
+		if (!strncmp(line, name, namelen) && line[namelen] == '=') {
+			*valend = next;
+			return line + namelen + 1;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Terminating '\0' of the environment in the data of a copy
+ */
+static char *env_end(char *data, size_t len)
+{
+	char *line, *next;
+
+	for (line = data; line - data < len && *line; line = next + 1) {
+		next = memchr(line, '\0', len - (line - data));
+		if (!next)
+			return NULL;
+	}
+
+	return line - data < len ? line : NULL;
+}
+
+/*
+ * Attributes of a variable from the .flags of a copy
+ */
+static void env_lookup_flags(char *data, size_t len, const char *name,
+			     struct var_entry *entry)
+{
+	size_t namelen = strlen(name);
+	char attrs[4];
+	char *p, *end, *sep;
+	size_t n;
+
+	p = env_lookup(data, len, ".flags", &end);
+	while (p && p < end) {
+		sep = memchr(p, ',', end - p) ?: end;
+		if (sep - p > namelen && !strncmp(p, name, namelen) && p[namelen] == ':') {
+			p += namelen + 1;
+			n = sep - p < sizeof(attrs) ? sep - p : sizeof(attrs) - 1;
+			memcpy(attrs, p, n);
+			attrs[n] = '\0';
+			set_var_access_type(entry, attrs);
+			return;
+		}
+		p = sep + 1;
+	}
+}
+
+/*
+ * New value of a number in the same format (hex prefix, case
+ * of the digits, leading zeroes) as the old one
+ */
+static int number_update(const char *old, type_attribute type, bool add,
+			 long long delta, unsigned long long *value,
+			 char *out, size_t outlen)
+{
+	bool hex = type == TYPE_ATTR_HEX;
+	unsigned long long n;
+	const char *digits;
+	char *end;
+	int width, len;
+
+	if (type == TYPE_ATTR_STRING)
+		hex = old[0] == '0' && (old[1] == 'x' || old[1] == 'X');
+	else if (type != TYPE_ATTR_DECIMAL && type != TYPE_ATTR_HEX)
+		return -EINVAL;
+
+	digits = hex ? old + 2 : old;
+	if (!*digits || !validate_int(hex, digits))
+		return -EINVAL;
+
+	errno = 0;
+	n = strtoull(digits, &end, hex ? 16 : 10);
+	if (errno)
+		return -ERANGE;
+
+	if (!add)
+		n = *value;
+	else if (delta < 0 && 0ULL - (unsigned long long)delta > n)
+		return -ERANGE;
+	else if (delta > 0 && n > ULLONG_MAX - delta)
+		return -ERANGE;
+	else
+		n += delta;
+
+	width = end - digits;
+	if (!hex)
+		len = snprintf(out, outlen, "%0*llu", width, n);
+	else if (strpbrk(digits, "ABCDEF"))
+		len = snprintf(out, outlen, "%.2s%0*llX", old, width, n);
+	else
+		len = snprintf(out, outlen, "%.2s%0*llx", old, width, n);
+	if (len < 0 || len >= outlen)
+		return -ERANGE;
+
+	*value = n;
+
+	return len;
+}
+
+/*
+ * Change a number in the data of a copy and return the new CRC.
+ * If the length of the value does not change, the CRC is updated
+ * from the bytes that changed, else the rest of the environment
+ * is moved and the CRC is computed again.
+ */
+static int env_patch_number(struct uboot_ctx *ctx, char *data, size_t len,
+			    const char *varname, struct var_entry *validate,
+			    bool add, long long delta, unsigned long long *value,
+			    char *newval, size_t newvallen, uint32_t *crc)
+{
+	struct var_entry attrs;
+	char *val, *valend, *envend;
+	size_t oldlen, newlen;
+	uint32_t cold, cnew;
+	int ret;
+
+	val = env_lookup(data, len, varname, &valend);
+	if (!val)
+		return -ENOENT;
+
+	memset(&attrs, 0, sizeof(attrs));
+	env_lookup_flags(data, len, varname, &attrs);
+	if (validate) {
+		if (!libuboot_validate_flags(&attrs, NULL))
+			return -EPERM;
+		attrs.access = validate->access;
+		attrs.type = validate->type;
+	}
+
+	ret = number_update(val, attrs.type, add, delta, value, newval, newvallen);
+	if (ret < 0)
+		return ret;
+	if (!libuboot_validate_flags(&attrs, newval))
+		return -EPERM;
+
+	oldlen = valend - val;
+	newlen = ret;
+	if (newlen == oldlen) {
+		/*
+		 * The CRC of the data is linear in the bytes: shift the
+		 * difference of the changed bytes over the rest of the data
+		 */
+		cold = crc32(0, (uint8_t *)val, oldlen);
+		cnew = crc32(0, (uint8_t *)newval, newlen);
+		*crc ^= crc32_combine(cold ^ cnew, 0, data + len - valend);
+		memcpy(val, newval, newlen);
+		return 0;
+	}
+
+	envend = env_end(data, len);
+	if (!envend)
+		return -EIO;
+	if (newlen > oldlen && envend + 1 + newlen - oldlen > data + len)
+		return -ENOMEM;
+
+	memmove(val + newlen, valend, envend + 1 - valend);
+	if (newlen < oldlen)
+		memset(envend + 1 - (oldlen - newlen), ctx->padding, oldlen - newlen);
+	memcpy(val, newval, newlen);
+	*crc = crc32(0, (uint8_t *)data, len);
+
+	return 0;
+}
+
+/*
+ * Change a number on the storage, patching the current copy
+ * instead of loading and serializing the whole environment
+ */
+static int env_update_number(struct uboot_ctx *ctx, const char *varname,
+			     bool add, long long delta, unsigned long long *value)
+{
+	struct var_entry *validate = NULL, *entry;
+	struct store_job job;
+	void *buf[2] = { NULL, NULL };
+	uint8_t offsetdata = offsetof(struct uboot_env_noredund, data);
+	uint32_t knowncrc;
+	unsigned char knownflags;
+	bool locked, loaded;
+	char newval[64];
+	char *data, *value_dup = NULL;
+	uint32_t crc;
+	uint64_t t;
+	int i, ret;
+
+	if (!ctx || !varname || !*varname || strchr(varname, '=') || !ctx->size)
+		return -EINVAL;
+
+	if (!LIST_EMPTY(&ctx->writevarlist)) {
+		validate = __libuboot_get_env(&ctx->writevarlist, varname);
+		if (!validate)
+			return -EPERM;
+	}
+
+	store_reap(ctx);
+
+	memset(&job, 0, sizeof(job));
+	job.start = stats_now();
+	ctx_stats_begin(ctx);
+	TRACE2(store__start, ctx->name, ctx->size);
+
+	locked = ctx->lock > 0;
+	if (!locked) {
+		ret = libuboot_lock(ctx);
+		if (ret)
+			return ret;
+	}
+
+	/* whether the variables of the context match the storage */
+	loaded = ctx->valid;
+	knowncrc = ctx->envdevs[ctx->current].storedcrc;
+	knownflags = ctx->envdevs[ctx->current].flags;
+
+	for (i = 0; i < (ctx->redundant ? 2 : 1); i++) {
+		buf[i] = malloc(ctx->size);
+		if (!buf[i]) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
+	ret = read_copies(ctx, buf);
+	if (ret) {
+		loaded = false;
+		goto out;
+	}
+
+	select_copy(ctx);
+	if (!ctx->valid) {
+		loaded = false;
+		ret = -ENODATA;
+		goto out;
+	}
+	loaded = loaded && ctx->envdevs[ctx->current].storedcrc == knowncrc &&
+		 ctx->envdevs[ctx->current].flags == knownflags;
+
+	if (ctx->redundant)
+		offsetdata = offsetof(struct uboot_env_redund, data);
+	data = buf[ctx->current] + offsetdata;
+	crc = ctx->envdevs[ctx->current].storedcrc;
+
+	t = stats_now();
+	ret = env_patch_number(ctx, data, ctx->size - offsetdata, varname,
+			       validate, add, delta, value, newval, sizeof(newval),
+			       &crc);
+	if (ret)
+		goto out;
+	stats_record(&ctx->stats, LIBUBOOT_STATS_SERIALIZE, t, 0);
+	env_crc_reference(ctx, data, ctx->size - offsetdata, crc);
+
+	job.flags = next_flags(ctx);
+	job.crc = crc;
+	job.copy = ctx->redundant ? (ctx->current ? 0 : 1) : 0;
+	job.image = buf[ctx->current];
+	buf[ctx->current] = NULL;
+	memcpy(job.image, &crc, sizeof(crc));
+	if (ctx->redundant)
+		((struct uboot_env_redund *)job.image)->flags = job.flags;
+
+	ret = store_commit(ctx, &job);
+
+	/*
+	 * Keep the variables of the context in sync, or let the next
+	 * refresh reload them if the storage had changed meanwhile
+	 */
+	entry = __libuboot_get_env(&ctx->varlist, varname);
+	if (ret || (entry && !(value_dup = strdup(newval)))) {
+		loaded = false;
+	} else if (entry) {
+		free(entry->value);
+		entry->value = value_dup;
+	}
+
+out:
+	ctx->valid = loaded;
+	free(buf[0]);
+	free(buf[1]);
+	if (!locked)
+		libuboot_unlock(ctx);
+
+	return ret;
+}
+
+int libuboot_env_increment(struct uboot_ctx *ctx, const char *varname,
+			   long long delta, unsigned long long *value)
+{
+	unsigned long long n = 0;
+	int ret;
+
+	ret = env_update_number(ctx, varname, true, delta, &n);
+	if (!ret && value)
+		*value = n;
+
+	return ret;
+}
+
+int libuboot_env_set_number(struct uboot_ctx *ctx, const char *varname,
+			    unsigned long long value)
+{
+	return env_update_number(ctx, varname, false, 0, &value);
+}
+
+int libuboot_load_image(struct uboot_ctx *ctx, const void *image, size_t len)
+{
+	void *buf[2];
+	int ret;
+
+	if (!ctx || !image || !ctx->size)
+		return -EINVAL;
+
+	/*
+	 * Either one copy or, for a redundant environment,
+	 * both copies one after the other
+	 */
+	if (len != ctx->size && !(ctx->redundant && len == 2 * ctx->size))
+		return -EINVAL;
+
+	/* the variables are split in place */
+	buf[0] = malloc(2 * ctx->size);
+	if (!buf[0])
+		return -ENOMEM;
+	buf[1] = buf[0] + ctx->size;
+	memcpy(buf[0], image, len);
+	if (len == ctx->size)
+		memcpy(buf[1], image, len);
+
+	check_copy(ctx, 0, buf[0]);
+	if (ctx->redundant)
+		check_copy(ctx, 1, buf[1]);
+	free_var_list(&ctx->varlist);
+	ret = load_copies(ctx, NULL, buf);
+	free(buf[0]);
+
+	return ret;
+}
+
+int libuboot_configure_image(struct uboot_ctx *ctx, size_t size, int redundant)
+{
+	int i;
+
+	if (!ctx || size <= sizeof(struct uboot_env_redund))
+		return -EINVAL;
+
+	/* the layout of a context with devices comes from them */
+	if (ctx->envdevs[0].ops)
+		return -EBUSY;
+
+	ctx->size = size;
+	ctx->redundant = !!redundant;
+	ctx->current = 0;
+	for (i = 0; i < 2; i++) {
+		ctx->envdevs[i].envsize = size;
+		ctx->envdevs[i].flags = 0;
+		ctx->envdevs[i].flagstype = FLAGS_INCREMENTAL;
+	}
+
+	return 0;
+}
+
+int libuboot_set_erase_ahead(struct uboot_ctx *ctx, int enable)
+{
+	if (!ctx)
+		return -EINVAL;
+
+	ctx->erase_ahead = !!enable;
+
+	return 0;
+}
+
+int libuboot_set_padding(struct uboot_ctx *ctx, unsigned int padding)
+{
+	if (!ctx || (padding != 0x00 && padding != 0xFF))
+		return -EINVAL;
+
+	ctx->padding = padding;
+
+	return 0;
+}
+
+int libuboot_set_read_mode(struct uboot_ctx *ctx, enum libuboot_read_mode mode)
+{
+	if (!ctx || mode > LIBUBOOT_READ_PARALLEL)
+		return -EINVAL;
+
+	ctx->read_mode = mode;
+
+	return 0;
+}
+
+
+#if defined(__FreeBSD__)
+int libuboot_watch(struct uboot_ctx *ctx)
+{
+	return -ENOSYS;
+}
+#else
+int libuboot_watch(struct uboot_ctx *ctx)
+{
+	char *stampfile;
+	int fd;
+
+	if (!ctx)
+		return -EINVAL;
+
+	if (ctx->watchfd > 0)
+		return ctx->watchfd;
+
+	if (asprintf(&stampfile, "%s%s", ctx->lockfile ?: default_lockname,
+		     STAMPFILE_SUFFIX) < 0)
+		return -ENOMEM;
+
+	/*
+	 * The stamp file must exist to be watched
+	 */
+	fd = open(stampfile, O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+	if (fd >= 0)
+		close(fd);
+
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0) {
+		free(stampfile);
+		return -errno;
+	}
+
+	if (inotify_add_watch(fd, stampfile, IN_CLOSE_WRITE) < 0) {
+		int err = -errno;
+		close(fd);
+		free(stampfile);
+		return err;
+	}
+	free(stampfile);
+
+	ctx->watchfd = fd;
+
+	return fd;
+}
+#endif
+
+/*
+ * Reload the environment if the headers on the storage differ
+ * from the ones seen at the last load or store
+ */
+static int __libuboot_refresh(struct uboot_ctx *ctx, libuboot_change_cb cb, void *priv)
+{
+	uint8_t hdr[sizeof(struct uboot_env_redund)];
+	uint8_t hdrsize = offsetof(struct uboot_env_noredund, data);
+	uint8_t offsetflags = offsetof(struct uboot_env_redund, flags);
+	struct load_state state;
+	struct var_entry *e, *tmp;
+	bool locked, changed = !ctx->valid;
+	int i, ret = 0;
+
+	store_reap(ctx);
+	ctx_stats_begin(ctx);
+
+	if (ctx->redundant)
+		hdrsize = offsetof(struct uboot_env_redund, data);
+
+	locked = ctx->lock > 0;
+	if (!locked)
+		libuboot_lock(ctx);
+
+	for (i = 0; i < (ctx->redundant ? 2 : 1) && !changed; i++) {
+		struct uboot_flash_env *dev = &ctx->envdevs[i];
+
+		if (devread(ctx, i, hdr, hdrsize) != hdrsize) {
+			ret = -EIO;
+			goto out;
+		}
+		if (*(uint32_t *)hdr != dev->storedcrc ||
+		    (ctx->redundant && hdr[offsetflags] != dev->flags))
+			changed = true;
+	}
+	if (!changed)
+		goto out;
+
+	/*
+	 * Move the current variables apart and reload
+	 */
+	memset(&state, 0, sizeof(state));
+	if ((state.old.lh_first = ctx->varlist.lh_first) != NULL)
+		state.old.lh_first->next.le_prev = &state.old.lh_first;
+	LIST_INIT(&ctx->varlist);
+	state.cb = cb;
+	state.priv = priv;
+
+	ret = libuboot_load(ctx, &state);
+	if (ret < 0 && LIST_EMPTY(&ctx->varlist)) {
+		/* nothing read, keep what was there */
+		if ((ctx->varlist.lh_first = state.old.lh_first) != NULL)
+			ctx->varlist.lh_first->next.le_prev = &ctx->varlist.lh_first;
+		goto out;
+	}
+
+	/*
+	 * What is left was dropped from the environment
+	 */
+	LIST_FOREACH_SAFE(e, &state.old, next, tmp) {
+		if (ret >= 0 && cb)
+			cb(e->name, e->value, NULL, priv);
+		state.changes++;
+	}
+	free_var_list(&state.old);
+
+	if (ret >= 0)
+		ret = state.changes;
+
+out:
+	if (!locked)
+		libuboot_unlock(ctx);
+
+	return ret;
+}
+
+int libuboot_refresh(struct uboot_ctx *ctx)
+{
+	if (!ctx)
+		return -EINVAL;
+
+	return __libuboot_refresh(ctx, NULL, NULL);
+}
+
+int libuboot_watch_changes(struct uboot_ctx *ctx, libuboot_change_cb cb, void *priv)
+{
+	char events[1024] __attribute__((aligned(8)));
+
+	if (!ctx)
+		return -EINVAL;
+
+	if (ctx->watchfd > 0)
+		while (read(ctx->watchfd, events, sizeof(events)) > 0);
+
+	return __libuboot_refresh(ctx, cb, priv);
+}
+
+/*
+ * Read the whole input into a buffer, terminated by '\0'
+ */
+static int read_all(int fd, char **out, size_t *outlen)
+{
+	struct stat st;
+	size_t size = 4096, len = 0;
+	char *buf, *tmp;
+	ssize_t n;
+
+	if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0)
+		size = st.st_size + 1;
+
+	buf = malloc(size);
+	if (!buf)
+		return -ENOMEM;
+
+	while (1) {
+		if (len + 1 >= size) {
+			size *= 2;
+			tmp = realloc(buf, size);
+			if (!tmp) {
+				free(buf);
+				return -ENOMEM;
+			}
+			buf = tmp;
+		}
+		n = read(fd, buf + len, size - len - 1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			free(buf);
+			return -EIO;
+		}
+		if (n == 0)
+			break;
+		len += n;
+	}
+	buf[len] = '\0';
+
+	*out = buf;
+	*outlen = len;
+
+	return 0;
+}
+
+/*
+ * Parse a text environment in place in the same way as U-Boot does
+ * with "env import -t": a backslash escapes the next character, so
+ * values can span more lines. Lines starting with '#' and lines
+ * without '=' are skipped, an empty value drops the variable.
+ */
+static int parse_text_env(char *buf, size_t len, struct import_pair **out, size_t *npairs)
+{
+	struct import_pair *pairs = NULL, *tmp;
+	size_t n = 0, size = 0;
+	char *p = buf, *end = buf + len;
+	char *name, *value, *dst;
+
+	while (p < end) {
+		if (*p == '#' || *p == '\n' || *p == '\r') {
+			p = memchr(p, '\n', end - p);
+			if (!p)
+				break;
+			p++;
+			continue;
+		}
+
+		name = p;
+		while (p < end && *p != '=' && *p != '\n')
+			p++;
+		if (p == end || *p == '\n') {
+			/* no value, ignored */
+			p++;
+			continue;
+		}
+		*p++ = '\0';
+
+		/*
+		 * A backslash at the end of a line continues the value
+		 * on the next one, any other backslash is kept as it is
+		 */
+		value = dst = p;
+		while (p < end && *p != '\n') {
+			if (*p == '\\' && p + 1 < end && p[1] == '\n') {
+				p++;
+			} else if (*p == '\\' && p + 2 < end && p[1] == '\r' &&
+				   p[2] == '\n') {
+				p += 2;
+			}
+			*dst++ = *p++;
+		}
+		/* DOS line endings */
+		while (dst > value && dst[-1] == '\r')
+			dst--;
+		*dst = '\0';
+		p++;
+
+		if (n == size) {
+			size = size ? size * 2 : 256;
+			tmp = realloc(pairs, size * sizeof(*pairs));
+			if (!tmp) {
+				free(pairs);
+				return -ENOMEM;
+			}
+			pairs = tmp;
+		}
+		pairs[n].name = name;
+		pairs[n].value = *value ? value : NULL;
+		pairs[n].pos = n;
+		n++;
+	}
+
+	*out = pairs;
+	*npairs = n;
+
+	return 0;
+}
+
+/*
+ * Merge sorted pairs into the sorted list of variables in a single
+ * pass. The same rules as libuboot_set_env() apply for each variable.
+ */
+static int merge_pairs(struct uboot_ctx *ctx, struct import_pair *pairs, size_t n,
+		       libuboot_change_cb cb, void *priv)
+{
+	struct var_entry *cursor = LIST_FIRST(&ctx->varlist), *last = NULL;
+	struct var_entry *entry, *validate, *tmp;
+	char *name, *value, *newvalue;
+	int changes = 0;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		/* only the last assignment counts */
+		if (i + 1 < n && !strcmp(pairs[i].name, pairs[i + 1].name))
+			continue;
+
+		name = pairs[i].name;
+		value = pairs[i].value;
+		if (!*name)
+			continue;
+
+		validate = NULL;
+		if (!LIST_EMPTY(&ctx->writevarlist)) {
+			validate = __libuboot_get_env(&ctx->writevarlist, name);
+			if (!validate)
+				continue;
+		}
+
+		while (cursor && strcmp(cursor->name, name) < 0) {
+			last = cursor;
+			cursor = LIST_NEXT(cursor, next);
+		}
+
+		if (cursor && !strcmp(cursor->name, name)) {
+			entry = cursor;
+			bool valid = libuboot_validate_flags(entry, value);
+			if (validate) {
+				entry->access = validate->access;
+				entry->type = validate->type;
+				valid &= libuboot_validate_flags(entry, value);
+			}
+			if (!valid)
+				continue;
+			if (!value) {
+				if (cb)
+					cb(name, entry->value, NULL, priv);
+				changes++;
+				tmp = LIST_NEXT(entry, next);
+				free_var_entry(entry);
+				cursor = tmp;
+			} else if (strcmp(entry->value, value)) {
+				newvalue = strdup(value);
+				if (!newvalue)
+					return -ENOMEM;
+				if (cb)
+					cb(name, entry->value, value, priv);
+				changes++;
+				free(entry->value);
+				entry->value = newvalue;
+			}
+			continue;
+		}
+
+		if (!value)
+			continue;
+
+		entry = create_var_entry(name);
+		if (!entry)
+			return -ENOMEM;
+		entry->value = strdup(value);
+		if (!entry->value) {
+			FREE_ENTRY;
+			return -ENOMEM;
+		}
+		if (validate) {
+			entry->access = validate->access;
+			entry->type = validate->type;
+			if (!libuboot_validate_flags(entry, value)) {
+				FREE_ENTRY;
+				continue;
+			}
+		}
+
+		if (cursor)
+			LIST_INSERT_BEFORE(cursor, entry, next);
+		else if (last)
+			LIST_INSERT_AFTER(last, entry, next);
+		else
+			LIST_INSERT_HEAD(&ctx->varlist, entry, next);
+		last = entry;
+
+		if (cb)
+			cb(name, NULL, value, priv);
+		changes++;
+	}
+
+	return changes;
+}
+
+/*
+ * Import a text environment from a writable, NUL terminated buffer,
+ * return the number of changed variables
+ */
+static int import_text(struct uboot_ctx *ctx, char *buf, size_t len,
+		       libuboot_change_cb cb, void *priv)
+{
+	struct import_pair *pairs;
+	size_t n;
+	int ret;
+
+	ret = parse_text_env(buf, len, &pairs, &n);
+	if (ret)
+		return ret;
+
+	qsort(pairs, n, sizeof(*pairs), cmp_import_pair);
+	ret = merge_pairs(ctx, pairs, n, cb, priv);
+
+	free(pairs);
 
 	return ret;
 }
 
-static int libuboot_load(struct uboot_ctx *ctx)
+/*
+ * Import a text environment from a descriptor, return the
+ * number of changed variables
+ */
+static int libuboot_import_fd(struct uboot_ctx *ctx, int fd,
+			      libuboot_change_cb cb, void *priv)
 {
-	int ret, i;
-	int copies = 1;
-	void *buf[2];
-	size_t bufsize, usable_envsize;
-	struct uboot_flash_env *dev;
-	bool crcenv[2];
-	char *line, *next;
-	uint8_t offsetdata = offsetof(struct uboot_env_noredund, data);
-	uint8_t offsetcrc = offsetof(struct uboot_env_noredund, crc);
-	uint8_t offsetflags = offsetof(struct uboot_env_redund, flags);
-	char *data;
-	struct var_entry *entry;
-
-	ctx->valid = false;
+	size_t len;
+	char *buf;
+	int ret;
 
-	bufsize = ctx->size;
-	if (ctx->redundant) {
-		copies++;
-		bufsize += ctx->size;
-		offsetdata = offsetof(struct uboot_env_redund, data);
-		offsetcrc = offsetof(struct uboot_env_redund, crc);
-	}
-	usable_envsize = ctx->size - offsetdata;
-	buf[0] = malloc(bufsize);
-	if (!buf[0])
-		return -ENOMEM;
+	ret = read_all(fd, &buf, &len);
+	if (ret)
+		return ret;
 
-	if (copies > 1)
-		buf[1] = buf[0] + ctx->envdevs[0].envsize;
+	ret = import_text(ctx, buf, len, cb, priv);
+	free(buf);
 
-	for (i = 0; i < copies; i++) {
-		data = (char *)(buf[i] + offsetdata);
-		uint32_t crc;
+	return ret;
+}
 
-		dev = &ctx->envdevs[i];
-		ret = devread(ctx, i, buf[i]);
-		if (ret != ctx->size) {
-			free(buf[0]);
-			return -EIO;
-		}
-		crc = *(uint32_t *)(buf[i] + offsetcrc);
-		dev->crc = crc32(0, (uint8_t *)data, usable_envsize);
-		crcenv[i] = dev->crc == crc;
-		if (ctx->redundant)
-			dev->flags = *(uint8_t *)(buf[i] + offsetflags);
-	}
-	if (!ctx->redundant) {
-		ctx->current = 0;
-		ctx->valid = crcenv[0];
-	} else {
-		if (crcenv[0] && !crcenv[1]) {
-			ctx->valid = true;
-			ctx->current = 0;
-		} else if (!crcenv[0] && crcenv[1]) {
-			ctx->valid = true;
-			ctx->current = 1;
-		} else if (!crcenv[0] && !crcenv[1]) {
-			ctx->valid = false;
-			ctx->current = 0;
-		} else { /* both valid, check flags */
-			ctx->valid = true;
-			if (ctx->envdevs[1].flags > ctx->envdevs[0].flags)
-				ctx->current = 1;
-			else
-				ctx->current = 0;
-			switch (ctx->envdevs[0].flagstype) {
-			case FLAGS_BOOLEAN:
-				if (ctx->envdevs[1].flags == 0xFF)
-					ctx->current = 1;
-				else if (ctx->envdevs[0].flags == 0xFF)
-					ctx->current = 0;
-				break;
-			case FLAGS_INCREMENTAL:
-				/* check overflow */
-				if (ctx->envdevs[0].flags == 0xFF &&
-					ctx->envdevs[1].flags == 0)
-					ctx->current = 1;
-				else if (ctx->envdevs[1].flags == 0xFF &&
-					ctx->envdevs[0].flags == 0)
-					ctx->current = 0;
-				break;
-			}
+/*
+ * Check sorted pairs against the rules of libuboot_set_env() and
+ * resolve the attributes they get, without changing the context
+ */
+static int check_overrides(struct uboot_ctx *ctx, struct import_pair *pairs, size_t n)
+{
+	struct var_entry *cursor = LIST_FIRST(&ctx->varlist);
+	struct var_entry *validate, check;
+	struct import_pair *p;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		p = &pairs[i];
+		if (i + 1 < n && !strcmp(p->name, pairs[i + 1].name))
+			continue;
+		if (!*p->name)
+			continue;
+		if (strchr(p->name, '='))
+			return -EINVAL;
+
+		while (cursor && strcmp(cursor->name, p->name) < 0)
+			cursor = LIST_NEXT(cursor, next);
+		if (cursor && strcmp(cursor->name, p->name))
+			cursor = NULL;
+
+		memset(&check, 0, sizeof(check));
+		if (cursor) {
+			check.type = cursor->type;
+			check.access = cursor->access;
+			if (!libuboot_validate_flags(&check, p->value))
+				return -EPERM;
 		}
-	}
-
-#if !defined(NDEBUG)
-	fprintf(stdout, "Environment %s, copy %d\n",
-			ctx->valid ? "OK" : "WRONG", ctx->current);
-#endif
-
-	data = (char *)(buf[ctx->current] + offsetdata);
 
-	char *flagsvar = NULL;
+		if (!LIST_EMPTY(&ctx->writevarlist)) {
+			validate = __libuboot_get_env(&ctx->writevarlist, p->name);
+			if (!validate)
+				return -EPERM;
+			check.type = validate->type;
+			check.access = validate->access;
+			if (!libuboot_validate_flags(&check, p->value))
+				return -EPERM;
+		}
 
-	if (ctx->valid) {
-		for (line = data; *line; line = next + 1) {
-			char *value;
+		p->type = check.type;
+		p->access = check.access;
+	}
 
-			/*
-			 * Search the end of the string pointed by line
-			 */
-			for (next = line; *next; ++next) {
-				if ((next - (char *)data) > usable_envsize) {
-					free(buf[0]);
-					return -EIO;
-				}
-			}
+	return 0;
+}
 
-			value = strchr(line, '=');
-			if (!value)
-				continue;
+int libuboot_serialize_overrides(struct uboot_ctx *ctx, const char *text,
+				 size_t textlen, void *buf, size_t len)
+{
+	struct import_pair *pairs = NULL;
+	size_t n = 0;
+	char *copy;
+	int ret;
 
-			*value++ = '\0';
+	if (!ctx || !buf || !ctx->size || (!text && textlen))
+		return -EINVAL;
+	if (len < ctx->size)
+		return -ENOSPC;
 
-			if (!strcmp(line, ".flags"))
-				flagsvar = strdup(value);
-			else
-				__libuboot_set_env(ctx, line, value, NULL);
-		}
+	/* the parser works in place */
+	copy = malloc(textlen + 1);
+	if (!copy)
+		return -ENOMEM;
+	if (textlen)
+		memcpy(copy, text, textlen);
+	copy[textlen] = '\0';
+
+	ret = parse_text_env(copy, textlen, &pairs, &n);
+	if (!ret) {
+		qsort(pairs, n, sizeof(*pairs), cmp_import_pair);
+		ret = check_overrides(ctx, pairs, n);
 	}
+	if (!ret)
+		ret = env_serialize(ctx, pairs, n, buf);
+	if (!ret)
+		env_seal(ctx, buf, next_flags(ctx), NULL);
 
-	/*
-	 * Parse .flags and set the attributes for a variable
-	 */
-	char *pvar;
-	char *pval;
-	if (flagsvar) {
-#if !defined(NDEBUG)
-	fprintf(stdout, "Environment FLAGS %s\n", flagsvar);
-#endif
-		unsigned int flagslen = strlen(flagsvar);
-		pvar = flagsvar;
+	free(pairs);
+	free(copy);
 
-		while (*pvar && (pvar - flagsvar) < flagslen) {
-			char *pnext;
-			pval = strchr(pvar, ':');
-			if (!pval)
-				break;
+	return ret ? ret : ctx->size;
+}
 
-			*pval++ = '\0';
-			pnext = strchr(pval, ',');
-			if (!pnext)
-				pnext = flagsvar + strlen(flagsvar);
-			else
-				*pnext++ = '\0';
+int libuboot_load_env_mem(struct uboot_ctx *ctx, const char *buf, size_t len)
+{
+	char *copy;
+	int ret;
 
-			entry = __libuboot_get_env(&ctx->varlist, pvar);
-			set_var_access_type(entry, pval);
-			pvar = pnext;
-		}
-	}
-	free(flagsvar);
+	if (!ctx || (!buf && len))
+		return -EINVAL;
 
-	free(buf[0]);
+	/* the parser works in place */
+	copy = malloc(len + 1);
+	if (!copy)
+		return -ENOMEM;
+	if (len)
+		memcpy(copy, buf, len);
+	copy[len] = '\0';
 
-	return ctx->valid ? 0 : -ENODATA;
+	ret = import_text(ctx, copy, len, NULL, NULL);
+	free(copy);
+
+	return ret < 0 ? ret : 0;
 }
 
-#define LINE_LENGTH 2048
-int libuboot_load_file(struct uboot_ctx *ctx, const char *filename)
+int libuboot_import_file(struct uboot_ctx *ctx, const char *filename,
+			 libuboot_change_cb cb, void *priv)
 {
-	FILE *fp;
-	char *buf;
-	char *name, *value;
+	int fd, ret;
 
 	if (!filename)
 		return -EBADF;
 
 	if (strcmp(filename, "-") == 0)
-		fp = fdopen(0, "r");
+		fd = STDIN_FILENO;
 	else
-		fp = fopen(filename, "r");
-	if (!fp)
+		fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
 		return -EACCES;
 
-	buf = (char *)malloc(LINE_LENGTH);
-	if (!buf) {
-		fclose(fp);
-		return -ENOMEM;
-	}
+	ret = libuboot_import_fd(ctx, fd, cb, priv);
+	if (fd != STDIN_FILENO)
+		close(fd);
 
-	while (fgets(buf, LINE_LENGTH, fp)) {
-		int len = strlen(buf);
+	return ret;
+}
 
-		while (len && (buf[len - 1] == '\n' || buf [len - 1] == '\r'))
-			buf[--len] = '\0';
+int libuboot_load_file(struct uboot_ctx *ctx, const char *filename)
+{
+	int ret = libuboot_import_file(ctx, filename, NULL, NULL);
 
-		/* Skip comment or empty lines */
-		if (len == 0 || buf[0] == '#')
-			continue;
+	return ret < 0 ? ret : 0;
+}
 
-		value = strchr(buf, '=');
-		if (!value)
-			continue;
+/*
+ * Devices are resolved and checked once the whole
+ * configuration is known, for configurations
+ * coming from the cache, too.
+ */
+static int probe_ctx(struct uboot_ctx *ctx)
+{
+	int i;
+
+	for (i = 0; i < (ctx->redundant ? 2 : 1); i++) {
+		if (probe_env_device(&ctx->envdevs[i]) < 0)
+			return -EINVAL;
+	}
 
-		*value++ = '\0';
+	if (!check_compatible_devices(ctx))
+		return -EINVAL;
 
-		name = buf;
+	return 0;
+}
 
-		if (!strlen(value))
-			value = NULL;
+static int probe_config(struct uboot_ctx *ctxlist)
+{
+	int i, ret;
 
-		libuboot_set_env(ctx, name, value);
+	for (i = 0; i < (ctxlist->nelem ? ctxlist->nelem : 1); i++) {
+		ret = probe_ctx(&ctxlist[i]);
+		if (ret)
+			return ret;
 	}
-	fclose(fp);
-	free(buf);
 
 	return 0;
 }
 
-int libuboot_read_config_ext(struct uboot_ctx **ctxlist, const char *config)
+/*
+ * A legacy configuration starts with a device path, a YAML one
+ * with a document marker or with the key of a namespace.
+ * Just the first token is checked, the right parser reports errors.
+ */
+static bool is_yaml_config(FILE *fp)
+{
+	char *line = NULL, *p, *end;
+	size_t bufsize = 0;
+	bool yaml = false;
+
+	while (getline(&line, &bufsize, fp) != -1) {
+		p = line + strspn(line, " \t\r\n");
+		if (!*p || *p == '#')
+			continue;
+
+		if (!strncmp(p, "---", 3) || *p == '%') {
+			yaml = true;
+			break;
+		}
+		end = p + strcspn(p, " \t\r\n");
+		if (end[-1] == ':') {
+			yaml = true;
+			break;
+		}
+		end += strspn(end, " \t");
+		yaml = *end == ':';
+		break;
+	}
+	free(line);
+
+	return yaml;
+}
+
+/*
+ * Parse a configuration without checking the devices. A new
+ * list of contexts is allocated if *ctxlist is NULL, else
+ * the passed context is filled from a legacy configuration.
+ */
+static int parse_config(struct uboot_ctx **ctxlist, FILE *fp)
 {
-	FILE *fp;
 	char *line = NULL;
 	size_t bufsize = 0;
 	int ret = 0;
@@ -830,24 +2632,17 @@ int libuboot_read_config_ext(struct uboot_ctx **ctxlist, const char *config)
 	int retval = 0;
 	struct uboot_ctx *ctx;
 
-	if (!config)
-		return -EINVAL;
-
-	fp = fopen(config, "r");
-	if (!fp)
-		return -EBADF;
-
 	if (!*ctxlist) {
-		ret = parse_yaml_config(ctxlist, fp);
-		if (!ret) {
-			fclose(fp);
+		if (is_yaml_config(fp)) {
+			rewind(fp);
+			ret = parse_yaml_config(ctxlist, fp);
+			if (ret)
+				return ret < 0 ? ret : -EINVAL;
 			return 0;
 		}
 		ret = libuboot_initialize(ctxlist, NULL);
-		if (ret) {
-			fclose(fp);
+		if (ret)
 			return ret;
-		}
 	}
 	ctx = *ctxlist;
 
@@ -902,38 +2697,84 @@ int libuboot_read_config_ext(struct uboot_ctx **ctxlist, const char *config)
 			ctx->size = dev->envsize;
 
 		if (tmp) {
-			if (normalize_device_path(tmp, dev) < 0) {
+			if (strlen(tmp) >= sizeof(dev->devname)) {
 				free(tmp);
 				retval = -EINVAL;
 				break;
 			}
+			strcpy(dev->devname, tmp);
 			free(tmp);
 		}
 
-		if (check_env_device(dev) < 0) {
-			retval = -EINVAL;
-			break;
-		}
-
 		ndev++;
 		dev++;
 
 		if (ndev >= 2) {
 			ctx->redundant = true;
-			if (!check_compatible_devices(ctx))
-				retval = -EINVAL;
 			break;
 		}
 	}
 	if (ndev == 0)
 		retval = -EINVAL;
 
-	fclose(fp);
 	free(line);
 
 	return retval;
 }
 
+int libuboot_read_config_ext(struct uboot_ctx **ctxlist, const char *config)
+{
+	FILE *fp;
+	struct stat st;
+	bool created;
+	int ret;
+
+	if (!config)
+		return -EINVAL;
+
+	if (stat(config, &st) < 0)
+		return -EBADF;
+
+	if (!*ctxlist && !config_cache_load(ctxlist, config, &st))
+		return probe_config(*ctxlist);
+
+	fp = fopen(config, "r");
+	if (!fp)
+		return -EBADF;
+
+	created = !*ctxlist;
+	ret = parse_config(ctxlist, fp);
+	fclose(fp);
+	if (ret)
+		return ret;
+
+	if (created)
+		config_cache_save(*ctxlist, config, &st);
+
+	return probe_config(*ctxlist);
+}
+
+int libuboot_read_config_mem(struct uboot_ctx **ctxlist, const char *buf, size_t len)
+{
+	FILE *fp;
+	int ret;
+
+	if (!ctxlist || !buf || !len)
+		return -EINVAL;
+
+	/* opened read only, the buffer is not modified */
+	fp = fmemopen((void *)buf, len, "r");
+	if (!fp)
+		return -ENOMEM;
+
+	ret = parse_config(ctxlist, fp);
+	fclose(fp);
+	if (ret)
+		return ret;
+
+	return probe_config(*ctxlist);
+}
+
 int libuboot_read_config(struct uboot_ctx *ctx, const char *config)
 {
 	return libuboot_read_config_ext(&ctx, config);
@@ -1096,29 +2937,31 @@ int libuboot_initialize(struct uboot_ctx **out,
 }
 
 int libuboot_open(struct uboot_ctx *ctx) {
+	uint64_t start;
+	int ret;
+
 	if (!ctx)
 		return -EINVAL;
+
+	store_reap(ctx);
+	start = stats_now();
+	ctx_stats_begin(ctx);
 	libuboot_lock(ctx);
 
-	return libuboot_load(ctx);
+	ret = libuboot_load(ctx, NULL);
+	stats_record(&ctx->stats, LIBUBOOT_STATS_OPEN, start, ret ? 0 : ctx->size);
+
+	return ret;
 }
 
 void libuboot_close(struct uboot_ctx *ctx) {
-	struct var_entry *e, *tmp;
-
 	if (!ctx)
 		return;
+	libuboot_env_flush(ctx);
 	ctx->valid = false;
 	libuboot_unlock(ctx);
 
-	LIST_FOREACH_SAFE(e, &ctx->varlist, next, tmp) {
-		if (e->name)
-			free(e->name);
-		if (e->value)
-			free(e->value);
-		LIST_REMOVE(e, next);
-		free(e);
-	}
+	free_var_list(&ctx->varlist);
 }
 
 void libuboot_exit(struct uboot_ctx *ctx)
@@ -1139,8 +2982,15 @@ void libuboot_exit(struct uboot_ctx *ctx)
 	}
 
 	for (i = 0, c = ctx; i < ctx->nelem; i++, c++) {
+		/* a store in flight completes before the lock is released */
+		libuboot_unlock(c);
 		free(c->name);
 		free(c->lockfile);
+		free(c->lastdata);
+		if (c->watchfd > 0)
+			close(c->watchfd);
+		if (c->storefd > 0)
+			close(c->storefd);
 	}
 
 	free(ctx);
@@ -0,0 +1,234 @@
+/*
+ * (C) Copyright 2026
+ * Stefano Babic, <stefano.babic@swupdate.org>
+ *
+ * SPDX-License-Identifier:     LGPL-2.1-or-later
+ */
+
+/**
+ * @file uboot_file.c
+ *
+ * @brief Backend for files and block devices
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "uboot_private.h"
+#include "common.h"
+
+static int fileread(struct uboot_flash_env *dev, void *data, size_t size)
+{
+	int ret = 0;
+
+	if (dev->offset)
+		ret = lseek(dev->fd, dev->offset, SEEK_SET);
+
+	if (ret < 0)
+		return ret;
+
+	size_t remaining = size;
+
+	while (1) {
+		ret = read(dev->fd, data, remaining);
+
+		if (ret == 0 && remaining > 0)
+		    return -1;
+
+		if (ret < 0)
+			break;
+
+		remaining -= ret;
+		data += ret;
+
+		if (!remaining) {
+			ret = size;
+			break;
+		}
+	}
+
+	return ret;
+}
+
+static int fileprotect(struct uboot_flash_env *dev, bool on)
+{
+	const char c_sys_path_1[] = "/sys/class/block/";
+	const char c_sys_path_2[] = "/force_ro";
+	const char c_dev_name_1[] = "mmcblk";
+	const char c_dev_name_2[] = "boot";
+	const char c_unprot_char = '0';
+	const char c_prot_char = '1';
+	const char *devfile = dev->devname;
+	int ret = 0;  // 0 means OK, negative means error
+	int ret_int = 0;
+	char *sysfs_path = NULL;
+	int fd_force_ro;
+
+	// Devices without ro flag at /sys/class/block/mmcblk?boot?/force_ro are ignored
+	if (strncmp("/dev/block/", dev->devname, 11) == 0) {
+		devfile = dev->devname + 11;
+	} else if (strncmp("/dev/", dev->devname, 5) == 0) {
+		devfile = dev->devname + 5;
+	} else {
+		return ret;
+	}
+
+	ret_int = strncmp(devfile, c_dev_name_1, sizeof(c_dev_name_1) - 1);
+	if (ret_int != 0) {
+		return ret;
+	}
+
+	if (strncmp(devfile + sizeof(c_dev_name_1), c_dev_name_2, sizeof(c_dev_name_2) - 1) != 0) {
+		return ret;
+	}
+
+	if (*(devfile + sizeof(c_dev_name_1) - 1) < '0' ||
+	    *(devfile + sizeof(c_dev_name_1) - 1) > '9') {
+		return ret;
+	}
+
+	if (*(devfile + sizeof(c_dev_name_1) + sizeof(c_dev_name_2) - 1) < '0' ||
+	    *(devfile + sizeof(c_dev_name_1) + sizeof(c_dev_name_2) - 1) > '9') {
+		return ret;
+	}
+
+	// There is a ro flag, the device needs to be protected or unprotected
+	ret_int = asprintf(&sysfs_path, "%s%s%s", c_sys_path_1, devfile, c_sys_path_2);
+	if(ret_int < 0) {
+		ret = -ENOMEM;
+		goto fileprotect_out;
+	}
+
+	if (access(sysfs_path, W_OK) == -1) {
+		goto fileprotect_out;
+	}
+
+	fd_force_ro = open(sysfs_path, O_RDWR);
+	if (fd_force_ro == -1) {
+		ret = -EBADF;
+		goto fileprotect_out;
+	}
+
+	if(on == false){
+		ret_int = write(fd_force_ro, &c_unprot_char, 1);
+	} else {
+		ret_int = write(fd_force_ro, &c_prot_char, 1);
+	}
+	close(fd_force_ro);
+
+fileprotect_out:
+	if(sysfs_path)
+		free(sysfs_path);
+	return ret;
+}
+
+static int filewrite(struct uboot_flash_env *dev, void *data)
+{
+	int ret = 0;
+
+	if (dev->offset)
+		ret = lseek(dev->fd, dev->offset, SEEK_SET);
+
+	if (ret < 0)
+		return ret;
+
+	size_t remaining = dev->envsize;
+
+	while (1) {
+		ret = write(dev->fd, data, remaining);
+
+		if (ret < 0)
+			break;
+
+		remaining -= ret;
+		data += ret;
+
+		if (!remaining) {
+			ret = dev->envsize;
+			break;
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * eMMC boot partitions are read-only by default: they are
+ * unprotected while the device is open for writing
+ */
+static int fileopen(struct uboot_flash_env *dev, int flags)
+{
+	int ret;
+
+	dev->fd = open(dev->devname, flags);
+	if (dev->fd < 0)
+		return -EBADF;
+
+	if ((flags & O_ACCMODE) != O_RDONLY) {
+		ret = fileprotect(dev, false);
+		if (ret < 0) {
+			close(dev->fd);
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+static void fileclose(struct uboot_flash_env *dev)
+{
+	int flags = fcntl(dev->fd, F_GETFL);
+
+	close(dev->fd);
+	if (flags >= 0 && (flags & O_ACCMODE) != O_RDONLY)
+		fileprotect(dev, true);  // no error handling, keep ret from write
+}
+
+static int filesync(struct uboot_flash_env *dev)
+{
+	/* not every device supports it, as before it is not an error */
+	fsync(dev->fd);
+
+	return 0;
+}
+
+static bool filematch(const char *devname)
+{
+	return strncmp(devname, DEVICE_MTD_NAME, strlen(DEVICE_MTD_NAME)) &&
+		strncmp(devname, DEVICE_UBI_NAME, strlen(DEVICE_UBI_NAME));
+}
+
+static int fileprobe(struct uboot_flash_env *dev)
+{
+	int fd, ret;
+
+	fd = open(dev->devname, O_RDONLY);
+	if (fd < 0)
+		return -EBADF;
+
+	dev->device_type = DEVICE_FILE;
+	dev->flagstype = FLAGS_INCREMENTAL;
+	ret = resolve_env_offset(dev, fd);
+	close(fd);
+
+	return ret;
+}
+
+const struct uboot_backend_ops libubootenv_file_ops = {
+	.name = "file",
+	.match = filematch,
+	.probe = fileprobe,
+	.open = fileopen,
+	.close = fileclose,
+	.read = fileread,
+	.write = filewrite,
+	.sync = filesync,
+};
@@ -0,0 +1,302 @@
+/*
+ * (C) Copyright 2026
+ * Stefano Babic, <stefano.babic@swupdate.org>
+ *
+ * SPDX-License-Identifier:     LGPL-2.1-or-later
+ */
+
+/**
+ * @file uboot_flash.c
+ *
+ * @brief Read and write a copy on raw flash
+ *
+ * The loops skipping bad blocks and erasing sectors before
+ * programming them are shared by the backends with erase,
+ * program and isbad operations (MTD and simulated flash).
+ * On NOR a copy found blank when it was loaded is programmed
+ * without erasing it again, as any other sector that reads
+ * as erased. A NAND page reading as erased may have been
+ * programmed (ECC in the OOB, interrupted write), so it is
+ * erased unless the context erased it itself under the lock
+ * it holds. Trailing pages that are blank in the data are
+ * left erased instead of programming them.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "uboot_private.h"
+#include "common.h"
+#include "uboot_trace.h"
+
+static int flash_isbad(struct uboot_flash_env *dev, off_t start)
+{
+	if (dev->mtdinfo.type != MTD_NANDFLASH || !dev->ops->isbad)
+		return 0;
+
+	return dev->ops->isbad(dev, start);
+}
+
+#define BLANK_CHUNK	4096
+
+/*
+ * Word by word without branches in the inner loop, so that
+ * the compiler can vectorize it
+ */
+static bool flash_blank_buf(const void *buf, size_t len)
+{
+	const uint64_t *w = buf;
+	const unsigned char *p;
+	uint64_t acc = ~0ULL;
+	size_t i, n = len / sizeof(*w);
+
+	for (i = 0; i < n; i++)
+		acc &= w[i];
+	p = (const unsigned char *)(w + n);
+	for (i = 0; i < len % sizeof(*w); i++)
+		acc &= 0xFFFFFFFFFFFFFF00ULL | p[i];
+
+	return acc == ~0ULL;
+}
+
+/*
+ * Check that len bytes at start read as erased flash. A sector
+ * in use is detected in the first chunk, so the cost of the check
+ * is one small read unless the sector is really blank.
+ */
+static bool flash_blank(struct uboot_flash_env *dev, off_t start, size_t len)
+{
+	uint64_t buf[BLANK_CHUNK / sizeof(uint64_t)];
+	size_t chunk;
+
+	if (lseek(dev->fd, start, SEEK_SET) < 0)
+		return false;
+
+	for (; len > 0; len -= chunk) {
+		chunk = len < sizeof(buf) ? len : sizeof(buf);
+		if (read(dev->fd, buf, chunk) != chunk)
+			return false;
+		if (!flash_blank_buf(buf, chunk))
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Length to program, without the trailing pages of data that
+ * are blank: an erased page reads the same
+ */
+static size_t flash_program_len(struct uboot_flash_env *dev, const void *data, size_t len)
+{
+	size_t page = dev->mtdinfo.writesize ? dev->mtdinfo.writesize : 1;
+	const unsigned char *p = data;
+	size_t end = len;
+
+	while (end > 0 && p[end - 1] == 0xFF)
+		end--;
+	end = ((end + page - 1) / page) * page;
+
+	return end < len ? end : len;
+}
+
+int flash_read(struct uboot_flash_env *dev, void *data, size_t size)
+{
+	size_t count;
+	size_t blocksize;
+	off_t start;
+	int sectors, skip;
+	int ret = 0;
+
+	switch (dev->mtdinfo.type) {
+	case MTD_ABSENT:
+	case MTD_NORFLASH:
+		if (dev->offset)
+			if (lseek(dev->fd, dev->offset, SEEK_SET) < 0) {
+				ret = -EIO;
+				break;
+			}
+		ret = read(dev->fd, data, size);
+		break;
+	case MTD_NANDFLASH:
+		if (dev->offset)
+			if (lseek(dev->fd, dev->offset, SEEK_SET) < 0) {
+				ret = -EIO;
+				break;
+			}
+
+		count = size;
+		start = dev->offset;
+		blocksize = size;
+		sectors = dev->envsectors ? dev->envsectors : 1;
+
+		while (count > 0) {
+			skip = flash_isbad(dev, start);
+			if (skip < 0) {
+				return -EIO;
+			}
+
+			if (skip > 0) {
+				start += dev->sectorsize;
+				sectors--;
+				if (sectors > 0)
+					continue;
+				return  -EIO;
+			}
+
+			if (count > dev->sectorsize)
+				blocksize = dev->sectorsize;
+			else
+				blocksize = count;
+
+			if (lseek(dev->fd, start, SEEK_SET) < 0) {
+				return -EIO;
+			}
+			if (read(dev->fd, data, blocksize) != blocksize) {
+				return -EIO;
+			}
+			start += dev->sectorsize;
+			data += blocksize;
+			count -= blocksize;
+			ret += blocksize;
+		}
+		break;
+	}
+
+	return ret;
+}
+
+int flash_write(struct uboot_flash_env *dev, void *data)
+{
+	int ret = 0;
+	size_t count;
+	size_t blocksize, len;
+	off_t start;
+	void *buf;
+	int sectors, skip, err;
+	uint64_t t;
+
+	switch (dev->mtdinfo.type) {
+	case MTD_NORFLASH:
+	case MTD_NANDFLASH:
+		count = dev->envsize;
+		start = dev->offset;
+		blocksize = dev->envsize;
+		sectors = dev->envsectors ? dev->envsectors : 1;
+		buf = data;
+		while (count > 0) {
+			skip = flash_isbad(dev, start);
+			if (skip < 0)
+				return -EIO;
+
+			if (skip > 0) {
+				dev->counters.badblocks++;
+				start += dev->sectorsize;
+				sectors--;
+				if (sectors > 0)
+					continue;
+				return -EIO;
+			}
+
+			if (count > dev->sectorsize)
+				blocksize = dev->sectorsize;
+			else
+				blocksize = count;
+
+			/*
+			 * Only the bytes to be programmed must be blank,
+			 * the rest of the sector is not part of the copy
+			 */
+			if (dev->mtdinfo.type == MTD_NANDFLASH && dev->erased) {
+				dev->counters.erases_skipped_nand++;
+			} else if (dev->mtdinfo.type == MTD_NORFLASH &&
+				   (dev->erased || flash_blank(dev, start, blocksize))) {
+				dev->counters.erases_skipped++;
+			} else {
+				t = stats_now();
+				TRACE3(erase__start, dev->devname, start, dev->sectorsize);
+				err = dev->ops->erase(dev, start, dev->sectorsize);
+				TRACE3(erase__done, dev->devname, start, err);
+				if (err < 0)
+					return -EIO;
+				stats_record(&dev->stats, LIBUBOOT_STATS_ERASE, t, dev->sectorsize);
+				dev->counters.erases++;
+			}
+
+			len = flash_program_len(dev, buf, blocksize);
+			if (len > 0) {
+				t = stats_now();
+				TRACE3(program__start, dev->devname, start, len);
+				err = dev->ops->program(dev, start, buf, len);
+				TRACE3(program__done, dev->devname, start, err);
+				if (err < 0)
+					return -EIO;
+				stats_record(&dev->stats, LIBUBOOT_STATS_PROGRAM, t, len);
+				dev->counters.programs++;
+				dev->counters.bytes_written += len;
+			}
+
+			start += dev->sectorsize;
+			buf += blocksize;
+			count -= blocksize;
+			ret += blocksize;
+		}
+		break;
+	}
+
+	return ret;
+}
+
+/*
+ * Erase the sectors flash_write() would program, so that
+ * the next write of the copy just programs them
+ */
+int flash_erase(struct uboot_flash_env *dev)
+{
+	size_t count;
+	off_t start;
+	int sectors, skip, err;
+	uint64_t t;
+
+	if (dev->mtdinfo.type != MTD_NORFLASH && dev->mtdinfo.type != MTD_NANDFLASH)
+		return -EINVAL;
+
+	count = dev->envsize;
+	start = dev->offset;
+	sectors = dev->envsectors ? dev->envsectors : 1;
+	while (count > 0) {
+		skip = flash_isbad(dev, start);
+		if (skip < 0)
+			return -EIO;
+
+		if (skip > 0) {
+			start += dev->sectorsize;
+			sectors--;
+			if (sectors > 0)
+				continue;
+			return -EIO;
+		}
+
+		t = stats_now();
+		TRACE3(erase__start, dev->devname, start, dev->sectorsize);
+		err = dev->ops->erase(dev, start, dev->sectorsize);
+		TRACE3(erase__done, dev->devname, start, err);
+		if (err < 0)
+			return -EIO;
+		stats_record(&dev->stats, LIBUBOOT_STATS_ERASE, t, dev->sectorsize);
+		dev->counters.erases++;
+
+		start += dev->sectorsize;
+		count -= count > dev->sectorsize ? dev->sectorsize : count;
+	}
+	/* the caller holds the lock, the next write can skip the erase */
+	dev->erased = true;
+
+	return 0;
+}
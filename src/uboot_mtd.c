@@ -8,7 +8,7 @@
 /**
  * @file uboot_mtd.c
  *
- * @brief function used with MTD subsystem
+ * @brief MTD and UBI storage backends
  *
  */
 
@@ -36,6 +36,7 @@
 #include <mtd/mtd-user.h>
 #include <mtd/ubi-user.h>
 #include "uboot_private.h"
+#include "common.h"
 
 static int ubi_get_dev_id(char *device)
 {
@@ -61,16 +62,6 @@ static int mtd_get_dev_id(char *device)
 	return dev_id;
 }
 
-static int is_nand_badblock(struct uboot_flash_env *dev, loff_t start)
-{
-	int bad;
-	if (dev->mtdinfo.type != MTD_NANDFLASH)
-		return 0;
-	bad = ioctl(dev->fd, MEMGETBADBLOCK, &start);
-	return bad;
-}
-
-
 static int ubi_get_dev_id_from_mtd(char *device)
 {
 	DIR *sysfs_ubi;
@@ -216,7 +207,7 @@ out:
 	return vol_id;
 }
 
-int libubootenv_ubi_update_name(struct uboot_flash_env *dev)
+static int ubi_update_name(struct uboot_flash_env *dev)
 {
 	const size_t VOLNAME_MAX_LENGTH = DEVNAME_MAX_LENGTH - 20;
 	char device[DEVNAME_MAX_LENGTH];
@@ -299,163 +290,75 @@ out:
 	return ret;
 }
 
-int libubootenv_mtdread(struct uboot_flash_env *dev, void *data)
+static int ubiread(struct uboot_flash_env *dev, void *data, size_t size)
 {
-	size_t count;
-	size_t blocksize;
-	loff_t start;
-	int sectors, skip;
 	int ret = 0;
 
-	switch (dev->mtdinfo.type) {
-	case MTD_ABSENT:
-	case MTD_NORFLASH:
-		if (dev->offset)
-			if (lseek(dev->fd, dev->offset, SEEK_SET) < 0) {
-				ret = -EIO;
-				break;
-			}
-		ret = read(dev->fd, data, dev->envsize);
-		break;
-	case MTD_NANDFLASH:
-		if (dev->offset)
-			if (lseek(dev->fd, dev->offset, SEEK_SET) < 0) {
-				ret = -EIO;
-				break;
-			}
-
-		count = dev->envsize;
-		start = dev->offset;
-		blocksize = dev->envsize;
-		sectors = dev->envsectors ? dev->envsectors : 1;
-
-		while (count > 0) {
-			skip = is_nand_badblock(dev, start);
-			if (skip < 0) {
-				return -EIO;
-			}
-
-			if (skip > 0) {
-				start += dev->sectorsize;
-				sectors--;
-				if (sectors > 0)
-					continue;
-				return  -EIO;
-			}
-
-			if (count > dev->sectorsize)
-				blocksize = dev->sectorsize;
-			else
-				blocksize = count;
-
-			if (lseek(dev->fd, start, SEEK_SET) < 0) {
-				return -EIO;
-			}
-			if (read(dev->fd, data, blocksize) != blocksize) {
-				return -EIO;
-			}
-			start += dev->sectorsize;
-			data += blocksize;
-			count -= blocksize;
-			ret += blocksize;
-		}
-		break;
-	}
+	ret = read(dev->fd, data, size);
 
 	return ret;
 }
 
-int libubootenv_ubiread(struct uboot_flash_env *dev, void *data)
+/*
+ * Erase and unlock the sectors, they stay unlocked
+ * until they are written
+ */
+static int mtderase(struct uboot_flash_env *dev, off_t start, size_t len)
 {
-	int ret = 0;
+	struct erase_info_user erase;
 
-	ret = read(dev->fd, data, dev->envsize);
+	erase.start = start;
+	erase.length = len;
 
-	return ret;
+	/*
+	 * unlock could fail, no check
+	 */
+	MTDUNLOCK(dev, &erase);
+	if (ioctl(dev->fd, MEMERASE, &erase) != 0)
+		return -EIO;
+
+	return 0;
 }
 
-int libubootenv_mtdwrite(struct uboot_flash_env *dev, void *data)
+static int mtdprogram(struct uboot_flash_env *dev, off_t start, const void *data, size_t len)
 {
-	int ret = 0;
 	struct erase_info_user erase;
-	size_t count;
-	size_t blocksize;
-	loff_t start;
-	void *buf;
-	int sectors, skip;
 
-	switch (dev->mtdinfo.type) {
-	case MTD_NORFLASH:
-	case MTD_NANDFLASH:
-		count = dev->envsize;
-		start = dev->offset;
-		blocksize = dev->envsize;
-		erase.length = dev->sectorsize;
-		sectors = dev->envsectors ? dev->envsectors : 1;
-		buf = data;
-		while (count > 0) {
-			erase.start = start;
-
-			skip = is_nand_badblock(dev, start);
-			if (skip < 0) {
-				ret = -EIO;
-				goto devwrite_out;
-			}
+	erase.start = start;
+	erase.length = dev->sectorsize;
 
-			if (skip > 0) {
-				start += dev->sectorsize;
-				sectors--;
-				if (sectors > 0)
-					continue;
-				ret = -EIO;
-				goto devwrite_out;
-			}
+	if (lseek(dev->fd, start, SEEK_SET) < 0)
+		return -EIO;
+	/*
+	 * a sector erased ahead can be locked again,
+	 * unlock could fail, no check
+	 */
+	MTDUNLOCK(dev, &erase);
+	if (write(dev->fd, data, len) != len)
+		return -EIO;
+	MTDLOCK(dev, &erase);
 
-			if (count > dev->sectorsize)
-				blocksize = dev->sectorsize;
-			else
-				blocksize = count;
-
-			/*
-			 * unlock could fail, no check
-			 */
-			MTDUNLOCK(dev, &erase);
-			if (ioctl(dev->fd, MEMERASE, &erase) != 0) {
-				ret =-EIO;
-				goto devwrite_out;
-			}
-			if (lseek(dev->fd, start, SEEK_SET) < 0) {
-				ret =-EIO;
-				goto devwrite_out;
-			}
-			if (write(dev->fd, buf, blocksize) != blocksize) {
-				ret =-EIO;
-				goto devwrite_out;
-			}
-			MTDLOCK(dev, &erase);
-			start += dev->sectorsize;
-			buf += blocksize;
-			count -= blocksize;
-			ret += blocksize;
-		}
-		break;
-	}
+	return 0;
+}
 
-devwrite_out:
-	return ret;
+static int mtdisbad(struct uboot_flash_env *dev, off_t start)
+{
+	loff_t ofs = start;
+
+	return ioctl(dev->fd, MEMGETBADBLOCK, &ofs);
 }
 
-int libubootenv_ubi_update_volume(struct uboot_flash_env *dev)
+static int ubi_update_volume(struct uboot_flash_env *dev)
 {
 	int64_t envsize = dev->envsize;
 	return ioctl(dev->fd, UBI_IOCVOLUP, &envsize);
 }
 
-int libubootenv_ubiwrite(struct uboot_flash_env *dev, void *data)
+static int ubiwrite(struct uboot_flash_env *dev, void *data)
 {
 	int ret;
 
-	if (libubootenv_ubi_update_volume(dev) < 0)
+	if (ubi_update_volume(dev) < 0)
 		return -1;
 
 	ret = write(dev->fd, data, dev->envsize);
@@ -463,25 +366,15 @@ int libubootenv_ubiwrite(struct uboot_flash_env *dev, void *data)
 	return ret;
 }
 
-int libubootenv_mtdgetinfo(int fd, struct uboot_flash_env *dev)
-{
-	return ioctl(fd, MEMGETINFO, &dev->mtdinfo);
-}
-
-int libubootenv_set_obsolete_flag(struct uboot_flash_env *dev)
+static int mtd_set_obsolete(struct uboot_flash_env *dev)
 {
 	uint8_t offsetflags = offsetof(struct uboot_env_redund, flags);
 	unsigned char flag = 0;
 	struct erase_info_user erase;
 	int ret = 0;
 
-	dev->fd = open(dev->devname, O_RDWR);
-	if (dev->fd < 0)
+	if (lseek(dev->fd, dev->offset + offsetflags, SEEK_SET) < 0)
 		return -EBADF;
-	if (lseek(dev->fd, dev->offset + offsetflags, SEEK_SET) < 0) {
-		close(dev->fd);
-		return -EBADF;
-	}
 	erase.start = dev->offset;
 	erase.length = dev->sectorsize;
 	MTDUNLOCK(dev, &erase);
@@ -491,8 +384,104 @@ int libubootenv_set_obsolete_flag(struct uboot_flash_env *dev)
 	else if (ret >= 0)
 		ret = -EIO;
 	MTDLOCK(dev, &erase);
-	close(dev->fd);
 
 	return ret;
 }
+
+static bool mtdmatch(const char *devname)
+{
+	return !strncmp(devname, DEVICE_MTD_NAME, strlen(DEVICE_MTD_NAME)) &&
+		!strchr(devname, DEVNAME_SEPARATOR);
+}
+
+static int mtdprobe(struct uboot_flash_env *dev)
+{
+	struct stat st;
+	int fd, ret;
+
+	dev->device_type = DEVICE_MTD;
+
+	fd = open(dev->devname, O_RDONLY);
+	if (fd < 0)
+		return -EBADF;
+
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -EBADF;
+	}
+
+	if (S_ISCHR(st.st_mode)) {
+		ret = ioctl(fd, MEMGETINFO, &dev->mtdinfo);
+		if (ret < 0 || (dev->mtdinfo.type != MTD_NORFLASH &&
+				dev->mtdinfo.type != MTD_NANDFLASH)) {
+			close(fd);
+			return -EBADF;
+		}
+		if (dev->sectorsize == 0) {
+			dev->sectorsize = dev->mtdinfo.erasesize;
+		}
+	}
+
+	switch (dev->mtdinfo.type) {
+	case MTD_NORFLASH:
+		dev->flagstype = FLAGS_BOOLEAN;
+		break;
+	case MTD_NANDFLASH:
+		dev->flagstype = FLAGS_INCREMENTAL;
+	};
+
+	ret = resolve_env_offset(dev, fd);
+	close(fd);
+
+	return ret;
+}
+
+static bool ubimatch(const char *devname)
+{
+	if (!strncmp(devname, DEVICE_MTD_NAME, strlen(DEVICE_MTD_NAME)))
+		return strchr(devname, DEVNAME_SEPARATOR) != NULL;
+
+	return !strncmp(devname, DEVICE_UBI_NAME, strlen(DEVICE_UBI_NAME));
+}
+
+static int ubiprobe(struct uboot_flash_env *dev)
+{
+	int fd, ret;
+
+	dev->device_type = DEVICE_UBI;
+
+	ret = ubi_update_name(dev);
+	if (ret)
+		return ret;
+
+	fd = open(dev->devname, O_RDONLY);
+	if (fd < 0)
+		return -EBADF;
+
+	dev->flagstype = FLAGS_INCREMENTAL;
+	ret = resolve_env_offset(dev, fd);
+	close(fd);
+
+	return ret;
+}
+
+const struct uboot_backend_ops libubootenv_mtd_ops = {
+	.name = "mtd",
+	.match = mtdmatch,
+	.probe = mtdprobe,
+	.read = flash_read,
+	.write = flash_write,
+	.erase = mtderase,
+	.program = mtdprogram,
+	.isbad = mtdisbad,
+	.set_obsolete = mtd_set_obsolete,
+};
+
+const struct uboot_backend_ops libubootenv_ubi_ops = {
+	.name = "ubi",
+	.match = ubimatch,
+	.probe = ubiprobe,
+	.read = ubiread,
+	.write = ubiwrite,
+};
 #endif
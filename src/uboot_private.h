@@ -9,6 +9,7 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <pthread.h>
 #include <sys/queue.h>
 #include <sys/types.h>
 #include "libuboot.h"
@@ -23,6 +24,9 @@
 #define SYS_UBI_VOLUME_COUNT		"/sys/class/ubi/ubi%d/volumes_count"
 #define SYS_UBI_VOLUME_NAME		"/sys/class/ubi/ubi%d/ubi%d_%d/name"
 
+/* appended to the lockfile name, written at each store */
+#define STAMPFILE_SUFFIX		".stamp"
+
 #if !defined(__FreeBSD__)
 #include <mtd/mtd-user.h>
 #include <mtd/ubi-user.h>
@@ -112,6 +116,45 @@ struct uboot_env_redund {
 	char data[];
 };
 
+struct uboot_flash_env;
+
+/**
+ * Operations of a storage backend (internal, see
+ * libubootenv_register_backend()). The library calls open before
+ * read, write, sync or set_obsolete and close afterwards; the backend
+ * keeps what it needs in the device (usually fd). read and write
+ * return the number of bytes moved or a negative value, the other
+ * operations 0 or a negative value. Optional operations are NULL.
+ */
+struct uboot_backend_ops {
+	/** name of the backend, for diagnostics */
+	const char *name;
+	/** devname is not a path, it is passed to match() as it is */
+	bool virtual_device;
+	/** true if the backend handles devname */
+	bool (*match)(const char *devname);
+	/** check the device and fill flagstype, sectorsize, ... */
+	int (*probe)(struct uboot_flash_env *dev);
+	/** optional, default is open(2) on devname */
+	int (*open)(struct uboot_flash_env *dev, int flags);
+	/** optional, default is close(2) */
+	void (*close)(struct uboot_flash_env *dev);
+	/** read the first size bytes of the copy */
+	int (*read)(struct uboot_flash_env *dev, void *data, size_t size);
+	/** write the whole copy (envsize bytes) */
+	int (*write)(struct uboot_flash_env *dev, void *data);
+	/** optional, erase len bytes at start (raw flash) */
+	int (*erase)(struct uboot_flash_env *dev, off_t start, size_t len);
+	/** optional, program len bytes at start into erased flash (raw flash) */
+	int (*program)(struct uboot_flash_env *dev, off_t start, const void *data, size_t len);
+	/** optional, > 0 if the block at start is bad (raw flash) */
+	int (*isbad)(struct uboot_flash_env *dev, off_t start);
+	/** optional, make the written data persistent */
+	int (*sync)(struct uboot_flash_env *dev);
+	/** optional, mark the copy as obsolete (FLAGS_BOOLEAN) */
+	int (*set_obsolete)(struct uboot_flash_env *dev);
+};
+
 struct uboot_flash_env {
 	/** path to device or file where env is stored */
 	char 			devname[DEVNAME_MAX_LENGTH];
@@ -127,6 +170,8 @@ struct uboot_flash_env {
 	struct mtd_info_user	mtdinfo;
 	/** Computed CRC on the stored environment */
 	uint32_t		crc;
+	/** CRC as found in the header of the stored environment */
+	uint32_t		storedcrc;
 	/** file descriptor used to access the device */
 	int  			fd;
 	/** flags (see flags_type) are one byte in the stored environment */
@@ -135,8 +180,21 @@ struct uboot_flash_env {
 	enum flags_type		flagstype;
 	/** type of device (mtd, ubi, file, ....) */
 	enum device_type	device_type;
+	/** backend handling the device, set by probing */
+	const struct uboot_backend_ops *ops;
+	/** backend data between open and close */
+	void			*priv;
+	/** operations on raw flash since the context was created */
+	struct libuboot_flash_counters counters;
+	/** phases measured on the device itself (erase, program) */
+	struct libuboot_stats	stats;
 	/** Disable lock mechanism (required by some flashes */
 	int disable_mtd_lock;
+	/** the copy read as erased flash, it is not valid */
+	bool			blank;
+	/** known erased under the current lock, the next write just programs
+	 *  it: found blank on NOR, erased by this context on NAND */
+	bool			erased;
 };
 
 /** Internal structure for an environment variable
@@ -156,6 +214,28 @@ struct var_entry {
 
 LIST_HEAD(vars, var_entry);
 
+/** Store in progress, see libuboot_env_store_async()
+ */
+struct store_job {
+	/** worker writing the image */
+	pthread_t thread;
+	struct uboot_ctx *ctx;
+	/** serialized environment, flags and CRC included */
+	void *image;
+	/** copy being written */
+	int copy;
+	unsigned char flags;
+	uint32_t crc;
+	/** start of the store for the statistics */
+	uint64_t start;
+	libuboot_store_cb cb;
+	void *priv;
+	/** result of the store, set by the worker */
+	int result;
+	/** set by the worker once the copy is written, the job can be joined */
+	bool done;
+};
+
 /** libubootenv context
  */
 struct uboot_ctx {
@@ -179,28 +259,54 @@ struct uboot_ctx {
 	char *name;
 	/** lockfile */
 	char *lockfile;
+	/** erase the obsolete copy in the background after a store */
+	bool erase_ahead;
+	/** byte filling the copy after the end of the environment */
+	unsigned char padding;
+	/** how the copies are read, see libuboot_set_read_mode() */
+	enum libuboot_read_mode read_mode;
+	/** inotify descriptor watching the stamp file */
+	int watchfd;
 	/** Number of namespaces */
 	int nelem;
 	/** private pointer to list */
 	struct uboot_ctx *ctxlist;
+	/** timings and counters, see libuboot_get_stats() */
+	struct libuboot_stats stats;
+	/** store running on a worker thread */
+	struct store_job *job;
+	/** result of the last asynchronous store */
+	int asyncresult;
+	/** eventfd signalled when an asynchronous store completes */
+	int storefd;
+	/** deferred stores, see libuboot_set_store_delay() */
+	unsigned int debounce_ms;
+	unsigned int maxdelay_ms;
+	/** a deferred store is pending */
+	bool dirty;
+	/** first pending change and time of the store, in ms */
+	uint64_t first_change;
+	uint64_t deadline;
+	/** data of the last copy loaded or serialized, and its CRC */
+	uint8_t *lastdata;
+	size_t lastlen;
+	uint32_t lastcrc;
 };
 
-#if defined(__FreeBSD__)
-#define libubootenv_mtdgetinfo(fd,dev) (-1)
-#define libubootenv_mtdread(dev,data) (-1)
-#define libubootenv_mtdwrite(dev,data) (-1)
-#define libubootenv_ubiread(dev,data) (-1)
-#define libubootenv_ubiwrite(dev,data) (-1)
-#define libubootenv_ubi_update_name(dev) (-1)
-#define libubootenv_set_obsolete_flag(dev) (-1)
-#else
-int libubootenv_mtdgetinfo(int fd, struct uboot_flash_env *dev);
-int libubootenv_mtdread(struct uboot_flash_env *dev, void *data);
-int libubootenv_mtdwrite(struct uboot_flash_env *dev, void *data);
-int libubootenv_ubi_update_name(struct uboot_flash_env *dev);
-int libubootenv_ubiread(struct uboot_flash_env *dev, void *data);
-int libubootenv_ubiwrite(struct uboot_flash_env *dev, void *data);
-int libubootenv_set_obsolete_flag(struct uboot_flash_env *dev);
+extern const struct uboot_backend_ops libubootenv_file_ops;
+extern const struct uboot_backend_ops libubootenv_sim_ops;
+#if !defined(__FreeBSD__)
+extern const struct uboot_backend_ops libubootenv_mtd_ops;
+extern const struct uboot_backend_ops libubootenv_ubi_ops;
 #endif
 
-
+/*
+ * Backends registered at runtime are tried before the built-in
+ * ones, so they can claim devices the built-in ones would take.
+ * The backend interface is internal to the library and its tools:
+ * it is not in the installed headers and struct uboot_flash_env
+ * changes between releases, so there is no stable ABI for
+ * backends built outside the tree.
+ */
+int libubootenv_register_backend(const struct uboot_backend_ops *ops);
+const struct uboot_backend_ops *libubootenv_find_backend(const char *devname);
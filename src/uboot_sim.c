@@ -0,0 +1,366 @@
+/*
+ * (C) Copyright 2026
+ * Stefano Babic, <stefano.babic@swupdate.org>
+ *
+ * SPDX-License-Identifier:     LGPL-2.1-or-later
+ */
+
+/**
+ * @file uboot_sim.c
+ *
+ * @brief Simulated NOR and NAND flash
+ *
+ * The flash is kept in a file (use tmpfs to keep it in memory)
+ * and it behaves as raw flash: erasing sets the block to 0xFF,
+ * programming can only clear bits, reads and writes skip bad
+ * blocks on NAND and each operation can take a configured time.
+ * The device name is
+ *
+ *	sim:<nor|nand>[,option=value...]:<file>
+ *
+ * with the options
+ *
+ *	erasesize=<bytes>	erase block (default 64 KiB on NOR, 128 KiB on NAND)
+ *	pagesize=<bytes>	program unit (default 1 on NOR, 2048 on NAND)
+ *	bad=<block>[/<block>...]	bad blocks on NAND, from the start of the file
+ *	read_us=<us>		time for each read of a copy
+ *	erase_us=<us>		time for each erased block
+ *	program_us=<us>		time for each programmed page
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "uboot_private.h"
+#include "common.h"
+
+#define SIM_PREFIX		"sim:"
+#define SIM_MAX_BADBLOCKS	16
+
+struct sim_flash {
+	uint8_t type;
+	size_t erasesize;
+	size_t pagesize;
+	unsigned long bad[SIM_MAX_BADBLOCKS];
+	unsigned int nbad;
+	unsigned long read_us;
+	unsigned long erase_us;
+	unsigned long program_us;
+	const char *path;
+};
+
+static int sim_parse(const char *devname, struct sim_flash *sim)
+{
+	const char *p = devname + strlen(SIM_PREFIX);
+	const char *path;
+	char opts[DEVNAME_MAX_LENGTH], *opt, *saveptr, *val, *blk, *blkptr;
+	unsigned long v;
+	char *end;
+
+	path = strchr(p, DEVNAME_SEPARATOR);
+	if (!path || !path[1] || path - p >= sizeof(opts))
+		return -EINVAL;
+	memcpy(opts, p, path - p);
+	opts[path - p] = '\0';
+
+	memset(sim, 0, sizeof(*sim));
+	sim->path = path + 1;
+
+	opt = strtok_r(opts, ",", &saveptr);
+	if (!opt)
+		return -EINVAL;
+	if (!strcmp(opt, "nor")) {
+		sim->type = MTD_NORFLASH;
+		sim->erasesize = 0x10000;
+		sim->pagesize = 1;
+	} else if (!strcmp(opt, "nand")) {
+		sim->type = MTD_NANDFLASH;
+		sim->erasesize = 0x20000;
+		sim->pagesize = 2048;
+	} else {
+		return -EINVAL;
+	}
+
+	while ((opt = strtok_r(NULL, ",", &saveptr)) != NULL) {
+		val = strchr(opt, '=');
+		if (!val)
+			return -EINVAL;
+		*val++ = '\0';
+		if (!strcmp(opt, "bad")) {
+			for (blk = strtok_r(val, "/", &blkptr); blk;
+			     blk = strtok_r(NULL, "/", &blkptr)) {
+				if (sim->nbad == SIM_MAX_BADBLOCKS)
+					return -EINVAL;
+				sim->bad[sim->nbad] = strtoul(blk, &end, 0);
+				if (*end)
+					return -EINVAL;
+				sim->nbad++;
+			}
+			continue;
+		}
+		v = strtoul(val, &end, 0);
+		if (*end || end == val)
+			return -EINVAL;
+		if (!strcmp(opt, "erasesize"))
+			sim->erasesize = v;
+		else if (!strcmp(opt, "pagesize"))
+			sim->pagesize = v;
+		else if (!strcmp(opt, "read_us"))
+			sim->read_us = v;
+		else if (!strcmp(opt, "erase_us"))
+			sim->erase_us = v;
+		else if (!strcmp(opt, "program_us"))
+			sim->program_us = v;
+		else
+			return -EINVAL;
+	}
+
+	if (!sim->erasesize || !sim->pagesize || sim->erasesize % sim->pagesize)
+		return -EINVAL;
+
+	return 0;
+}
+
+static void sim_delay(unsigned long us)
+{
+	struct timespec ts;
+
+	if (!us)
+		return;
+
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000;
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+static int sim_fill(int fd, off_t pos, off_t end)
+{
+	char blank[4096];
+	size_t len;
+
+	memset(blank, 0xff, sizeof(blank));
+	for (; pos < end; pos += len) {
+		len = end - pos < sizeof(blank) ? end - pos : sizeof(blank);
+		if (pwrite(fd, blank, len, pos) != len)
+			return -EIO;
+	}
+
+	return 0;
+}
+
+/*
+ * Blocks beyond the end of the file were never written,
+ * they are added in the erased state
+ */
+static int sim_extend(int fd, off_t end)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) < 0)
+		return -EIO;
+
+	return sim_fill(fd, st.st_size, end);
+}
+
+static bool sim_match(const char *devname)
+{
+	return !strncmp(devname, SIM_PREFIX, strlen(SIM_PREFIX));
+}
+
+static int sim_open(struct uboot_flash_env *dev, int flags)
+{
+	struct sim_flash *sim;
+	unsigned long blocks;
+	int ret = 0;
+
+	sim = malloc(sizeof(*sim));
+	if (!sim)
+		return -ENOMEM;
+
+	ret = sim_parse(dev->devname, sim);
+	if (ret) {
+		free(sim);
+		return ret;
+	}
+
+	/* a read-only context never changes the image */
+	if ((flags & O_ACCMODE) == O_RDONLY)
+		dev->fd = open(sim->path, O_RDONLY | O_CLOEXEC);
+	else
+		dev->fd = open(sim->path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (dev->fd < 0) {
+		free(sim);
+		return -EBADF;
+	}
+
+	/* the blocks of the copy, bad ones included */
+	blocks = dev->envsectors ? dev->envsectors :
+		(dev->envsize + sim->erasesize - 1) / sim->erasesize;
+	if ((flags & O_ACCMODE) != O_RDONLY)
+		ret = sim_extend(dev->fd, dev->offset + blocks * sim->erasesize);
+	if (ret) {
+		close(dev->fd);
+		free(sim);
+		return ret;
+	}
+
+	dev->priv = sim;
+
+	return 0;
+}
+
+static void sim_close(struct uboot_flash_env *dev)
+{
+	close(dev->fd);
+	free(dev->priv);
+	dev->priv = NULL;
+}
+
+static int sim_probe(struct uboot_flash_env *dev)
+{
+	struct sim_flash *sim;
+	int ret;
+
+	if (dev->offset < 0)
+		return -EINVAL;
+
+	/* the image stands for the device, it is created with the copy erased */
+	ret = sim_open(dev, O_RDWR);
+	if (ret)
+		return ret;
+	sim = dev->priv;
+
+	dev->device_type = DEVICE_MTD;
+	memset(&dev->mtdinfo, 0, sizeof(dev->mtdinfo));
+	dev->mtdinfo.type = sim->type;
+	dev->mtdinfo.erasesize = sim->erasesize;
+	dev->mtdinfo.writesize = sim->pagesize;
+	if (dev->sectorsize == 0)
+		dev->sectorsize = sim->erasesize;
+	dev->flagstype = sim->type == MTD_NORFLASH ? FLAGS_BOOLEAN : FLAGS_INCREMENTAL;
+
+	/* sectors are erased as a whole */
+	if (dev->sectorsize % sim->erasesize)
+		ret = -EINVAL;
+
+	sim_close(dev);
+
+	return ret;
+}
+
+static int sim_read(struct uboot_flash_env *dev, void *data, size_t size)
+{
+	struct sim_flash *sim = dev->priv;
+
+	sim_delay(sim->read_us);
+
+	return flash_read(dev, data, size);
+}
+
+static bool sim_isbad_block(struct sim_flash *sim, off_t start)
+{
+	unsigned long block = start / sim->erasesize;
+	unsigned int i;
+
+	/* NOR has no bad blocks */
+	if (sim->type != MTD_NANDFLASH)
+		return false;
+
+	for (i = 0; i < sim->nbad; i++)
+		if (sim->bad[i] == block)
+			return true;
+
+	return false;
+}
+
+static int sim_isbad(struct uboot_flash_env *dev, off_t start)
+{
+	return sim_isbad_block(dev->priv, start) ? 1 : 0;
+}
+
+static int sim_erase(struct uboot_flash_env *dev, off_t start, size_t len)
+{
+	struct sim_flash *sim = dev->priv;
+	off_t end;
+	int ret;
+
+	if (start % sim->erasesize)
+		return -EINVAL;
+
+	end = start + ((len + sim->erasesize - 1) / sim->erasesize) * sim->erasesize;
+	for (; start < end; start += sim->erasesize) {
+		if (sim_isbad_block(sim, start))
+			return -EIO;
+		ret = sim_fill(dev->fd, start, start + sim->erasesize);
+		if (ret)
+			return ret;
+		sim_delay(sim->erase_us);
+	}
+
+	return 0;
+}
+
+/*
+ * As on real flash, programming can only clear bits: a byte
+ * not erased before ends up with the AND of old and new data
+ */
+static int sim_program(struct uboot_flash_env *dev, off_t start, const void *data, size_t len)
+{
+	struct sim_flash *sim = dev->priv;
+	const uint8_t *src = data;
+	uint8_t buf[4096];
+	size_t chunk, i, pages;
+	off_t pos;
+
+	if (sim_isbad_block(sim, start))
+		return -EIO;
+
+	for (pos = 0; pos < len; pos += chunk) {
+		chunk = len - pos < sizeof(buf) ? len - pos : sizeof(buf);
+		if (pread(dev->fd, buf, chunk, start + pos) != chunk)
+			return -EIO;
+		for (i = 0; i < chunk; i++)
+			buf[i] &= src[pos + i];
+		if (pwrite(dev->fd, buf, chunk, start + pos) != chunk)
+			return -EIO;
+	}
+
+	pages = (start % sim->pagesize + len + sim->pagesize - 1) / sim->pagesize;
+	sim_delay(sim->program_us * pages);
+
+	return 0;
+}
+
+static int sim_set_obsolete(struct uboot_flash_env *dev)
+{
+	uint8_t offsetflags = offsetof(struct uboot_env_redund, flags);
+	unsigned char flag = 0;
+
+	return sim_program(dev, dev->offset + offsetflags, &flag, sizeof(flag));
+}
+
+const struct uboot_backend_ops libubootenv_sim_ops = {
+	.name = "sim",
+	.virtual_device = true,
+	.match = sim_match,
+	.probe = sim_probe,
+	.open = sim_open,
+	.close = sim_close,
+	.read = sim_read,
+	.write = flash_write,
+	.erase = sim_erase,
+	.program = sim_program,
+	.isbad = sim_isbad,
+	.set_obsolete = sim_set_obsolete,
+};
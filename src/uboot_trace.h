@@ -0,0 +1,34 @@
+/*
+ * (C) Copyright 2026
+ * Stefano Babic, <stefano.babic@swupdate.org>
+ *
+ * SPDX-License-Identifier:     LGPL-2.1-or-later
+ */
+
+/**
+ * @file uboot_trace.h
+ *
+ * @brief Static tracepoints (USDT)
+ *
+ * With ENABLE_USDT the probes are emitted with <sys/sdt.h> under
+ * the provider "libubootenv" and cost a nop until a tracer attaches
+ * to them. Otherwise they compile to nothing.
+ */
+
+#pragma once
+
+#if defined(ENABLE_USDT)
+#include <sys/sdt.h>
+
+#define TRACE0(name)			DTRACE_PROBE(libubootenv, name)
+#define TRACE1(name, a)			DTRACE_PROBE1(libubootenv, name, a)
+#define TRACE2(name, a, b)		DTRACE_PROBE2(libubootenv, name, a, b)
+#define TRACE3(name, a, b, c)		DTRACE_PROBE3(libubootenv, name, a, b, c)
+#define TRACE4(name, a, b, c, d)	DTRACE_PROBE4(libubootenv, name, a, b, c, d)
+#else
+#define TRACE0(name)			do { } while (0)
+#define TRACE1(name, a)			do { } while (0)
+#define TRACE2(name, a, b)		do { } while (0)
+#define TRACE3(name, a, b, c)		do { } while (0)
+#define TRACE4(name, a, b, c, d)	do { } while (0)
+#endif
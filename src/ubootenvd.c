@@ -0,0 +1,693 @@
+/*
+ * (C) Copyright 2026
+ * Stefano Babic, <stefano.babic@swupdate.org>
+ *
+ * SPDX-License-Identifier:     LGPL-2.1-or-later
+ */
+
+/**
+ * @file ubootenvd.c
+ *
+ * @brief Resident daemon serving the environment over a Unix socket
+ *
+ * Each namespace is loaded once and kept in memory. The lock is
+ * released after loading and taken again only to store, so that
+ * the daemon does not block other users of the library. Stores
+ * done by them are noticed with libuboot_watch() and reloaded.
+ * Writes are coalesced: a store happens when no change was requested
+ * for the debounce time, but not later than the maximum delay after
+ * the first pending change, or when a client asks for it. The
+ * pending changes are kept apart and applied again on top of what
+ * is on the storage, after each reload and under the lock before
+ * storing, so that changes stored meanwhile by others are not lost.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "libuboot.h"
+#include "ubootenvd.h"
+
+#ifndef DEFAULT_CFG_FILE
+#define DEFAULT_CFG_FILE "/etc/fw_env.config"
+#endif
+
+#ifndef DEFAULT_ENV_FILE
+#define DEFAULT_ENV_FILE "/etc/u-boot-initial-env"
+#endif
+
+#define MAX_CLIENTS		64
+#define RX_BUFFER_SIZE		4096
+/* a request is one line, a client sending a longer one is dropped */
+#define MAX_REQUEST_SIZE	(256 * 1024)
+#define DEFAULT_DEBOUNCE_MS	1000
+#define DEFAULT_MAXDELAY_MS	10000
+
+/*
+ * A change not yet stored, value is NULL to delete
+ */
+struct pending {
+	char *name;
+	char *value;
+};
+
+struct namespace {
+	/** context inside the list read from configuration */
+	struct uboot_ctx *ctx;
+	/** signals stores done by other processes */
+	int watchfd;
+	/** changes not yet stored */
+	bool dirty;
+	struct pending *pending;
+	unsigned int npending;
+	/** default environment was loaded, store it with the next change */
+	bool default_used;
+	/** time of the first pending change */
+	uint64_t first_change;
+	/** time the store is due */
+	uint64_t deadline;
+	/** stored, the obsolete copy can be erased when idle */
+	bool erase_pending;
+};
+
+/*
+ * The socket is non-blocking: the answers are queued in out and sent
+ * when the client can take them, no request is read from the client
+ * meanwhile
+ */
+struct client {
+	int fd;
+	char *buf;
+	size_t len;
+	size_t size;
+	char *out;
+	size_t outlen;
+	size_t outoff;
+};
+
+static struct uboot_ctx *ctxlist;
+static struct namespace *namespaces;
+static unsigned int nnamespaces;
+static struct client clients[MAX_CLIENTS];
+static const char *defenvfile = DEFAULT_ENV_FILE;
+static uint64_t debounce_ms = DEFAULT_DEBOUNCE_MS;
+static uint64_t maxdelay_ms = DEFAULT_MAXDELAY_MS;
+static volatile sig_atomic_t quit;
+
+static struct option long_options[] = {
+	{"help", no_argument, NULL, 'h'},
+	{"config", required_argument, NULL, 'c'},
+	{"defenv", required_argument, NULL, 'f'},
+	{"socket", required_argument, NULL, 'S'},
+	{"debounce", required_argument, NULL, 'd'},
+	{"max-delay", required_argument, NULL, 'D'},
+	{NULL, 0, NULL, 0}
+};
+
+static void usage(char *program)
+{
+	fprintf(stdout, "Usage %s [OPTION]\n", program);
+	fprintf(stdout,
+		" -h, --help                       : print this help\n"
+		" -c, --config <filename>          : configuration file (by default: " DEFAULT_CFG_FILE ")\n"
+		" -f, --defenv <filename>          : default environment if no one found (by default: " DEFAULT_ENV_FILE ")\n"
+		" -S, --socket <path>              : listening socket (by default: " DEFAULT_SOCKET_PATH ")\n"
+		" -d, --debounce <ms>              : store after no change for <ms> (default: %d)\n"
+		" -D, --max-delay <ms>             : store at latest <ms> after first change (default: %d)\n",
+		DEFAULT_DEBOUNCE_MS, DEFAULT_MAXDELAY_MS
+	);
+}
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void sighandler(int signo)
+{
+	(void)signo;
+	quit = 1;
+}
+
+static struct namespace *get_namespace(const char *name, int *err)
+{
+	struct uboot_ctx *ctx;
+	struct namespace *ns, *tmp;
+	unsigned int i;
+	int ret;
+
+	if (!strcmp(name, UBOOTENVD_DEFAULT_NS))
+		ctx = ctxlist;
+	else
+		ctx = libuboot_get_namespace(ctxlist, name);
+	if (!ctx) {
+		*err = -ENOENT;
+		return NULL;
+	}
+
+	for (i = 0; i < nnamespaces; i++)
+		if (namespaces[i].ctx == ctx)
+			return &namespaces[i];
+
+	/*
+	 * First access: load it and keep it
+	 */
+	tmp = realloc(namespaces, (nnamespaces + 1) * sizeof(*namespaces));
+	if (!tmp) {
+		*err = -ENOMEM;
+		return NULL;
+	}
+	namespaces = tmp;
+	ns = &namespaces[nnamespaces];
+	memset(ns, 0, sizeof(*ns));
+	ns->ctx = ctx;
+
+	if ((ret = libuboot_open(ctx)) < 0) {
+		fprintf(stderr, "Cannot read environment %s, using default\n", name);
+		if ((ret = libuboot_load_file(ctx, defenvfile)) < 0) {
+			fprintf(stderr, "Cannot read default environment from file\n");
+			libuboot_close(ctx);
+			*err = ret;
+			return NULL;
+		}
+		ns->default_used = true;
+	}
+	libuboot_unlock(ctx);
+	ns->watchfd = libuboot_watch(ctx);
+	nnamespaces++;
+
+	return ns;
+}
+
+static void drop_pending(struct namespace *ns)
+{
+	unsigned int i;
+
+	for (i = 0; i < ns->npending; i++) {
+		free(ns->pending[i].name);
+		free(ns->pending[i].value);
+	}
+	free(ns->pending);
+	ns->pending = NULL;
+	ns->npending = 0;
+}
+
+static int add_pending(struct namespace *ns, const char *name, const char *value)
+{
+	struct pending *p, *tmp;
+	char *v = NULL;
+	unsigned int i;
+
+	if (value && !(v = strdup(value)))
+		return -ENOMEM;
+
+	for (i = 0; i < ns->npending; i++) {
+		p = &ns->pending[i];
+		if (!strcmp(p->name, name)) {
+			free(p->value);
+			p->value = v;
+			return 0;
+		}
+	}
+
+	tmp = realloc(ns->pending, (ns->npending + 1) * sizeof(*tmp));
+	if (!tmp) {
+		free(v);
+		return -ENOMEM;
+	}
+	ns->pending = tmp;
+	p = &ns->pending[ns->npending];
+	p->name = strdup(name);
+	if (!p->name) {
+		free(v);
+		return -ENOMEM;
+	}
+	p->value = v;
+	ns->npending++;
+
+	return 0;
+}
+
+/*
+ * Pick up what was stored by others and apply the pending changes
+ * on top of it. A change that cannot be applied anymore (the
+ * variable became read-only) is reported in conflict and is
+ * dropped with the next store.
+ */
+static int reload_namespace(struct namespace *ns, int *conflict)
+{
+	struct pending *p;
+	unsigned int i;
+	int ret;
+
+	ret = libuboot_refresh(ns->ctx);
+	if (ret < 0 && ret != -ENODATA)
+		return ret;
+	/* a valid environment on the storage replaces the default one */
+	if (ret >= 0)
+		ns->default_used = false;
+
+	for (i = 0; i < ns->npending; i++) {
+		p = &ns->pending[i];
+		ret = libuboot_set_env(ns->ctx, p->name, p->value);
+		if (ret) {
+			fprintf(stderr, "Cannot apply %s after reload: %d\n",
+				p->name, ret);
+			if (conflict && !*conflict)
+				*conflict = ret;
+		}
+	}
+
+	return 0;
+}
+
+static int flush_namespace(struct namespace *ns)
+{
+	int ret, conflict = 0;
+
+	if (!ns->dirty && !ns->default_used)
+		return 0;
+
+	/*
+	 * The storage may have changed since it was loaded,
+	 * store the pending changes on top of its content
+	 */
+	ret = libuboot_lock(ns->ctx);
+	if (!ret)
+		ret = reload_namespace(ns, &conflict);
+	if (!ret && (ns->npending || ns->default_used))
+		ret = libuboot_env_store(ns->ctx);
+	libuboot_unlock(ns->ctx);
+
+	if (ret) {
+		fprintf(stderr, "Error storing the env: %d\n", ret);
+		/* retry later */
+		ns->deadline = now_ms() + debounce_ms;
+		return ret;
+	}
+
+	drop_pending(ns);
+	ns->dirty = false;
+	ns->default_used = false;
+	ns->erase_pending = true;
+
+	/* changes that could not be applied conflict with another writer */
+	return conflict;
+}
+
+static void mark_dirty(struct namespace *ns)
+{
+	uint64_t now = now_ms();
+
+	if (!ns->dirty) {
+		ns->dirty = true;
+		ns->first_change = now;
+	}
+	ns->deadline = now + debounce_ms;
+	if (ns->deadline > ns->first_change + maxdelay_ms)
+		ns->deadline = ns->first_change + maxdelay_ms;
+}
+
+static int set_var(struct namespace *ns, const char *name, const char *value)
+{
+	char *old;
+	bool changed;
+	int ret;
+
+	old = libuboot_get_env(ns->ctx, name);
+	if (value)
+		changed = !old || strcmp(old, value);
+	else
+		changed = old != NULL;
+	free(old);
+
+	if (!changed)
+		return 0;
+
+	ret = libuboot_set_env(ns->ctx, name, value);
+	if (!ret)
+		ret = add_pending(ns, name, value);
+	if (!ret)
+		mark_dirty(ns);
+
+	return ret;
+}
+
+static void handle_request(FILE *tx, char *line)
+{
+	struct namespace *ns;
+	char *cmd, *nsname, *name;
+	char *value;
+	void *tmp;
+	unsigned int items;
+	int ret = 0;
+
+	cmd = strsep(&line, " ");
+	nsname = strsep(&line, " ");
+	if (!nsname || !*nsname) {
+		ubootenvd_put_header(tx, -EINVAL, 0);
+		return;
+	}
+
+	ns = get_namespace(nsname, &ret);
+	if (!ns) {
+		ubootenvd_put_header(tx, ret, 0);
+		return;
+	}
+
+	if (!strcmp(cmd, "list")) {
+		items = 0;
+		tmp = NULL;
+		while ((tmp = libuboot_iterator(ns->ctx, tmp)) != NULL)
+			items++;
+		ubootenvd_put_header(tx, 0, items);
+		tmp = NULL;
+		while ((tmp = libuboot_iterator(ns->ctx, tmp)) != NULL)
+			ubootenvd_put_pair(tx, libuboot_getname(tmp),
+					   libuboot_getvalue(tmp));
+		return;
+	}
+
+	if (!strcmp(cmd, "store")) {
+		ubootenvd_put_header(tx, flush_namespace(ns), 0);
+		return;
+	}
+
+	name = strsep(&line, " ");
+	if (!name || !*name) {
+		ubootenvd_put_header(tx, -EINVAL, 0);
+		return;
+	}
+
+	if (!strcmp(cmd, "get")) {
+		value = libuboot_get_env(ns->ctx, name);
+		if (!value) {
+			ubootenvd_put_header(tx, -ENOENT, 0);
+			return;
+		}
+		ubootenvd_put_header(tx, 0, 1);
+		ubootenvd_put_item(tx, value, strlen(value));
+		free(value);
+	} else if (!strcmp(cmd, "set")) {
+		ret = set_var(ns, name, line ? line : "");
+		ubootenvd_put_header(tx, ret, 0);
+	} else if (!strcmp(cmd, "del")) {
+		ret = set_var(ns, name, NULL);
+		ubootenvd_put_header(tx, ret, 0);
+	} else {
+		ubootenvd_put_header(tx, -EINVAL, 0);
+	}
+}
+
+static void drop_client(struct client *cl)
+{
+	close(cl->fd);
+	free(cl->buf);
+	free(cl->out);
+	memset(cl, 0, sizeof(*cl));
+	cl->fd = -1;
+}
+
+static void write_client(struct client *cl)
+{
+	ssize_t n;
+
+	while (cl->outoff < cl->outlen) {
+		n = send(cl->fd, cl->out + cl->outoff, cl->outlen - cl->outoff,
+			 MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			/* the rest goes when poll() reports POLLOUT */
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				drop_client(cl);
+			return;
+		}
+		cl->outoff += n;
+	}
+
+	free(cl->out);
+	cl->out = NULL;
+	cl->outlen = 0;
+	cl->outoff = 0;
+}
+
+static void read_client(struct client *cl)
+{
+	char *start, *eol;
+	FILE *tx;
+	ssize_t n;
+
+	if (cl->size - cl->len < RX_BUFFER_SIZE) {
+		char *tmp;
+
+		if (cl->size >= MAX_REQUEST_SIZE) {
+			fprintf(stderr, "Request too long, dropping the client\n");
+			drop_client(cl);
+			return;
+		}
+		tmp = realloc(cl->buf, cl->size + RX_BUFFER_SIZE);
+		if (!tmp) {
+			drop_client(cl);
+			return;
+		}
+		cl->buf = tmp;
+		cl->size += RX_BUFFER_SIZE;
+	}
+
+	n = read(cl->fd, cl->buf + cl->len, cl->size - cl->len);
+	if (n <= 0) {
+		if (n < 0 && (errno == EINTR || errno == EAGAIN))
+			return;
+		drop_client(cl);
+		return;
+	}
+	cl->len += n;
+
+	/* nothing is queued, a client is not read while answers are pending */
+	tx = open_memstream(&cl->out, &cl->outlen);
+	if (!tx) {
+		drop_client(cl);
+		return;
+	}
+
+	start = cl->buf;
+	while ((eol = memchr(start, '\n', cl->len - (start - cl->buf))) != NULL) {
+		*eol = '\0';
+		handle_request(tx, start);
+		start = eol + 1;
+	}
+	cl->len -= start - cl->buf;
+	memmove(cl->buf, start, cl->len);
+
+	if (fclose(tx) == EOF) {
+		drop_client(cl);
+		return;
+	}
+	write_client(cl);
+}
+
+static void accept_client(int sock)
+{
+	int fd, i;
+
+	fd = accept4(sock, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (fd < 0)
+		return;
+
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		if (clients[i].fd < 0)
+			break;
+	}
+	if (i == MAX_CLIENTS) {
+		close(fd);
+		return;
+	}
+
+	clients[i].fd = fd;
+}
+
+static int open_socket(const char *path)
+{
+	struct sockaddr_un addr;
+	int sock;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return -errno;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+	unlink(path);
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(sock, MAX_CLIENTS) < 0) {
+		int err = -errno;
+		close(sock);
+		return err;
+	}
+
+	return sock;
+}
+
+int main(int argc, char **argv)
+{
+	const char *cfgfname = DEFAULT_CFG_FILE;
+	const char *sockname = DEFAULT_SOCKET_PATH;
+	struct sigaction sa;
+	unsigned int i;
+	int sock, c, ret;
+
+	while ((c = getopt_long(argc, argv, "hc:f:S:d:D:",
+				long_options, NULL)) != EOF) {
+		switch (c) {
+		case 'c':
+			cfgfname = optarg;
+			break;
+		case 'f':
+			defenvfile = optarg;
+			break;
+		case 'S':
+			sockname = optarg;
+			break;
+		case 'd':
+			debounce_ms = strtoull(optarg, NULL, 0);
+			break;
+		case 'D':
+			maxdelay_ms = strtoull(optarg, NULL, 0);
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit(0);
+		default:
+			usage(argv[0]);
+			exit(1);
+		}
+	}
+
+	ret = libuboot_read_config_ext(&ctxlist, cfgfname);
+	if (ret) {
+		fprintf(stderr, "Cannot initialize environment\n");
+		exit(1);
+	}
+
+	sock = open_socket(sockname);
+	if (sock < 0) {
+		fprintf(stderr, "Cannot listen on %s: %s\n", sockname, strerror(-sock));
+		libuboot_exit(ctxlist);
+		exit(1);
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sighandler;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	for (i = 0; i < MAX_CLIENTS; i++)
+		clients[i].fd = -1;
+
+	while (!quit) {
+		struct pollfd fds[MAX_CLIENTS + 1 + nnamespaces];
+		uint64_t now, next = UINT64_MAX;
+		int timeout = -1;
+
+		for (i = 0; i < nnamespaces; i++)
+			if (namespaces[i].dirty && namespaces[i].deadline < next)
+				next = namespaces[i].deadline;
+		if (next != UINT64_MAX) {
+			now = now_ms();
+			timeout = next > now ? (int)(next - now) : 0;
+		}
+
+		fds[0].fd = sock;
+		fds[0].events = POLLIN;
+		for (i = 0; i < MAX_CLIENTS; i++) {
+			fds[i + 1].fd = clients[i].fd;
+			fds[i + 1].events = clients[i].out ? POLLOUT : POLLIN;
+			fds[i + 1].revents = 0;
+		}
+		for (i = 0; i < nnamespaces; i++) {
+			fds[MAX_CLIENTS + 1 + i].fd = namespaces[i].watchfd;
+			fds[MAX_CLIENTS + 1 + i].events = POLLIN;
+			fds[MAX_CLIENTS + 1 + i].revents = 0;
+		}
+
+		ret = poll(fds, MAX_CLIENTS + 1 + nnamespaces, timeout);
+		if (ret < 0 && errno != EINTR)
+			break;
+
+		if (ret > 0) {
+			for (i = 0; i < nnamespaces; i++)
+				if (fds[MAX_CLIENTS + 1 + i].revents & POLLIN) {
+					/* clear the event, reload with the pending changes */
+					libuboot_watch_changes(namespaces[i].ctx,
+							       NULL, NULL);
+					reload_namespace(&namespaces[i], NULL);
+				}
+			if (fds[0].revents & POLLIN)
+				accept_client(sock);
+			for (i = 0; i < MAX_CLIENTS; i++) {
+				if (clients[i].fd < 0 || !fds[i + 1].revents)
+					continue;
+				if (clients[i].out)
+					write_client(&clients[i]);
+				else
+					read_client(&clients[i]);
+			}
+		}
+
+		now = now_ms();
+		for (i = 0; i < nnamespaces; i++)
+			if (namespaces[i].dirty && namespaces[i].deadline <= now)
+				flush_namespace(&namespaces[i]);
+
+		/*
+		 * The clients got their answers, erase now what the next
+		 * store would erase (if enabled for the namespace)
+		 */
+		for (i = 0; i < nnamespaces; i++)
+			if (namespaces[i].erase_pending && !namespaces[i].dirty) {
+				libuboot_erase_ahead(namespaces[i].ctx);
+				namespaces[i].erase_pending = false;
+			}
+	}
+
+	for (i = 0; i < MAX_CLIENTS; i++)
+		if (clients[i].fd >= 0)
+			drop_client(&clients[i]);
+	close(sock);
+	unlink(sockname);
+
+	for (i = 0; i < nnamespaces; i++) {
+		flush_namespace(&namespaces[i]);
+		drop_pending(&namespaces[i]);
+		libuboot_close(namespaces[i].ctx);
+	}
+	free(namespaces);
+	libuboot_exit(ctxlist);
+
+	return 0;
+}
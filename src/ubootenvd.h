@@ -0,0 +1,64 @@
+/*
+ * (C) Copyright 2026
+ * Stefano Babic, <stefano.babic@swupdate.org>
+ *
+ * SPDX-License-Identifier:     LGPL-2.1-or-later
+ */
+
+/**
+ * @file ubootenvd.h
+ *
+ * @brief Protocol spoken between ubootenvd and its clients
+ *
+ * Requests are single lines, fields separated by one space:
+ *
+ *	get <namespace> <name>
+ *	set <namespace> <name> <value>
+ *	del <namespace> <name>
+ *	list <namespace>
+ *	store <namespace>
+ *
+ * The value of "set" is the rest of the line and can contain spaces.
+ * Namespace "-" selects the default (first) one.
+ *
+ * Each answer starts with a header line, "OK <items>" or "ERR <errno>",
+ * followed by the items. An item is framed as "<length> <bytes>\n",
+ * so values are transferred unchanged.
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <stddef.h>
+
+#ifndef DEFAULT_SOCKET_PATH
+#define DEFAULT_SOCKET_PATH	"/var/run/ubootenvd.sock"
+#endif
+
+#define UBOOTENVD_DEFAULT_NS	"-"
+
+struct ubootenvd_client {
+	/** connected socket */
+	int fd;
+	/** buffered reader on top of fd */
+	FILE *rx;
+};
+
+typedef void (*ubootenvd_item_cb)(const char *data, size_t len, void *priv);
+
+/*
+ * Framing, shared by the daemon and by the tools printing
+ * in the same format
+ */
+int ubootenvd_put_header(FILE *out, int err, unsigned int items);
+int ubootenvd_put_item(FILE *out, const char *data, size_t len);
+int ubootenvd_put_pair(FILE *out, const char *name, const char *value);
+
+/*
+ * Client side
+ */
+int ubootenvd_connect(struct ubootenvd_client *c, const char *path);
+void ubootenvd_disconnect(struct ubootenvd_client *c);
+int ubootenvd_request(struct ubootenvd_client *c, const char *cmd,
+		      const char *ns, const char *name, const char *value,
+		      ubootenvd_item_cb cb, void *priv);
@@ -0,0 +1,181 @@
+/*
+ * (C) Copyright 2026
+ * Stefano Babic, <stefano.babic@swupdate.org>
+ *
+ * SPDX-License-Identifier:     LGPL-2.1-or-later
+ */
+
+/**
+ * @file ubootenvd_proto.c
+ *
+ * @brief Framing and client side of the ubootenvd protocol
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "ubootenvd.h"
+
+int ubootenvd_put_header(FILE *out, int err, unsigned int items)
+{
+	if (err)
+		return fprintf(out, "ERR %d\n", err < 0 ? -err : err) < 0 ? -EIO : 0;
+
+	return fprintf(out, "OK %u\n", items) < 0 ? -EIO : 0;
+}
+
+int ubootenvd_put_item(FILE *out, const char *data, size_t len)
+{
+	if (fprintf(out, "%zu ", len) < 0)
+		return -EIO;
+	if (len && fwrite(data, 1, len, out) != len)
+		return -EIO;
+	if (fputc('\n', out) == EOF)
+		return -EIO;
+
+	return 0;
+}
+
+int ubootenvd_put_pair(FILE *out, const char *name, const char *value)
+{
+	size_t len = strlen(name) + 1 + strlen(value);
+
+	if (fprintf(out, "%zu %s=%s\n", len, name, value) < 0)
+		return -EIO;
+
+	return 0;
+}
+
+int ubootenvd_connect(struct ubootenvd_client *c, const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	c->fd = -1;
+	c->rx = NULL;
+
+	if (!path)
+		path = DEFAULT_SOCKET_PATH;
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		int err = -errno;
+		close(fd);
+		return err;
+	}
+
+	c->rx = fdopen(fd, "r");
+	if (!c->rx) {
+		close(fd);
+		return -ENOMEM;
+	}
+	c->fd = fd;
+
+	return 0;
+}
+
+void ubootenvd_disconnect(struct ubootenvd_client *c)
+{
+	if (c->rx)
+		fclose(c->rx);	/* closes fd, too */
+	c->rx = NULL;
+	c->fd = -1;
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+	while (len) {
+		ssize_t n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+int ubootenvd_request(struct ubootenvd_client *c, const char *cmd,
+		      const char *ns, const char *name, const char *value,
+		      ubootenvd_item_cb cb, void *priv)
+{
+	char *req = NULL, *line = NULL;
+	size_t linesize = 0;
+	unsigned int items, i;
+	int len, ret, err;
+
+	if (!c->rx)
+		return -ENOTCONN;
+
+	/* requests are line based, a newline cannot be transferred */
+	if ((ns && strpbrk(ns, " \n")) || (name && strpbrk(name, " \n")) ||
+	    (value && strchr(value, '\n')))
+		return -EINVAL;
+
+	len = asprintf(&req, "%s %s%s%s%s%s\n", cmd, ns ? ns : UBOOTENVD_DEFAULT_NS,
+			name ? " " : "", name ? name : "",
+			value ? " " : "", value ? value : "");
+	if (len < 0)
+		return -ENOMEM;
+
+	ret = write_all(c->fd, req, len);
+	free(req);
+	if (ret)
+		return ret;
+
+	if (getline(&line, &linesize, c->rx) < 0) {
+		free(line);
+		return -EPIPE;
+	}
+
+	if (sscanf(line, "ERR %d", &err) == 1) {
+		free(line);
+		return err > 0 ? -err : -EIO;
+	}
+	ret = sscanf(line, "OK %u", &items);
+	free(line);
+	if (ret != 1)
+		return -EPROTO;
+
+	for (i = 0; i < items; i++) {
+		size_t itemlen;
+		char *data;
+
+		if (fscanf(c->rx, "%zu", &itemlen) != 1 || fgetc(c->rx) != ' ')
+			return -EPROTO;
+		data = malloc(itemlen + 1);
+		if (!data)
+			return -ENOMEM;
+		if (fread(data, 1, itemlen, c->rx) != itemlen ||
+		    fgetc(c->rx) != '\n') {
+			free(data);
+			return -EPROTO;
+		}
+		data[itemlen] = '\0';
+		if (cb)
+			cb(data, itemlen, priv);
+		free(data);
+	}
+
+	return 0;
+}
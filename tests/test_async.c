@@ -0,0 +1,205 @@
+/*
+ * (C) Copyright 2026
+ * Stefano Babic, <stefano.babic@swupdate.org>
+ *
+ * SPDX-License-Identifier:     LGPL-2.1-or-later
+ */
+
+/**
+ * @file test_async.c
+ *
+ * @brief Asynchronous stores
+ *
+ * Stores run on simulated NAND flash with a slow erase, so that they
+ * are still in flight when the test goes on: a second store is
+ * refused while one runs, completion is signalled on the eventfd
+ * after the callback, two stores in a row both reach the flash and
+ * libuboot_exit() waits for a store that is in flight.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+
+#include "libuboot.h"
+
+#define SECTOR		0x4000
+#define POLL_MS		5000
+
+static char workdir[] = "/tmp/test-async-XXXXXX";
+static char image[PATH_MAX];
+static char config[PATH_MAX];
+static unsigned int failures;
+
+struct result {
+	unsigned int calls;
+	int result;
+};
+
+#define CHECK(cond, ...) do {						\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s:%d: ", __func__, __LINE__);		\
+		fprintf(stderr, __VA_ARGS__);				\
+		fputc('\n', stderr);					\
+		failures++;						\
+	}								\
+} while (0)
+
+static struct uboot_ctx *setup(void)
+{
+	struct uboot_ctx *ctx = NULL;
+	unsigned int i;
+	FILE *fp;
+
+	fp = fopen(config, "w");
+	if (!fp)
+		return NULL;
+	for (i = 0; i < 2; i++)
+		fprintf(fp, "sim:nand,erasesize=0x%x,pagesize=512,erase_us=100000:%s "
+			"0x%x 0x%x 0x%x 1\n", SECTOR, image, i * SECTOR, SECTOR, SECTOR);
+	if (fclose(fp) || libuboot_read_config_ext(&ctx, config))
+		return NULL;
+
+	return ctx;
+}
+
+static void stored(struct uboot_ctx *ctx, int result, void *priv)
+{
+	struct result *r = priv;
+
+	(void)ctx;
+	r->result = result;
+	__atomic_add_fetch(&r->calls, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Wait on the eventfd, the callback has run by then
+ */
+static int wait_event(int fd)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	uint64_t events;
+
+	if (poll(&pfd, 1, POLL_MS) != 1)
+		return -ETIMEDOUT;
+	if (read(fd, &events, sizeof(events)) != sizeof(events))
+		return -EIO;
+
+	return 0;
+}
+
+static bool load(const char *value)
+{
+	struct uboot_ctx *ctx;
+	char *stored;
+	bool ok;
+
+	ctx = setup();
+	if (!ctx)
+		return false;
+	stored = libuboot_open(ctx) ? NULL : libuboot_get_env(ctx, "count");
+	ok = stored && !strcmp(stored, value);
+	free(stored);
+	libuboot_close(ctx);
+	libuboot_exit(ctx);
+
+	return ok;
+}
+
+static void test_back_to_back(struct uboot_ctx *ctx)
+{
+	struct result r = { 0, -1 };
+	const char *values[] = { "1", "2" };
+	unsigned int i;
+	int fd, ret;
+
+	fd = libuboot_env_store_fd(ctx);
+	CHECK(fd >= 0, "no eventfd: %d", fd);
+	if (fd < 0)
+		return;
+
+	/* a fresh image has no valid copy */
+	libuboot_open(ctx);
+	for (i = 0; i < 2; i++) {
+		r.result = -1;
+		CHECK(!libuboot_set_env(ctx, "count", values[i]), "set %s", values[i]);
+		ret = libuboot_env_store_async(ctx, stored, &r);
+		CHECK(!ret, "store %u not started: %d", i, ret);
+		if (ret)
+			break;
+		ret = libuboot_env_store_async(ctx, stored, &r);
+		CHECK(ret == -EBUSY, "store %u in flight, second one gave %d", i, ret);
+
+		ret = wait_event(fd);
+		CHECK(!ret, "store %u not signalled: %d", i, ret);
+		CHECK(__atomic_load_n(&r.calls, __ATOMIC_ACQUIRE) == i + 1,
+		      "store %u: %u callbacks", i, r.calls);
+		CHECK(!r.result, "store %u: callback result %d", i, r.result);
+		ret = libuboot_env_store_wait(ctx);
+		CHECK(!ret, "store %u: wait result %d", i, ret);
+	}
+	libuboot_close(ctx);
+
+	CHECK(load("2"), "second store not on flash");
+}
+
+static void test_exit_in_flight(void)
+{
+	struct result r = { 0, -1 };
+	struct uboot_ctx *ctx;
+	int ret;
+
+	ctx = setup();
+	CHECK(ctx, "cannot set up");
+	if (!ctx)
+		return;
+
+	CHECK(!libuboot_open(ctx), "open");
+	CHECK(!libuboot_set_env(ctx, "count", "3"), "set");
+	ret = libuboot_env_store_async(ctx, stored, &r);
+	CHECK(!ret, "store not started: %d", ret);
+	libuboot_exit(ctx);
+
+	CHECK(__atomic_load_n(&r.calls, __ATOMIC_ACQUIRE) == (ret ? 0 : 1),
+	      "%u callbacks after exit", r.calls);
+	CHECK(!ret && !r.result, "callback result %d", r.result);
+	CHECK(load("3"), "store in flight at exit not on flash");
+}
+
+int main(void)
+{
+	struct uboot_ctx *ctx;
+	char cache[PATH_MAX + sizeof(".cache")];
+
+	if (!mkdtemp(workdir)) {
+		fprintf(stderr, "cannot create %s\n", workdir);
+		return 1;
+	}
+	snprintf(image, sizeof(image), "%s/flash.img", workdir);
+	snprintf(config, sizeof(config), "%s/fw_env.config", workdir);
+	snprintf(cache, sizeof(cache), "%s.cache", config);
+
+	ctx = setup();
+	CHECK(ctx, "cannot set up");
+	if (ctx) {
+		test_back_to_back(ctx);
+		libuboot_exit(ctx);
+		test_exit_in_flight();
+	}
+
+	unlink(cache);
+	unlink(config);
+	unlink(image);
+	rmdir(workdir);
+	printf("failures=%u\n", failures);
+
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,163 @@
+/*
+ * (C) Copyright 2026
+ * Stefano Babic, <stefano.babic@swupdate.org>
+ *
+ * SPDX-License-Identifier:     LGPL-2.1-or-later
+ */
+
+/**
+ * @file test_crc_update.c
+ *
+ * @brief Incremental CRC against zlib
+ *
+ * Random buffers are edited as a store does (values changed in
+ * place, values growing or shrinking and moving the rest of the
+ * environment) and the CRC from crc32_update() must be the one
+ * computed by crc32() on the whole buffer.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "common.h"
+
+#define ROUNDS	2000
+
+static uint64_t seed = 0x2545F4914F6CDD1DULL;
+
+static uint32_t rnd(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 7;
+	seed ^= seed << 17;
+
+	return (uint32_t)seed;
+}
+
+static void fill(uint8_t *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = rnd();
+}
+
+enum edit {
+	EDIT_FIRST,
+	EDIT_LAST,
+	EDIT_RANDOM,
+	EDIT_RANGES,
+	EDIT_GROW,
+	EDIT_SHRINK,
+	EDIT_NONE,
+	EDIT_COUNT
+};
+
+static const char * const edit_names[EDIT_COUNT] = {
+	"first byte", "last byte", "random byte", "ranges", "grow",
+	"shrink", "none"
+};
+
+/*
+ * Apply an edit to a copy of old. Return true if it is small
+ * enough that the incremental CRC is expected to be used.
+ */
+static bool edit(enum edit e, const uint8_t *old, uint8_t *data, size_t len)
+{
+	size_t pos, n, i;
+
+	memcpy(data, old, len);
+	switch (e) {
+	case EDIT_FIRST:
+		data[0] ^= 1 + rnd() % 255;
+		return true;
+	case EDIT_LAST:
+		data[len - 1] ^= 1 + rnd() % 255;
+		return true;
+	case EDIT_RANDOM:
+		data[rnd() % len] ^= 1 + rnd() % 255;
+		return true;
+	case EDIT_RANGES:
+		n = 1 + rnd() % 8;
+		for (i = 0; i < n; i++) {
+			pos = rnd() % len;
+			data[pos] ^= 1 + rnd() % 255;
+			if (pos + 1 < len)
+				data[pos + 1] = rnd();
+		}
+		return false;
+	case EDIT_GROW:
+		/* insert bytes, the end of the buffer is lost */
+		pos = rnd() % len;
+		n = 1 + rnd() % 4;
+		if (n > len - pos)
+			n = len - pos;
+		memmove(data + pos + n, old + pos, len - pos - n);
+		fill(data + pos, n);
+		return false;
+	case EDIT_SHRINK:
+		/* drop bytes, the end of the buffer is padded */
+		pos = rnd() % len;
+		n = 1 + rnd() % 4;
+		if (n > len - pos)
+			n = len - pos;
+		memmove(data + pos, old + pos + n, len - pos - n);
+		memset(data + len - n, 0xFF, n);
+		return false;
+	default:
+		return true;
+	}
+}
+
+int main(void)
+{
+	static const size_t sizes[] = { 1, 63, 64, 65, 1000, 0x2000 - 5, 0x4000 - 5 };
+	unsigned int incremental = 0, failures = 0;
+	uint8_t *old, *data;
+	uint32_t oldcrc, crc, ref;
+	size_t crcbytes, len;
+	unsigned int s, r;
+	enum edit e;
+	bool small;
+
+	old = malloc(0x4000);
+	data = malloc(0x4000);
+	if (!old || !data)
+		return 1;
+
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		len = sizes[s];
+		for (r = 0; r < ROUNDS; r++) {
+			e = r % EDIT_COUNT;
+			fill(old, len);
+			oldcrc = crc32(0, old, len);
+			small = edit(e, old, data, len);
+			ref = crc32(0, data, len);
+
+			if (!crc32_update(old, oldcrc, data, len, &crc, &crcbytes)) {
+				if (small && len >= 4 * 64) {
+					fprintf(stderr, "size %zu, %s: not updated incrementally\n",
+						len, edit_names[e]);
+					failures++;
+				}
+				continue;
+			}
+			incremental++;
+			if (crc != ref || crcbytes > 2 * len) {
+				fprintf(stderr, "size %zu, %s: CRC %08x, expected %08x\n",
+					len, edit_names[e], crc, ref);
+				failures++;
+			}
+		}
+	}
+
+	printf("incremental=%u failures=%u\n", incremental, failures);
+	free(old);
+	free(data);
+
+	return failures ? 1 : 0;
+}
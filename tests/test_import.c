@@ -0,0 +1,81 @@
+/*
+ * (C) Copyright 2026
+ * Stefano Babic, <stefano.babic@swupdate.org>
+ *
+ * SPDX-License-Identifier:     LGPL-2.1-or-later
+ */
+
+/**
+ * @file test_import.c
+ *
+ * @brief Text environment import
+ *
+ * Scripts and default environments are imported by the same parser:
+ * a backslash at the end of a line continues the value, any other
+ * backslash is kept, DOS line endings are dropped and an empty
+ * value deletes the variable.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libuboot.h"
+
+static const char script[] =
+	"# comment\n"
+	"re=^a\\d+$\n"
+	"path=C:\\dir\\file\n"
+	"bootcmd=run a\\; run b\n"
+	"multi=one\\\ntwo\n"
+	"dos=value\r\n"
+	"doscont=a\\\r\nb\r\n"
+	"noequal\n"
+	"gone=1\n"
+	"gone=\n"
+	"last=x";
+
+static const struct {
+	const char *name;
+	const char *value;
+} expected[] = {
+	{ "re", "^a\\d+$" },
+	{ "path", "C:\\dir\\file" },
+	{ "bootcmd", "run a\\; run b" },
+	{ "multi", "one\ntwo" },
+	{ "dos", "value" },
+	{ "doscont", "a\nb" },
+	{ "noequal", NULL },
+	{ "gone", NULL },
+	{ "last", "x" },
+};
+
+int main(void)
+{
+	struct uboot_ctx *ctx;
+	unsigned int i, failures = 0;
+	char *value;
+
+	if (libuboot_initialize(&ctx, NULL) ||
+	    libuboot_load_env_mem(ctx, script, strlen(script))) {
+		fprintf(stderr, "cannot import the script\n");
+		return 1;
+	}
+
+	for (i = 0; i < sizeof(expected) / sizeof(expected[0]); i++) {
+		value = libuboot_get_env(ctx, expected[i].name);
+		if (expected[i].value ? !value || strcmp(value, expected[i].value) :
+		    value != NULL) {
+			fprintf(stderr, "%s: \"%s\", expected \"%s\"\n", expected[i].name,
+				value ? value : "(none)",
+				expected[i].value ? expected[i].value : "(none)");
+			failures++;
+		}
+		free(value);
+	}
+
+	libuboot_exit(ctx);
+	printf("checked=%u failures=%u\n", i, failures);
+
+	return failures ? 1 : 0;
+}
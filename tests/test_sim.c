@@ -0,0 +1,328 @@
+/*
+ * (C) Copyright 2026
+ * Stefano Babic, <stefano.babic@swupdate.org>
+ *
+ * SPDX-License-Identifier:     LGPL-2.1-or-later
+ */
+
+/**
+ * @file test_sim.c
+ *
+ * @brief Store and load on simulated NOR and NAND flash
+ *
+ * A redundant environment is kept on sim devices in a scratch
+ * directory: the flags of the copies must toggle at each store, a
+ * bad block on NAND must be skipped, the erase must be skipped on
+ * blank NOR sectors and on NAND only for a copy erased ahead under
+ * the lock, and a read-only open must leave the image alone.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "libuboot.h"
+
+#define SECTOR		0x4000
+#define FLAGS_OFFSET	4
+
+static char workdir[] = "/tmp/test-sim-XXXXXX";
+static char image[PATH_MAX];
+static char config[PATH_MAX];
+static unsigned int failures;
+
+#define CHECK(cond, ...) do {						\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s:%d: ", __func__, __LINE__);		\
+		fprintf(stderr, __VA_ARGS__);				\
+		fputc('\n', stderr);					\
+		failures++;						\
+	}								\
+} while (0)
+
+/*
+ * Two copies on a fresh image, each one of nsectors erase blocks
+ */
+static struct uboot_ctx *setup(const char *type, const char *opts,
+			       unsigned int nsectors)
+{
+	struct uboot_ctx *ctx = NULL;
+	unsigned int i;
+	FILE *fp;
+
+	unlink(image);
+	fp = fopen(config, "w");
+	if (!fp)
+		return NULL;
+	for (i = 0; i < 2; i++)
+		fprintf(fp, "sim:%s,erasesize=0x%x%s%s:%s 0x%x 0x%x 0x%x %u\n",
+			type, SECTOR, *opts ? "," : "", opts, image,
+			i * nsectors * SECTOR, SECTOR, SECTOR, nsectors);
+	if (fclose(fp) || libuboot_read_config_ext(&ctx, config))
+		return NULL;
+
+	return ctx;
+}
+
+static void teardown(struct uboot_ctx *ctx)
+{
+	char cache[PATH_MAX + sizeof(".cache")];
+
+	libuboot_exit(ctx);
+	snprintf(cache, sizeof(cache), "%s.cache", config);
+	unlink(cache);
+	unlink(config);
+	unlink(image);
+}
+
+static int store(struct uboot_ctx *ctx, unsigned int value)
+{
+	char buf[16];
+	int ret;
+
+	snprintf(buf, sizeof(buf), "%u", value);
+	libuboot_open(ctx);
+	ret = libuboot_set_env(ctx, "count", buf);
+	if (!ret)
+		ret = libuboot_env_store(ctx);
+	libuboot_close(ctx);
+
+	return ret;
+}
+
+static bool load(struct uboot_ctx *ctx, unsigned int value)
+{
+	char buf[16];
+	char *stored;
+	bool ok;
+
+	snprintf(buf, sizeof(buf), "%u", value);
+	if (libuboot_open(ctx))
+		return false;
+	stored = libuboot_get_env(ctx, "count");
+	ok = stored && !strcmp(stored, buf);
+	free(stored);
+	libuboot_close(ctx);
+
+	return ok;
+}
+
+static int read_image(off_t offset, void *buf, size_t len)
+{
+	ssize_t n;
+	int fd;
+
+	fd = open(image, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	n = pread(fd, buf, len, offset);
+	close(fd);
+
+	return n == (ssize_t)len ? 0 : -EIO;
+}
+
+static void sum_counters(struct uboot_ctx *ctx, struct libuboot_flash_counters *c)
+{
+	struct libuboot_flash_counters copy;
+	unsigned int i;
+
+	memset(c, 0, sizeof(*c));
+	for (i = 0; i < 2; i++) {
+		if (libuboot_get_flash_counters(ctx, i, &copy))
+			continue;
+		c->erases += copy.erases;
+		c->badblocks += copy.badblocks;
+		c->erases_skipped += copy.erases_skipped;
+		c->erases_skipped_nand += copy.erases_skipped_nand;
+	}
+}
+
+/*
+ * NOR marks the new copy active (1) and the old one obsolete (0),
+ * NAND gives the new copy the next counter
+ */
+static void test_toggle(const char *type)
+{
+	bool nand = !strcmp(type, "nand");
+	struct uboot_ctx *ctx;
+	uint8_t flags[2];
+	int newest, last = -1;
+	unsigned int i;
+
+	ctx = setup(type, nand ? "pagesize=512" : "", 1);
+	CHECK(ctx, "%s: cannot set up", type);
+	if (!ctx)
+		return;
+
+	for (i = 0; i < 6; i++) {
+		CHECK(!store(ctx, i), "%s: store %u failed", type, i);
+		CHECK(load(ctx, i), "%s: load %u failed", type, i);
+		if (read_image(FLAGS_OFFSET, &flags[0], 1) ||
+		    read_image(SECTOR + FLAGS_OFFSET, &flags[1], 1)) {
+			CHECK(0, "%s: cannot read the flags", type);
+			break;
+		}
+		/* the first store leaves the other copy blank */
+		if (i < 1)
+			continue;
+		if (nand) {
+			newest = (uint8_t)(flags[1] + 1) == flags[0] ? 0 : 1;
+			CHECK((uint8_t)(flags[!newest] + 1) == flags[newest],
+			      "nand: store %u flags %u/%u", i, flags[0], flags[1]);
+		} else {
+			newest = flags[0] == 1 ? 0 : 1;
+			CHECK(flags[newest] == 1 && flags[!newest] == 0,
+			      "nor: store %u flags %u/%u", i, flags[0], flags[1]);
+		}
+		CHECK(newest != last, "%s: store %u wrote copy %d again", type, i, newest);
+		last = newest;
+	}
+
+	teardown(ctx);
+}
+
+/*
+ * Each copy spans two blocks, the first block of the image is bad
+ */
+static void test_badblock(void)
+{
+	struct libuboot_flash_counters c;
+	struct uboot_ctx *ctx;
+	uint8_t buf[64];
+	unsigned int i;
+
+	ctx = setup("nand", "pagesize=512,bad=0", 2);
+	CHECK(ctx, "cannot set up");
+	if (!ctx)
+		return;
+
+	for (i = 0; i < 2; i++)
+		CHECK(!store(ctx, i), "store %u failed", i);
+	CHECK(load(ctx, 1), "load failed");
+
+	sum_counters(ctx, &c);
+	CHECK(c.badblocks > 0, "bad block not skipped");
+	CHECK(!read_image(0, buf, sizeof(buf)), "cannot read the image");
+	for (i = 0; i < sizeof(buf); i++)
+		if (buf[i] != 0xff)
+			break;
+	CHECK(i == sizeof(buf), "bad block programmed");
+
+	teardown(ctx);
+}
+
+static void test_erase_skip(void)
+{
+	struct libuboot_flash_counters before, after;
+	struct uboot_ctx *ctx;
+
+	/* NOR: a blank sector is not erased */
+	ctx = setup("nor", "", 1);
+	CHECK(ctx, "nor: cannot set up");
+	if (ctx) {
+		CHECK(!store(ctx, 1), "nor: store failed");
+		sum_counters(ctx, &after);
+		CHECK(after.erases_skipped == 1 && after.erases == 0,
+		      "nor: erases %llu skipped %llu", after.erases, after.erases_skipped);
+		teardown(ctx);
+	}
+
+	/* NAND: blank blocks are erased anyway */
+	ctx = setup("nand", "pagesize=512", 1);
+	CHECK(ctx, "nand: cannot set up");
+	if (!ctx)
+		return;
+	CHECK(!store(ctx, 1), "nand: store failed");
+	sum_counters(ctx, &after);
+	CHECK(after.erases == 1 && !after.erases_skipped && !after.erases_skipped_nand,
+	      "nand: erases %llu skipped %llu/%llu", after.erases,
+	      after.erases_skipped, after.erases_skipped_nand);
+	CHECK(!store(ctx, 2), "nand: store failed");
+
+	/* without the lock nothing is erased ahead */
+	CHECK(!libuboot_set_erase_ahead(ctx, 1), "cannot enable erase ahead");
+	sum_counters(ctx, &before);
+	CHECK(!libuboot_erase_ahead(ctx), "nand: erase ahead failed");
+	sum_counters(ctx, &after);
+	CHECK(after.erases == before.erases, "nand: erased ahead without the lock");
+
+	/* the lock is released in between, the store erases again */
+	libuboot_open(ctx);
+	CHECK(!libuboot_erase_ahead(ctx), "nand: erase ahead failed");
+	libuboot_close(ctx);
+	CHECK(!store(ctx, 3), "nand: store failed");
+	sum_counters(ctx, &after);
+	CHECK(after.erases == before.erases + 2 &&
+	      after.erases_skipped_nand == before.erases_skipped_nand,
+	      "nand: erases %llu->%llu skipped %llu->%llu", before.erases,
+	      after.erases, before.erases_skipped_nand, after.erases_skipped_nand);
+
+	/* erased ahead under the lock, the store only programs */
+	libuboot_open(ctx);
+	sum_counters(ctx, &before);
+	CHECK(!libuboot_erase_ahead(ctx), "nand: erase ahead failed");
+	CHECK(!libuboot_set_env(ctx, "count", "4") && !libuboot_env_store(ctx),
+	      "nand: store failed");
+	sum_counters(ctx, &after);
+	libuboot_close(ctx);
+	CHECK(after.erases == before.erases + 1 &&
+	      after.erases_skipped_nand == before.erases_skipped_nand + 1,
+	      "nand: erases %llu->%llu skipped %llu->%llu", before.erases,
+	      after.erases, before.erases_skipped_nand, after.erases_skipped_nand);
+	CHECK(load(ctx, 4), "nand: load failed");
+
+	teardown(ctx);
+}
+
+/*
+ * The image is truncated after the configuration created it:
+ * loading must not extend it again
+ */
+static void test_readonly(void)
+{
+	struct uboot_ctx *ctx;
+	struct stat st;
+
+	ctx = setup("nor", "", 1);
+	CHECK(ctx, "cannot set up");
+	if (!ctx)
+		return;
+
+	CHECK(!truncate(image, 0), "cannot truncate the image");
+	libuboot_open(ctx);
+	libuboot_close(ctx);
+	CHECK(!stat(image, &st) && st.st_size == 0,
+	      "read-only open changed the image");
+
+	teardown(ctx);
+}
+
+int main(void)
+{
+	if (!mkdtemp(workdir)) {
+		fprintf(stderr, "cannot create %s\n", workdir);
+		return 1;
+	}
+	snprintf(image, sizeof(image), "%s/flash.img", workdir);
+	snprintf(config, sizeof(config), "%s/fw_env.config", workdir);
+
+	test_toggle("nor");
+	test_toggle("nand");
+	test_badblock();
+	test_erase_skip();
+	test_readonly();
+
+	rmdir(workdir);
+	printf("failures=%u\n", failures);
+
+	return failures ? 1 : 0;
+}